@@ -7,26 +7,61 @@
 //
 
 #include "Voronoi2D.h"
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <type_traits>
+
+#ifdef __FAST_MATH__
+#error "Voronoi2D.cpp needs IEEE rounding for its exact orientation test, build it without -ffast-math"
+#endif
 
 using namespace std;
 using namespace Voronoi;
 
-void Voronoi2D::generate_voronoi_2D(float * points, int num_points, void (*render)(vector<HalfEdge2D *>, float), void (*sleep)()) {
+template <typename Scalar>
+void Voronoi2D<Scalar>::generate_voronoi_2D(Scalar * points, int num_points, void (*render)(const vector<Point2D<Scalar>> &, const vector<Edge2D> &, Scalar), void (*sleep)()) {
     
-    bool should_render = false;
+    reset_sweep();
+    set_bounds(points, num_points);
+    
+    for (int i = 0; i < num_points; i++) {
+        Point2D<Scalar> site = Point2D<Scalar>(points[2 * i], points[2 * i + 1]);
+        site_event_queue.push(site);
+    }
     
-    X0 = Y0 = 1;
-    X1 = Y1 = 0;
+    sweep(render, sleep);
+}
+
+// Everything from the last call is reused, not freed.
+template <typename Scalar>
+void Voronoi2D<Scalar>::reset_sweep() {
     
     beach_head = NULL;
-    //voronoi_vertices.clear();
+    voronoi_vertices.clear();
     voronoi_edges.clear();
+    voronoi_edge_sites.clear();
     while (!circle_event_queue.empty()) {
         circle_event_queue.pop();
     }
+    while (!site_event_queue.empty()) {
+        site_event_queue.pop();
+    }
+    arcs.reset();
+    arc_links.reset();
+    circle_events.reset();
+    for (int i = 0; i < MAX_SKIPLIST_HEIGHT; i++) {
+        free_arcs[i].clear();
+    }
+    free_circle_events.clear();
     sweep_line = 0;
+}
+
+template <typename Scalar>
+void Voronoi2D<Scalar>::set_bounds(Scalar * points, int num_points) {
     
-    priority_queue<Point2D, vector<Point2D>, PriorityQueueCompare> site_event_queue;
+    X0 = X1 = num_points > 0 ? points[0] : 0;
+    Y0 = Y1 = num_points > 0 ? points[1] : 0;
     
     for (int i = 0; i < num_points; i++) {
         
@@ -34,286 +69,1256 @@ void Voronoi2D::generate_voronoi_2D(float * points, int num_points, void (*rende
         if (points[2 * i] > X1) {X1 = points[2 * i];}
         if (points[2 * i + 1] < Y0) {Y0 = points[2 * i + 1];}
         if (points[2 * i + 1] > Y1) {Y1 = points[2 * i + 1];}
-        
-        Point2D site = Point2D(points[2 * i], points[2 * i + 1]);
-        site_event_queue.push(site);
+    }
+    
+    // The coordinates are only as precise as the largest of them, not the size of the box.
+    Scalar largest = max(max(fabs(X0), fabs(X1)), max(fabs(Y0), fabs(Y1)));
+    Scalar size = X1 - X0 + Y1 - Y0;
+    if (size == 0) {
+        size = largest + 1;
     }
     
     // Add margins to the bounding box.
-    float dx = (X1-X0+1)/5.0, dy = (Y1-Y0+1)/5.0;
-    X0 -= dx;  X1 += dx;  Y0 -= dy;  Y1 += dy;
+    Scalar margin = size / 5;
+    X0 -= margin;  X1 += margin;  Y0 -= margin;  Y1 += margin;
+    
+    // Sites this close to a breakpoint, and circle events this close to a site, are treated as exact hits.
+    tolerance = 4 * numeric_limits<Scalar>::epsilon() * (size + largest);
     
     //cout << X0 << ", " << X1 << ", " << Y0 << ", " << Y1 << "\n";
+}
+
+// Sweeps the sites in site_event_queue.
+template <typename Scalar>
+void Voronoi2D<Scalar>::sweep(void (*render)(const vector<Point2D<Scalar>> &, const vector<Edge2D> &, Scalar), void (*sleep)()) {
+    
+    bool should_render = false;
+    
+    Point2D<Scalar> last_site;
     
     while (!site_event_queue.empty() || !circle_event_queue.empty()) {
         
         //cout << "[" << site_event_queue.size() << ", " << circle_event_queue.size() << "]\n";
         
-        if (site_event_queue.empty() || (!circle_event_queue.empty() && circle_event_queue.top()->right_most_x < site_event_queue.top().x)) {
+        if (site_event_queue.empty() || circle_event_is_next()) {
             
-            CircleEvent2D * circle = circle_event_queue.top();
+            // Pop before handling, the event is recycled and new ones may go on top.
+            CircleEvent2D<Scalar> * circle = circle_event_queue.top();
+            circle_event_queue.pop();
             sweep_line = circle->right_most_x;
             handle_circle_event(circle);
-            circle_event_queue.pop();
         }
         else {
-            Point2D site = site_event_queue.top();
+            Point2D<Scalar> site = site_event_queue.top();
+            site_event_queue.pop();
+            
+            // Sites come out sorted, so a repeated site is right after the first one.
+            if (beach_head != NULL && site.x == last_site.x && site.y == last_site.y) {continue;}
+            
             sweep_line = site.x;
+            last_site = site;
             handle_site_event(site);
-            site_event_queue.pop();
         }
         
         if (should_render) {
-            render(voronoi_edges, sweep_line);
+            render(voronoi_vertices, voronoi_edges, sweep_line);
             sleep();
         }
         
     }
     
-    sweep_line = 2 * (X1 + (X1 - X0) + (Y1 - Y0));
+    sweep_line = X1 + 2 * ((X1 - X0) + (Y1 - Y0));
+    num_finite_vertices = (unsigned int)voronoi_vertices.size();
+    
+    if (beach_head == NULL) {
+        return;
+    }
     
-    for (Arc2D * arc = beach_head; arc->next != NULL; arc = arc->next) {
-        if (arc->s1 != NULL) {
-            //cout << arc->location << arc->next->location << sweep_line << "\n";
-            arc->s1->finish(parabolic_intersection(arc->location, arc->next->location));
+    for (Arc2D<Scalar> * arc = beach_head; arc->next[0] != NULL; arc = arc->next[0]) {
+        if (arc->s1 >= 0) {
+            //cout << arc->location << arc->next[0]->location << sweep_line << "\n";
+            finish_edge(arc->s1, add_vertex(parabolic_intersection(arc->location, arc->next[0]->location)));
             
             if (should_render) {
-                render(voronoi_edges, sweep_line);
+                render(voronoi_vertices, voronoi_edges, sweep_line);
                 sleep();
             }
         }
     }
+    
+    // The arcs go back with the arena on the next call.
+    beach_head = NULL;
 }
 
-void Voronoi2D::handle_site_event(Point2D site) {
+// hi + lo is exactly a * b.
+template <typename Scalar>
+static void two_product(Scalar a, Scalar b, Scalar & hi, Scalar & lo) {
     
-    //cout << "Handle site event " << site;
+    hi = a * b;
+    lo = fma(a, b, -hi);
+}
+
+// Adds b to the n components of e, smallest first, without rounding. Returns the new number of components.
+template <typename Scalar>
+static int grow_expansion(Scalar * e, int n, Scalar b) {
     
-    if (beach_head == NULL) {
-        beach_head = new Arc2D(site);
+    int m = 0;
+    Scalar q = b;
+    for (int i = 0; i < n; i++) {
+        Scalar sum = q + e[i];
+        Scalar b_virtual = sum - q;
+        Scalar error = (q - (sum - b_virtual)) + (e[i] - b_virtual);
+        if (error != 0) {e[m++] = error;}
+        q = sum;
+    }
+    if (q != 0) {e[m++] = q;}
+    return m;
+}
+
+/*
+ *  Positive if abc turns counterclockwise, negative if it turns clockwise and 0 if the
+ *  points are on a line. The sign is always right, rounding only costs time when the
+ *  points are nearly on a line (Shewchuk, Adaptive Precision Floating-Point Arithmetic).
+ */
+template <typename Scalar>
+static int orientation(Point2D<Scalar> a, Point2D<Scalar> b, Point2D<Scalar> c) {
+    
+    Scalar left = (b.x - a.x) * (c.y - a.y);
+    Scalar right = (c.x - a.x) * (b.y - a.y);
+    Scalar det = left - right;
+    
+    Scalar eps = numeric_limits<Scalar>::epsilon() / 2;
+    Scalar bound = (3 + 16 * eps) * eps * (fabs(left) + fabs(right));
+    if (det > bound) {return 1;}
+    if (-det > bound) {return -1;}
+    
+    // Expand the six products of the coordinates exactly and take the sign of the largest part.
+    Scalar terms[6][2] = {{a.x, b.y}, {-a.x, c.y}, {b.x, c.y}, {-b.x, a.y}, {c.x, a.y}, {-c.x, b.y}};
+    Scalar e[24];
+    int n = 0;
+    for (int i = 0; i < 6; i++) {
+        Scalar hi, lo;
+        two_product(terms[i][0], terms[i][1], hi, lo);
+        n = grow_expansion(e, n, lo);
+        n = grow_expansion(e, n, hi);
+    }
+    return n == 0 ? 0 : (e[n - 1] > 0 ? 1 : -1);
+}
+
+/*
+ *  Positive if d is inside the circle through the counterclockwise a, b and c, negative if
+ *  it is outside, and 0 if that can not be told in Eval.
+ */
+template <typename Eval, typename Scalar>
+static int in_circle(Point2D<Scalar> a, Point2D<Scalar> b, Point2D<Scalar> c, Point2D<Scalar> d) {
+    
+    Eval adx = (Eval)a.x - d.x, ady = (Eval)a.y - d.y;
+    Eval bdx = (Eval)b.x - d.x, bdy = (Eval)b.y - d.y;
+    Eval cdx = (Eval)c.x - d.x, cdy = (Eval)c.y - d.y;
+    
+    Eval bdxcdy = bdx * cdy, cdxbdy = cdx * bdy, alift = adx * adx + ady * ady;
+    Eval cdxady = cdx * ady, adxcdy = adx * cdy, blift = bdx * bdx + bdy * bdy;
+    Eval adxbdy = adx * bdy, bdxady = bdx * ady, clift = cdx * cdx + cdy * cdy;
+    
+    Eval det = alift * (bdxcdy - cdxbdy) + blift * (cdxady - adxcdy) + clift * (adxbdy - bdxady);
+    Eval permanent = (fabs(bdxcdy) + fabs(cdxbdy)) * alift + (fabs(cdxady) + fabs(adxcdy)) * blift + (fabs(adxbdy) + fabs(bdxady)) * clift;
+    
+    Eval eps = numeric_limits<Eval>::epsilon() / 2;
+    Eval bound = (10 + 96 * eps) * eps * permanent;
+    if (det > bound) {return 1;}
+    if (-det > bound) {return -1;}
+    return 0;
+}
+
+/*
+ *  Does the circle event on top go before the next site? When the two are too close to
+ *  tell apart by x, the site goes first only if it is inside the circle of the event,
+ *  since then it would have cut the arc of the event off first.
+ */
+template <typename Scalar>
+bool Voronoi2D<Scalar>::circle_event_is_next() {
+    
+    if (circle_event_queue.empty()) {
+        return false;
+    }
+    
+    CircleEvent2D<Scalar> * event = circle_event_queue.top();
+    Point2D<Scalar> site = site_event_queue.top();
+    
+    if (event->right_most_x < site.x - tolerance) {return true;}
+    if (event->right_most_x > site.x + tolerance || !event->is_valid) {return event->right_most_x < site.x;}
+    
+    // The arcs of an event turn clockwise, so they go the other way around for in_circle.
+    Arc2D<Scalar> * arc = event->arc;
+    Point2D<Scalar> a = arc->next[0]->location, b = arc->location, c = arc->prev[0]->location;
+    
+    int inside = in_circle<Scalar>(a, b, c, site);
+    if (inside == 0) {
+        typedef typename conditional<is_same<Scalar, float>::value, double, long double>::type Wider;
+        inside = in_circle<Wider>(a, b, c, site);
+    }
+    return inside <= 0;
+}
+
+namespace Voronoi {
+    
+    /*
+     *  The sites one strip of generate_voronoi_2D_parallel owns. They are split into columns
+     *  about four site spacings wide and sorted by column and then by y, so the sites of a
+     *  column between two heights are next to each other.
+     */
+    template <typename Scalar>
+    struct Strip2D {
+        
+        // The strip owns the sites with lo <= x < hi.
+        Scalar lo, hi;
+        
+        vector<Point2D<Scalar>> sites;
+        
+        // Column c is sites[column_start[c]] up to sites[column_start[c + 1]], from column_lo[c] to column_hi[c] in x.
+        vector<int> column_start;
+        vector<Scalar> column_lo, column_hi;
+        
+        // Mean distance between the sites.
+        Scalar spacing;
+        
+        vector<Point2D<Scalar>> hull;
+    };
+}
+
+template <typename Scalar>
+static bool lower_y(const Point2D<Scalar> & left, const Point2D<Scalar> & right) {return left.y < right.y;}
+
+// Twice the area of the triangle abc, positive if it turns counterclockwise.
+template <typename Scalar>
+static double turn(Point2D<Scalar> a, Point2D<Scalar> b, Point2D<Scalar> c) {
+    
+    return ((double)b.x - a.x) * ((double)c.y - a.y) - ((double)c.x - a.x) * ((double)b.y - a.y);
+}
+
+// Andrew's monotone chain. The sites must be sorted, and sites on an edge of the hull are left out.
+template <typename Scalar>
+static void convex_hull(const vector<Point2D<Scalar>> & sites, vector<Point2D<Scalar>> & hull) {
+    
+    if (sites.size() < 3) {
+        hull = sites;
         return;
     }
     
-    Arc2D * i;
+    hull.resize(2 * sites.size());
+    
+    size_t k = 0;
+    for (size_t i = 0; i < sites.size(); i++) {
+        while (k >= 2 && turn(hull[k - 2], hull[k - 1], sites[i]) <= 0) {k--;}
+        hull[k++] = sites[i];
+    }
+    for (size_t i = sites.size() - 1, t = k + 1; i > 0; i--) {
+        while (k >= t && turn(hull[k - 2], hull[k - 1], sites[i - 1]) <= 0) {k--;}
+        hull[k++] = sites[i - 1];
+    }
+    
+    hull.resize(k - 1);
+}
+
+// Collects the sites with strip->lo <= x < strip->hi, finds their hull and sorts them into columns.
+template <typename Scalar>
+static void build_strip(Strip2D<Scalar> * strip, Scalar * points, int num_points) {
+    
+    vector<Point2D<Scalar>> & sites = strip->sites;
+    sites.clear();
+    strip->column_start.clear();
+    strip->column_lo.clear();
+    strip->column_hi.clear();
+    strip->hull.clear();
+    strip->spacing = 0;
     
-    Point2D z, zz;
+    Scalar y0 = numeric_limits<Scalar>::max(), y1 = -numeric_limits<Scalar>::max();
     
-    for (i = beach_head; i != NULL; i = i->next) {
+    for (int i = 0; i < num_points; i++) {
+        if (points[2 * i] >= strip->lo && points[2 * i] < strip->hi) {
+            sites.push_back(Point2D<Scalar>(points[2 * i], points[2 * i + 1]));
+            y0 = min(y0, points[2 * i + 1]);
+            y1 = max(y1, points[2 * i + 1]);
+        }
+    }
+    
+    if (sites.empty()) {
+        strip->column_start.push_back(0);
+        return;
+    }
+    
+    sort(sites.begin(), sites.end());
+    convex_hull(sites, strip->hull);
+    
+    Scalar x0 = sites.front().x, x1 = sites.back().x;
+    double spacing = sqrt((double)(x1 - x0) * (y1 - y0) / sites.size());
+    strip->spacing = spacing;
+    int num_columns = spacing > 0 ? (int)min((double)sites.size(), (x1 - x0) / (4 * spacing)) + 1 : 1;
+    Scalar width = (x1 - x0) / num_columns;
+    
+    // Only columns with sites in them are kept.
+    int column = -1;
+    for (int i = 0; i < sites.size(); i++) {
+        int c = width > 0 ? min(num_columns - 1, (int)((sites[i].x - x0) / width)) : 0;
+        if (c != column) {
+            strip->column_start.push_back(i);
+            strip->column_lo.push_back(sites[i].x);
+            strip->column_hi.push_back(sites[i].x);
+            column = c;
+        }
+        strip->column_hi.back() = sites[i].x;
+    }
+    strip->column_start.push_back((int)sites.size());
+    
+    for (int c = 0; c + 1 < strip->column_start.size(); c++) {
+        sort(sites.begin() + strip->column_start[c], sites.begin() + strip->column_start[c + 1], lower_y<Scalar>);
+    }
+}
+
+// Is there a site of the strip, other than the ones from cover_lo to cover_hi in x, closer than r - margin to the center?
+template <typename Scalar>
+static bool has_site_in_circle(const Strip2D<Scalar> & strip, Point2D<Scalar> center, double r, double margin, Scalar cover_lo, Scalar cover_hi) {
+    
+    if (r <= margin) {
+        return false;
+    }
+    
+    double inside = (r - margin) * (r - margin);
+    
+    size_t c = lower_bound(strip.column_lo.begin(), strip.column_lo.end(), center.x - r) - strip.column_lo.begin();
+    if (c > 0 && strip.column_hi[c - 1] >= center.x - r) {c--;}
+    
+    for (; c < strip.column_lo.size() && strip.column_lo[c] <= center.x + r; c++) {
+        
+        if (strip.column_lo[c] >= cover_lo && strip.column_hi[c] < cover_hi) {continue;}
+        
+        // The circle is from center.y - dy to center.y + dy over the whole column.
+        double dx = max(0.0, max(strip.column_lo[c] - (double)center.x, center.x - (double)strip.column_hi[c]));
+        if (dx >= r) {continue;}
+        double dy = sqrt(r * r - dx * dx);
         
-        //cout << "Looking at " << i->location;
+        const Point2D<Scalar> * end = &strip.sites[0] + strip.column_start[c + 1];
+        const Point2D<Scalar> * p = lower_bound(&strip.sites[0] + strip.column_start[c], end, Point2D<Scalar>(0, center.y - dy), lower_y<Scalar>);
         
-        if (does_intersect(site, i, &z)) {
+        for (; p < end && p->y <= center.y + dy; p++) {
+            if (p->x >= cover_lo && p->x < cover_hi) {continue;}
+            double px = p->x - (double)center.x, py = p->y - (double)center.y;
+            if (px * px + py * py < inside) {
+                return true;
+            }
+        }
+    }
+    
+    return false;
+}
+
+template <typename Scalar>
+void Voronoi2D<Scalar>::generate_voronoi_2D_parallel(Scalar * points, int num_points, int num_threads) {
+    
+    if (num_threads < 2 || num_points < 2 * num_threads) {
+        generate_voronoi_2D(points, num_points, NULL, NULL);
+        return;
+    }
+    
+    reset_sweep();
+    set_bounds(points, num_points);
+    
+    // The strips split an even sample of the sites by x.
+    int num_samples = min(num_points, 1024 * num_threads);
+    vector<Scalar> sample(num_samples);
+    for (int i = 0; i < num_samples; i++) {
+        sample[i] = points[2 * (int)((long long)i * num_points / num_samples)];
+    }
+    sort(sample.begin(), sample.end());
+    
+    vector<Strip2D<Scalar>> strips(num_threads);
+    for (int k = 0; k < num_threads; k++) {
+        strips[k].lo = k == 0 ? -numeric_limits<Scalar>::infinity() : sample[k * num_samples / num_threads];
+        strips[k].hi = k == num_threads - 1 ? numeric_limits<Scalar>::infinity() : sample[(k + 1) * num_samples / num_threads];
+    }
+    
+    vector<thread> threads;
+    for (int k = 0; k < num_threads; k++) {
+        threads.push_back(thread(build_strip<Scalar>, &strips[k], points, num_points));
+    }
+    for (int k = 0; k < num_threads; k++) {
+        threads[k].join();
+    }
+    threads.clear();
+    
+    // Every hull vertex is on the hull of its strip.
+    vector<Point2D<Scalar>> hull_sites, hull;
+    for (int k = 0; k < num_threads; k++) {
+        hull_sites.insert(hull_sites.end(), strips[k].hull.begin(), strips[k].hull.end());
+    }
+    sort(hull_sites.begin(), hull_sites.end());
+    convex_hull(hull_sites, hull);
+    
+    // Start with a halo of six times the mean distance between sites.
+    Scalar x0 = hull_sites.front().x, x1 = hull_sites.back().x, y0 = hull_sites.front().y, y1 = y0;
+    for (int i = 0; i < hull_sites.size(); i++) {
+        y0 = min(y0, hull_sites[i].y);
+        y1 = max(y1, hull_sites[i].y);
+    }
+    Scalar halo = 6 * sqrt((x1 - x0) * (y1 - y0) / num_points);
+    if (!(halo > 0)) {
+        halo = (X1 - X0) / num_threads;
+    }
+    
+    while (strip_sweeps.size() < num_threads) {
+        strip_sweeps.push_back(unique_ptr<Voronoi2D>(new Voronoi2D()));
+    }
+    
+    for (int k = 0; k < num_threads; k++) {
+        Voronoi2D * strip_sweep = strip_sweeps[k].get();
+        strip_sweep->X0 = X0;  strip_sweep->X1 = X1;  strip_sweep->Y0 = Y0;  strip_sweep->Y1 = Y1;
+        strip_sweep->tolerance = tolerance;
+        threads.push_back(thread(&Voronoi2D::sweep_strip, strip_sweep, &strips, k, &hull, halo));
+    }
+    for (int k = 0; k < num_threads; k++) {
+        threads[k].join();
+    }
+    threads.clear();
+    
+    // Each strip copies its edges into its own part of the diagram.
+    size_t num_vertices = 0, num_edges = 0;
+    vector<size_t> vertex_offsets, edge_offsets;
+    for (int k = 0; k < num_threads; k++) {
+        vertex_offsets.push_back(num_vertices);
+        edge_offsets.push_back(num_edges);
+        num_vertices += strip_sweeps[k]->voronoi_vertices.size();
+        num_edges += strip_sweeps[k]->voronoi_edges.size();
+    }
+    voronoi_vertices.resize(num_vertices);
+    voronoi_edges.resize(num_edges);
+    voronoi_edge_sites.resize(num_edges);
+    
+    for (int k = 0; k < num_threads; k++) {
+        threads.push_back(thread(&Voronoi2D::copy_strip, this, strip_sweeps[k].get(), vertex_offsets[k], edge_offsets[k]));
+    }
+    for (int k = 0; k < num_threads; k++) {
+        threads[k].join();
+    }
+}
+
+// Sweeps strip k with its halo and the hull, with a wider halo each time until it checks out, and keeps the edges it owns.
+template <typename Scalar>
+void Voronoi2D<Scalar>::sweep_strip(const vector<Strip2D<Scalar>> * strips, int k, const vector<Point2D<Scalar>> * hull, Scalar halo) {
+    
+    const Strip2D<Scalar> & strip = (*strips)[k];
+    
+    while (true) {
+        
+        reset_sweep();
+        
+        if (strip.sites.empty()) {
+            return;
+        }
+        
+        Scalar cover_lo = strip.lo - halo, cover_hi = strip.hi + halo;
+        
+        for (int j = 0; j < strips->size(); j++) {
+            
+            const Strip2D<Scalar> & other = (*strips)[j];
+            
+            for (int c = 0; c + 1 < other.column_start.size(); c++) {
+                
+                int first = other.column_start[c], last = other.column_start[c + 1] - 1;
+                
+                if (other.column_hi[c] >= cover_lo && other.column_lo[c] < cover_hi) {
+                    for (int i = first; i <= last; i++) {
+                        if (other.sites[i].x >= cover_lo && other.sites[i].x < cover_hi) {
+                            site_event_queue.push(other.sites[i]);
+                        }
+                    }
+                }
+                
+                /*
+                 *  The cells along the bottom and top of the sites are big and reach across many
+                 *  strips, so the sites within two spacings of the bottom and top of every column
+                 *  are swept too.
+                 */
+                int bottom = first, top = last;
+                while (bottom <= last && other.sites[bottom].y <= other.sites[first].y + 2 * other.spacing) {bottom++;}
+                while (top >= bottom && other.sites[top].y >= other.sites[last].y - 2 * other.spacing) {top--;}
+                for (int i = first; i < bottom; i++) {
+                    if (other.sites[i].x < cover_lo || other.sites[i].x >= cover_hi) {
+                        site_event_queue.push(other.sites[i]);
+                    }
+                }
+                for (int i = top + 1; i <= last; i++) {
+                    if (other.sites[i].x < cover_lo || other.sites[i].x >= cover_hi) {
+                        site_event_queue.push(other.sites[i]);
+                    }
+                }
+            }
+        }
+        
+        // With the whole hull in every strip, the unbounded edges of a strip are the same as in the whole diagram.
+        for (int i = 0; i < hull->size(); i++) {
+            if ((*hull)[i].x < cover_lo || (*hull)[i].x >= cover_hi) {
+                site_event_queue.push((*hull)[i]);
+            }
+        }
+        
+        sweep(NULL, NULL);
+        
+        Scalar needed = certify_strip(strips, k, cover_lo, cover_hi);
+        if (needed == 0) {
+            break;
+        }
+        
+        halo = max(needed, 2 * halo);
+    }
+    
+    keep_strip_edges(strip.lo, strip.hi);
+}
+
+/*
+ *  The cells of the owned sites are right if the circle of every vertex on them has no site
+ *  in it that was not swept. Every site from cover_lo to cover_hi in x was, and the hull is
+ *  only there to pin down the unbounded edges, which is why the ends at the cut off sweep
+ *  line are not checked. Returns 0 if the cells are right, or else the halo that reaches
+ *  over every circle that was not empty.
+ */
+template <typename Scalar>
+Scalar Voronoi2D<Scalar>::certify_strip(const vector<Strip2D<Scalar>> * strips, int k, Scalar cover_lo, Scalar cover_hi) {
+    
+    Scalar lo = (*strips)[k].lo, hi = (*strips)[k].hi;
+    Scalar needed = 0;
+    
+    for (int e = 0; e < voronoi_edges.size(); e++) {
+        
+        Point2D<Scalar> a = voronoi_edge_sites[e].first, b = voronoi_edge_sites[e].second;
+        if ((a.x < lo || a.x >= hi) && (b.x < lo || b.x >= hi)) {continue;}
+        
+        for (int end = 0; end < 2; end++) {
+            
+            unsigned int v = voronoi_edges[e].vidx[end];
+            if (v >= num_finite_vertices) {continue;}
+            
+            Point2D<Scalar> center = voronoi_vertices[v];
+            double r = sqrt(((double)center.x - a.x) * ((double)center.x - a.x) + ((double)center.y - a.y) * ((double)center.y - a.y));
+            if (center.x - r >= cover_lo && center.x + r < cover_hi) {continue;}
+            
+            // A vertex is a few roundings off, and the center of a big circle is less precise.
+            double margin = 16 * tolerance * (1 + r / (X1 - X0 + Y1 - Y0));
+            
+            for (int j = 0; j < strips->size(); j++) {
+                if (j != k && has_site_in_circle((*strips)[j], center, r, margin, cover_lo, cover_hi)) {
+                    needed = max(needed, (Scalar)max(lo - (center.x - r), center.x + r - hi));
+                    break;
+                }
+            }
+        }
+    }
+    
+    return needed;
+}
+
+// Keeps the edges whose lower site is from lo to hi in x, and the vertices on them.
+template <typename Scalar>
+void Voronoi2D<Scalar>::keep_strip_edges(Scalar lo, Scalar hi) {
+    
+    vector<unsigned int> remap(voronoi_vertices.size(), 0);
+    
+    int num_edges = 0;
+    for (int e = 0; e < voronoi_edges.size(); e++) {
+        Point2D<Scalar> a = voronoi_edge_sites[e].first, b = voronoi_edge_sites[e].second;
+        Point2D<Scalar> lower = a < b ? a : b;
+        if (lower.x >= lo && lower.x < hi) {
+            remap[voronoi_edges[e].vidx[0]] = remap[voronoi_edges[e].vidx[1]] = 1;
+            voronoi_edges[num_edges] = voronoi_edges[e];
+            voronoi_edge_sites[num_edges] = voronoi_edge_sites[e];
+            num_edges++;
+        }
+    }
+    voronoi_edges.resize(num_edges);
+    voronoi_edge_sites.resize(num_edges);
+    
+    unsigned int num_vertices = 0;
+    for (unsigned int v = 0; v < voronoi_vertices.size(); v++) {
+        if (remap[v]) {
+            remap[v] = num_vertices;
+            voronoi_vertices[num_vertices++] = voronoi_vertices[v];
+        }
+    }
+    voronoi_vertices.resize(num_vertices);
+    
+    for (int e = 0; e < num_edges; e++) {
+        voronoi_edges[e] = Edge2D(remap[voronoi_edges[e].vidx[0]], remap[voronoi_edges[e].vidx[1]]);
+    }
+}
+
+template <typename Scalar>
+void Voronoi2D<Scalar>::copy_strip(const Voronoi2D * strip_sweep, size_t vertex_offset, size_t edge_offset) {
+    
+    copy(strip_sweep->voronoi_vertices.begin(), strip_sweep->voronoi_vertices.end(), voronoi_vertices.begin() + vertex_offset);
+    copy(strip_sweep->voronoi_edge_sites.begin(), strip_sweep->voronoi_edge_sites.end(), voronoi_edge_sites.begin() + edge_offset);
+    
+    for (size_t e = 0; e < strip_sweep->voronoi_edges.size(); e++) {
+        const Edge2D & edge = strip_sweep->voronoi_edges[e];
+        voronoi_edges[edge_offset + e] = Edge2D((unsigned int)(edge.vidx[0] + vertex_offset), (unsigned int)(edge.vidx[1] + vertex_offset));
+    }
+}
+
+// rect, or the bounding box of the points if rect is NULL, as {x0, y0, x1, y1}.
+template <typename Scalar>
+static void cell_rect(const Scalar * points, int num_points, const Scalar * rect, Scalar * box) {
+    
+    if (rect != NULL) {
+        copy(rect, rect + 4, box);
+        return;
+    }
+    
+    box[0] = box[2] = num_points > 0 ? points[0] : 0;
+    box[1] = box[3] = num_points > 0 ? points[1] : 0;
+    for (int i = 0; i < num_points; i++) {
+        box[0] = min(box[0], points[2 * i]);
+        box[2] = max(box[2], points[2 * i]);
+        box[1] = min(box[1], points[2 * i + 1]);
+        box[3] = max(box[3], points[2 * i + 1]);
+    }
+}
+
+// Which of the count tiles of width from lo is x in? Values outside go to the closest tile.
+template <typename Scalar>
+static int tile_of(Scalar x, Scalar lo, Scalar width, int count) {
+    
+    Scalar t = width > 0 ? floor((x - lo) / width) : 0;
+    return t < 0 ? 0 : (t >= count ? count - 1 : (int)t);
+}
+
+// The part of the plane tile (tx, ty) owns, as {x0, y0, x1, y1}. The tiles on the sides reach out forever.
+template <typename Scalar>
+static void tile_region(const Scalar * box, int tiles_x, int tiles_y, int tx, int ty, Scalar * region) {
+    
+    Scalar width = (box[2] - box[0]) / tiles_x, height = (box[3] - box[1]) / tiles_y;
+    Scalar inf = numeric_limits<Scalar>::infinity();
+    
+    region[0] = tx == 0 ? -inf : box[0] + tx * width;
+    region[2] = tx == tiles_x - 1 ? inf : box[0] + (tx + 1) * width;
+    region[1] = ty == 0 ? -inf : box[1] + ty * height;
+    region[3] = ty == tiles_y - 1 ? inf : box[1] + (ty + 1) * height;
+}
+
+template <typename Scalar>
+static bool in_rect(const Scalar * rect, Scalar x, Scalar y) {
+    
+    return x >= rect[0] && x <= rect[2] && y >= rect[1] && y <= rect[3];
+}
+
+template <typename Scalar>
+void Voronoi2D<Scalar>::generate_cell_polygons(Scalar * points, int num_points, const Scalar * rect) {
+    
+    Scalar box[4];
+    cell_rect(points, num_points, rect, box);
+    
+    generate_voronoi_2D(points, num_points, NULL, NULL);
+    
+    tile_index.resize(num_points);
+    for (int i = 0; i < num_points; i++) {
+        tile_index[i] = i;
+    }
+    clip_cells(box, points, num_points, num_points, tile_index.data());
+}
+
+template <typename Scalar>
+void Voronoi2D<Scalar>::generate_cell_polygons_tiled(Scalar * points, int num_points, int tiles_x, int tiles_y, void (*sink)(const CellPolygons2D<Scalar> & cells, void * data), void * data, const Scalar * rect) {
+    
+    Scalar box[4];
+    cell_rect(points, num_points, rect, box);
+    
+    tiles_x = max(tiles_x, 1);
+    tiles_y = max(tiles_y, 1);
+    int num_tiles = tiles_x * tiles_y;
+    Scalar width = (box[2] - box[0]) / tiles_x, height = (box[3] - box[1]) / tiles_y;
+    
+    // Sort the sites into their tiles, tile t has tile_sites[tile_start[t]] up to tile_sites[tile_start[t + 1]].
+    tile_start.assign(num_tiles + 1, 0);
+    tile_sites.resize(num_points);
+    for (int i = 0; i < num_points; i++) {
+        tile_start[tile_of(points[2 * i + 1], box[1], height, tiles_y) * tiles_x + tile_of(points[2 * i], box[0], width, tiles_x) + 1]++;
+    }
+    for (int t = 0; t < num_tiles; t++) {
+        tile_start[t + 1] += tile_start[t];
+    }
+    for (int i = num_points - 1; i >= 0; i--) {
+        tile_sites[--tile_start[tile_of(points[2 * i + 1], box[1], height, tiles_y) * tiles_x + tile_of(points[2 * i], box[0], width, tiles_x) + 1]] = i;
+    }
+    for (int t = 0; t < num_tiles; t++) {
+        tile_start[t] = tile_start[t + 1];
+    }
+    tile_start[num_tiles] = num_points;
+    
+    // A halo a few sites deep, the sites it misses are found by certify_tile.
+    Scalar spacing = sqrt((box[2] - box[0]) * (box[3] - box[1]) / max(num_points, 1));
+    
+    for (int ty = 0; ty < tiles_y; ty++) {
+        for (int tx = 0; tx < tiles_x; tx++) {
+            
+            int tile = ty * tiles_x + tx;
+            Scalar region[4];
+            tile_region(box, tiles_x, tiles_y, tx, ty, region);
+            
+            Scalar halo = spacing > 0 ? 3 * spacing : max(width, height);
+            Scalar cover[4] = {region[0] - halo, region[1] - halo, region[2] + halo, region[3] + halo};
+            
+            // The sites the tile owns go first, then the ones in its halo.
+            tile_index.clear();
+            for (int k = tile_start[tile]; k < tile_start[tile + 1]; k++) {
+                tile_index.push_back(tile_sites[k]);
+            }
+            int num_owned = (int)tile_index.size();
+            
+            int x0 = tile_of(cover[0], box[0], width, tiles_x), x1 = tile_of(cover[2], box[0], width, tiles_x);
+            int y0 = tile_of(cover[1], box[1], height, tiles_y), y1 = tile_of(cover[3], box[1], height, tiles_y);
+            for (int y = y0; y <= y1; y++) {
+                for (int x = x0; x <= x1; x++) {
+                    int t = y * tiles_x + x;
+                    for (int k = tile_start[t]; t != tile && k < tile_start[t + 1]; k++) {
+                        int i = tile_sites[k];
+                        if (in_rect(cover, points[2 * i], points[2 * i + 1])) {
+                            tile_index.push_back(i);
+                        }
+                    }
+                }
+            }
+            int num_covered = (int)tile_index.size();
+            
+            // Sites found too close to a corner are added after the halo, until there are none.
+            cell_polygons.clear();
+            while (num_owned > 0) {
+                
+                tile_points.clear();
+                for (int k = 0; k < tile_index.size(); k++) {
+                    tile_points.push_back(points[2 * tile_index[k]]);
+                    tile_points.push_back(points[2 * tile_index[k] + 1]);
+                }
+                
+                generate_voronoi_2D(tile_points.data(), (int)tile_index.size(), NULL, NULL);
+                clip_cells(box, tile_points.data(), (int)tile_index.size(), num_owned, tile_index.data());
+                
+                if (tile_index.size() == num_points || certify_tile(points, box, tiles_x, tiles_y, tile, cover, num_covered)) {
+                    break;
+                }
+                
+                sort(tile_index.begin() + num_covered, tile_index.end());
+                tile_index.erase(unique(tile_index.begin() + num_covered, tile_index.end()), tile_index.end());
+            }
             
-            if (i->next != NULL && !does_intersect(site, i->next, &zz)) {
-                //cout << "Split arc.\n";
-                i->next->prev = new Arc2D(i->location, i, i->next);
-                i->next = i->next->prev;
+            sink(cell_polygons, data);
+        }
+    }
+}
+
+/*
+ *  Clips the cells of the first num_owned of the sites to rect. A cell is cut down by the
+ *  half plane of every site on the other side of one of its edges, so it does not matter
+ *  if the edges of the sweep are in pieces or end in vertices that are a little off.
+ */
+template <typename Scalar>
+void Voronoi2D<Scalar>::clip_cells(const Scalar * rect, const Scalar * sites, int num_sites, int num_owned, const int * site_index) {
+    
+    cell_polygons.clear();
+    
+    site_order.resize(num_sites);
+    for (int i = 0; i < num_sites; i++) {
+        site_order[i] = i;
+    }
+    sort(site_order.begin(), site_order.end(), [=](int a, int b) {return Point2D<Scalar>(sites[2 * a], sites[2 * a + 1]) < Point2D<Scalar>(sites[2 * b], sites[2 * b + 1]);});
+    
+    // Count the neighbours of every owned site, then put them in place from the back.
+    neighbour_start.assign(num_owned + 1, 0);
+    for (int pass = 0; pass < 2; pass++) {
+        
+        for (int e = 0; e < voronoi_edge_sites.size(); e++) {
+            for (int side = 0; side < 2; side++) {
+                
+                Point2D<Scalar> p = side == 0 ? voronoi_edge_sites[e].first : voronoi_edge_sites[e].second;
+                Point2D<Scalar> q = side == 0 ? voronoi_edge_sites[e].second : voronoi_edge_sites[e].first;
+                
+                // Repeated sites are swept once, so every copy gets the neighbours.
+                vector<int>::iterator k = lower_bound(site_order.begin(), site_order.end(), p, [=](int a, const Point2D<Scalar> & b) {return Point2D<Scalar>(sites[2 * a], sites[2 * a + 1]) < b;});
+                for (; k != site_order.end() && sites[2 * *k] == p.x && sites[2 * *k + 1] == p.y; k++) {
+                    if (*k >= num_owned) {continue;}
+                    if (pass == 0) {
+                        neighbour_start[*k]++;
+                    }
+                    else {
+                        neighbours[--neighbour_start[*k]] = q;
+                    }
+                }
             }
-            else {//if (i->next == NULL) {
-                //cout << "Inbetween arcs.\n";
-                i->next = new Arc2D(i->location, i);
+        }
+        
+        if (pass == 0) {
+            for (int i = 1; i <= num_owned; i++) {
+                neighbour_start[i] += neighbour_start[i - 1];
             }
+            neighbours.resize(neighbour_start[num_owned]);
+        }
+    }
+    
+    for (int i = 0; i < num_owned; i++) {
+        
+        // Work from the site, like make_circle.
+        Point2D<Scalar> s(sites[2 * i], sites[2 * i + 1]);
+        vector<Point2D<Scalar>> * cell = &clipped[0], * next = &clipped[1];
+        cell->clear();
+        cell->push_back(Point2D<Scalar>(rect[0] - s.x, rect[1] - s.y));
+        cell->push_back(Point2D<Scalar>(rect[2] - s.x, rect[1] - s.y));
+        cell->push_back(Point2D<Scalar>(rect[2] - s.x, rect[3] - s.y));
+        cell->push_back(Point2D<Scalar>(rect[0] - s.x, rect[3] - s.y));
+        
+        for (int j = neighbour_start[i]; j < neighbour_start[i + 1] && !cell->empty(); j++) {
             
-            i->next->s1 = i->s1;
+            // Keep the points p with p.d <= h, the ones closer to s than to the neighbour.
+            Point2D<Scalar> d(neighbours[j].x - s.x, neighbours[j].y - s.y);
+            if (d.x == 0 && d.y == 0) {continue;}
+            Scalar h = (d.x * d.x + d.y * d.y) / 2;
             
-            i->next->prev = new Arc2D(site, i, i->next);
-            i->next = i->next->prev;
+            next->clear();
+            for (size_t k = 0; k < cell->size(); k++) {
+                Point2D<Scalar> a = (*cell)[k], b = (*cell)[(k + 1) % cell->size()];
+                Scalar fa = a.x * d.x + a.y * d.y - h, fb = b.x * d.x + b.y * d.y - h;
+                if (fa <= 0) {
+                    next->push_back(a);
+                }
+                if ((fa < 0 && fb > 0) || (fa > 0 && fb < 0)) {
+                    Scalar t = fa / (fa - fb);
+                    next->push_back(Point2D<Scalar>(a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t));
+                }
+            }
+            swap(cell, next);
+        }
+        
+        if (cell->empty()) {
+            continue;
+        }
+        
+        // A neighbour through a corner leaves two corners that are only apart by rounding.
+        cell_polygons.site_index.push_back(site_index[i]);
+        size_t first = cell_polygons.corners.size();
+        for (size_t k = 0; k < cell->size(); k++) {
+            Point2D<Scalar> p((*cell)[k].x + s.x, (*cell)[k].y + s.y);
+            if (cell_polygons.corners.size() > first && fabs(p.x - cell_polygons.corners.back().x) + fabs(p.y - cell_polygons.corners.back().y) <= tolerance) {continue;}
+            cell_polygons.corners.push_back(p);
+        }
+        Point2D<Scalar> p = cell_polygons.corners[first];
+        if (cell_polygons.corners.size() > first + 1 && fabs(p.x - cell_polygons.corners.back().x) + fabs(p.y - cell_polygons.corners.back().y) <= tolerance) {
+            cell_polygons.corners.pop_back();
+        }
+        cell_polygons.corner_start.push_back((unsigned int)cell_polygons.corners.size());
+    }
+}
+
+/*
+ *  Checks that no site the tile did not sweep is closer to a corner of one of its cells
+ *  than the site of the cell. The closest such site to each corner is added to tile_index,
+ *  after the num_covered sites of the tile and its halo, and false is returned if there
+ *  were any.
+ */
+template <typename Scalar>
+bool Voronoi2D<Scalar>::certify_tile(const Scalar * points, const Scalar * box, int tiles_x, int tiles_y, int tile, const Scalar * cover, int num_covered) {
+    
+    Scalar width = (box[2] - box[0]) / tiles_x, height = (box[3] - box[1]) / tiles_y;
+    
+    // The sites added before are sorted.
+    vector<int>::iterator added = tile_index.begin() + num_covered;
+    size_t num_swept = tile_index.size();
+    
+    for (int c = 0; c < cell_polygons.size(); c++) {
+        
+        int site = cell_polygons.site_index[c];
+        Point2D<Scalar> s(points[2 * site], points[2 * site + 1]);
+        
+        for (unsigned int k = cell_polygons.corner_start[c]; k < cell_polygons.corner_start[c + 1]; k++) {
             
-            i = i->next;
+            Point2D<Scalar> center = cell_polygons.corners[k];
+            double r = sqrt(((double)center.x - s.x) * ((double)center.x - s.x) + ((double)center.y - s.y) * ((double)center.y - s.y));
+            if (center.x - r >= cover[0] && center.x + r <= cover[2] && center.y - r >= cover[1] && center.y + r <= cover[3]) {continue;}
             
-            i->prev->s1 = i->s0 = new HalfEdge2D(z);
-            voronoi_edges.push_back(i->s0);
-            i->next->s0 = i->s1 = new HalfEdge2D(z);
-            voronoi_edges.push_back(i->s1);
+            // Ties only cost another sweep, since a site that was added is not checked again.
+            double margin = tolerance * (1 + r / (X1 - X0 + Y1 - Y0));
+            if (r <= margin) {continue;}
+            double closest = (r - margin) * (r - margin);
+            int found = -1;
             
-            check_circle_event(i);
-            check_circle_event(i->prev);
-            check_circle_event(i->next);
+            int x0 = tile_of((Scalar)(center.x - r), box[0], width, tiles_x), x1 = tile_of((Scalar)(center.x + r), box[0], width, tiles_x);
+            int y0 = tile_of((Scalar)(center.y - r), box[1], height, tiles_y), y1 = tile_of((Scalar)(center.y + r), box[1], height, tiles_y);
             
-            return;
+            for (int y = y0; y <= y1; y++) {
+                for (int x = x0; x <= x1; x++) {
+                    int t = y * tiles_x + x;
+                    for (int j = tile_start[t]; t != tile && j < tile_start[t + 1]; j++) {
+                        int i = tile_sites[j];
+                        double px = points[2 * i] - (double)center.x, py = points[2 * i + 1] - (double)center.y;
+                        if (px * px + py * py >= closest || in_rect(cover, points[2 * i], points[2 * i + 1]) || binary_search(added, tile_index.begin() + num_swept, i)) {continue;}
+                        closest = px * px + py * py;
+                        found = i;
+                    }
+                }
+            }
+            
+            if (found >= 0) {
+                tile_index.push_back(found);
+                added = tile_index.begin() + num_covered;
+            }
         }
+    }
+    
+    return tile_index.size() == num_swept;
+}
+
+template <typename Scalar>
+void Voronoi2D<Scalar>::handle_site_event(Point2D<Scalar> site) {
+    
+    //cout << "Handle site event " << site;
+    
+    if (beach_head == NULL) {
+        beach_head = add_arc(site, NULL, MAX_SKIPLIST_HEIGHT);
+        return;
+    }
+    
+    Arc2D<Scalar> * i = find_arc(site.y);
+    
+    if (i->location.x == site.x) {
+        
+        // Every arc so far is a vertical line at the first x, so the new one goes on top.
+        Arc2D<Scalar> * arc = add_arc(site, i, random_height());
+        
+        Point2D<Scalar> start(X0, (i->location.y + site.y) / 2);
+        i->s1 = arc->s0 = add_edge(add_vertex(start), i->location, site);
+        return;
+    }
+    
+    // The point on arc i right above the site.
+    Point2D<Scalar> z(parabola_x(i->location, site.y), site.y);
+    
+    Arc2D<Scalar> * left = NULL;
+    if (i->prev[0] != NULL && site.y - parabolic_intersection(i->prev[0]->location, i->location).y < tolerance) {
+        left = i->prev[0];
+    }
+    else if (i->next[0] != NULL && parabolic_intersection(i->location, i->next[0]->location).y - site.y < tolerance) {
+        left = i;
+    }
+    
+    if (left != NULL) {
         
+        // The site is right below a breakpoint, so that is a voronoi vertex and no arc is split.
+        Arc2D<Scalar> * arc = add_arc(site, left, random_height());
+        Arc2D<Scalar> * right = arc->next[0];
+        
+        unsigned int vertex = add_vertex(z);
+        
+        if (left->s1 >= 0) {
+            finish_edge(left->s1, vertex);
+        }
+        
+        left->s1 = arc->s0 = add_edge(vertex, left->location, site);
+        arc->s1 = right->s0 = add_edge(vertex, site, right->location);
+        
+        check_circle_event(left);
+        check_circle_event(right);
+        
+        return;
     }
     
-    for(i = beach_head; i->next != NULL; i = i->next){}
+    // Split arc i in two with the new arc between the halves.
+    Arc2D<Scalar> * upper = add_arc(i->location, i, random_height());
+    upper->s1 = i->s1;
+    
+    Arc2D<Scalar> * arc = add_arc(site, i, random_height());
     
-    //we append arc to end
-    i->next = new Arc2D(site, i);
+    // Both halves of the new edge start at z.
+    unsigned int vertex = add_vertex(z);
+    i->s1 = arc->s0 = add_edge(vertex, i->location, site);
+    arc->s1 = upper->s0 = add_edge(vertex, site, i->location);
     
-    Point2D start(X0, (i->location.y + i->next->location.y) / 2.f);
-    i->s1 = i->next->s0 = new HalfEdge2D(start);
-    voronoi_edges.push_back(i->s1);
+    // The new arc has the same site on both sides, so only its neighbours can get circle events.
+    check_circle_event(i);
+    check_circle_event(upper);
 }
 
-void Voronoi2D::handle_circle_event(CircleEvent2D * event) {
+template <typename Scalar>
+void Voronoi2D<Scalar>::handle_circle_event(CircleEvent2D<Scalar> * event) {
     
     //cout << "Handle circle event." << event->circumcenter;
     
     if (event->is_valid) {
         
-        HalfEdge2D * edge = new HalfEdge2D(event->circumcenter);
-        voronoi_edges.push_back(edge);
+        // Circle events are only made for arcs with neighbours on both sides.
+        Arc2D<Scalar> * a = event->arc;
+        Arc2D<Scalar> * prev = a->prev[0];
+        Arc2D<Scalar> * next = a->next[0];
         
-        Arc2D * a = event->arc;
+        unsigned int vertex = add_vertex(event->circumcenter);
+        int edge = add_edge(vertex, prev->location, next->location);
         
-        if (a->prev != NULL) {
-            a->prev->next = a->next;
-            a->prev->s1 = edge;
-        }
-        if (a->next != NULL) {
-            a->next->prev = a->prev;
-            a->next->s0 = edge;
-        }
+        prev->s1 = edge;
+        next->s0 = edge;
         
-        if (a->s0 != NULL) {
-            a->s0->finish(event->circumcenter);
+        if (a->s0 >= 0) {
+            finish_edge(a->s0, vertex);
         }
-        if (a->s1 != NULL) {
-            a->s1->finish(event->circumcenter);
+        if (a->s1 >= 0) {
+            finish_edge(a->s1, vertex);
         }
         
-        if (a->prev != NULL) {
-            check_circle_event(a->prev);
-        }
-        if (a->next != NULL) {
-            check_circle_event(a->next);
-        }
+        a->event = NULL;
+        remove_arc(a);
+        
+        check_circle_event(prev);
+        check_circle_event(next);
         
     }
-    delete event;
+    delete_circle_event(event);
 }
 
-void Voronoi2D::check_circle_event(Arc2D * arc) {
+template <typename Scalar>
+void Voronoi2D<Scalar>::check_circle_event(Arc2D<Scalar> * arc) {
     
     //cout << "Check circle event.\n";
     
-    if (arc->event != NULL && arc->event->right_most_x != sweep_line) {
+    if (arc->event != NULL) {
         arc->event->is_valid = false;
     }
     arc->event = NULL;
     
-    if (arc->prev == NULL || arc->next == NULL) {
+    if (arc->prev[0] == NULL || arc->next[0] == NULL) {
         return;
     }
     
-    float x;
-    Point2D circumcenter;
+    Scalar x;
+    Point2D<Scalar> circumcenter;
     
-    if (make_circle(arc->prev->location, arc->location, arc->next->location, circumcenter, x) && x > sweep_line) {
+    // The breakpoints of a right turn meet ahead of the sweep, so an event behind it is only rounding.
+    if (make_circle(arc->prev[0]->location, arc->location, arc->next[0]->location, circumcenter, x)) {
         
-        arc->event = new CircleEvent2D(arc, circumcenter, x);
+        arc->event = new_circle_event(arc, circumcenter, max(x, sweep_line));
         circle_event_queue.push(arc->event);
     }
     
 }
 
-bool Voronoi2D::make_circle(Point2D a, Point2D b, Point2D c, Point2D & circumcenter, float & right_most_x) {
+template <typename Scalar>
+bool Voronoi2D<Scalar>::make_circle(Point2D<Scalar> a, Point2D<Scalar> b, Point2D<Scalar> c, Point2D<Scalar> & circumcenter, Scalar & right_most_x) {
     
     //cout << "Make circle.\n" << a << b << c;
     
-    // Check that bc is a "right turn" from ab.
-    if ((b.x - a.x) * (c.y - a.y) - (c.x - a.x) * (b.y - a.y) > 0) {
+    // Check that bc is a "right turn" from ab, points on a line have no circle.
+    if (orientation(a, b, c) >= 0) {
         //cout << "Inverted circle.\n";
         return false;
     }
     
-    // Algorithm from O'Rourke 2ed p. 189.
-    float A = b.x - a.x,  B = b.y - a.y,
+    // Work from a, so the size of the coordinates does not eat the precision of the center.
+    Scalar A = b.x - a.x,  B = b.y - a.y,
     C = c.x - a.x,  D = c.y - a.y,
-    E = A*(a.x+b.x) + B*(a.y+b.y),
-    F = C*(a.x+c.x) + D*(a.y+c.y),
-    G = 2*(A*(c.y-b.y) - B*(c.x-b.x));
+    E = A*A + B*B,
+    F = C*C + D*D,
+    G = 2*(A*D - B*C);
     
-    // Points are co-linear.
-    if (G == 0) {
-        //cout << "Co-linear.\n";
-        
-        /*
-        *right_most_x = INF;
-        
-        circumcenter->x = (a.y - b.y) * INF + a.x;
-        circumcenter->y = (b.x - a.x) * INF + a.y;
-        
-        cout << *circumcenter;
-        
-        return true;*/
+    // The points are so close to a line that the rounded turn points the other way.
+    if (!(G < 0)) {
         return false;
     }
     
+    Scalar ox = (D*E - B*F) / G;
+    Scalar oy = (A*F - C*E) / G;
+    
     // Point o is the center of the circle.
-    circumcenter.x = (D*E-B*F)/G;
-    circumcenter.y = (A*F-C*E)/G;
+    circumcenter.x = a.x + ox;
+    circumcenter.y = a.y + oy;
     
     // o.x plus radius equals max x coordinate.
-    right_most_x = circumcenter.x + sqrt( pow(a.x - circumcenter.x, 2) + pow(a.y - circumcenter.y, 2) );
+    right_most_x = circumcenter.x + sqrt(ox*ox + oy*oy);
     
     return true;
 }
 
+// Where is the parabola of focus at height y, for the current sweep line?
+template <typename Scalar>
+Scalar Voronoi2D<Scalar>::parabola_x(Point2D<Scalar> focus, Scalar y) {
+    
+    return (y - focus.y) * (y - focus.y) / (2 * (focus.x - sweep_line)) + (focus.x + sweep_line) / 2;
+}
 
-// Will a new parabola at point p intersect with arc i?
-bool Voronoi2D::does_intersect(Point2D point, Arc2D * arc, Point2D * ret) {
+/*
+ *  Where do two parabolas intersect? The root is taken in the form that does not subtract
+ *  two nearly equal values, and x comes from the focus farther from the sweep, whose
+ *  parabola is the flatter one.
+ */
+template <typename Scalar>
+Point2D<Scalar> Voronoi2D<Scalar>::parabolic_intersection(Point2D<Scalar> left, Point2D<Scalar> right) {
     
-    if (point.x == arc->location.x) {return false;}
+    Point2D<Scalar> ret;
     
-    float down_y = 0;
-    float up_y = 0;
+    Scalar dl = left.x - sweep_line, dr = right.x - sweep_line;
     
-    if (arc->prev != NULL) {
-        down_y = parabolic_intersection(arc->prev->location, arc->location).y;
+    if (left.x == right.x) {
+        ret.y = (left.y + right.y) / 2;
+        if (dl == 0) {
+            ret.x = sweep_line;
+            return ret;
+        }
     }
-    if (arc->next != NULL) {
-        up_y = parabolic_intersection(arc->location, arc->next->location).y;
+    else if (dr == 0) {
+        ret.y = right.y;
     }
-    if ((arc->prev == NULL || down_y <= point.y) && (arc->next == NULL || up_y >= point.y)) {
-        
-        ret->y = point.y;
-        
-        ret->x = (arc->location.x * arc->location.x + (arc->location.y - ret->y) * (arc->location.y - ret->y) - point.x * point.x) / (2 * arc->location.x - 2 * point.x);
-        
-        return true;
+    else if (dl == 0) {
+        ret.y = left.y;
+    }
+    else {
+        Scalar a = right.x - left.x, d = right.y - left.y;
+        Scalar root = sqrt(dl * dr) * sqrt(a * a + d * d);
+        ret.y = left.y + (d >= 0 ? dl * (d * d + a * dr) / (dl * d - root) : (-dl * d - root) / a);
     }
     
+    ret.x = parabola_x(dl < dr ? left : right, ret.y);
     
-    return false;
+    //cout << ret;
+    
+    return ret;
 }
 
-// Where do two parabolas intersect?
-Point2D Voronoi2D::parabolic_intersection(Point2D left, Point2D right) {
+// Which arc is above height y? Each level moves up while the lower breakpoint of the next arc is not above y.
+template <typename Scalar>
+Arc2D<Scalar> * Voronoi2D<Scalar>::find_arc(Scalar y) {
     
-    Point2D ret;
+    Arc2D<Scalar> * arc = beach_head;
     
-    Point2D p = left;
+    for (int level = MAX_SKIPLIST_HEIGHT - 1; level >= 0; level--) {
+        while (arc->next[level] != NULL && parabolic_intersection(arc->next[level]->prev[0]->location, arc->next[level]->location).y <= y) {
+            arc = arc->next[level];
+        }
+    }
     
-    if (left.y == right.y) {
-        return (left < right) ? left : right;
+    return arc;
+}
+
+// Adds an arc right above left, or starts the beachline if left is NULL.
+template <typename Scalar>
+Arc2D<Scalar> * Voronoi2D<Scalar>::add_arc(Point2D<Scalar> site, Arc2D<Scalar> * left, int height) {
+    
+    // The prev links are followed by the next links in one block.
+    Arc2D<Scalar> * arc;
+    Arc2D<Scalar> ** links;
+    if (!free_arcs[height - 1].empty()) {
+        arc = free_arcs[height - 1].back();
+        free_arcs[height - 1].pop_back();
+        links = arc->prev;
     }
-    if (left.x == right.x) {
-        ret.y = (left.y + right.y) / 2.f;
+    else {
+        arc = arcs.allocate();
+        links = arc_links.allocate(2 * height);
     }
-    else if (right.x == sweep_line) {
-        ret.y = right.y;
+    
+    *arc = Arc2D<Scalar>(site, height);
+    arc->prev = links;
+    arc->next = links + height;
+    
+    for (int i = 0; i < height; i++) {
+        if (left != NULL) {
+            while (left->height <= i) {
+                left = left->prev[left->height - 1];
+            }
+            arc->prev[i] = left;
+            arc->next[i] = left->next[i];
+            if (left->next[i] != NULL) {
+                left->next[i]->prev[i] = arc;
+            }
+            left->next[i] = arc;
+        }
+        else {
+            arc->prev[i] = arc->next[i] = NULL;
+        }
     }
-    else if (left.x == sweep_line) {
-        ret.y = left.y;
-        p = right;
+    
+    return arc;
+}
+
+template <typename Scalar>
+void Voronoi2D<Scalar>::remove_arc(Arc2D<Scalar> * arc) {
+    
+    if (arc->event != NULL) {
+        arc->event->is_valid = false;
+    }
+    
+    for (int i = 0; i < arc->height; i++) {
+        if (arc->prev[i] != NULL) {
+            arc->prev[i]->next[i] = arc->next[i];
+        }
+        if (arc->next[i] != NULL) {
+            arc->next[i]->prev[i] = arc->prev[i];
+        }
+    }
+    
+    // The links stay with the arc, so it can only be reused at the same height.
+    free_arcs[arc->height - 1].push_back(arc);
+}
+
+template <typename Scalar>
+CircleEvent2D<Scalar> * Voronoi2D<Scalar>::new_circle_event(Arc2D<Scalar> * arc, Point2D<Scalar> circumcenter, Scalar right_most_x) {
+    
+    CircleEvent2D<Scalar> * event;
+    if (!free_circle_events.empty()) {
+        event = free_circle_events.back();
+        free_circle_events.pop_back();
     }
     else {
-        float z0 = 2 * (left.x - sweep_line);
-        float z1 = 2 * (right.x - sweep_line);
-        
-        float a = 1 / z0 - 1 / z1;
-        float b = -2 * (left.y / z0 - right.y / z1);
-        float c = (left.y * left.y + left.x * left.x - sweep_line * sweep_line) / z0 - (right.y * right.y + right.x * right.x - sweep_line * sweep_line) / z1;
-        
-        ret.y = (-b - sqrt(b*b - 4*a*c)) / (2 * a);
+        event = circle_events.allocate();
     }
     
-    ret.x = (p.x * p.x + (p.y - ret.y) * (p.y - ret.y) - sweep_line * sweep_line) / (2 * p.x - 2 * sweep_line);
+    *event = CircleEvent2D<Scalar>(arc, circumcenter, right_most_x);
+    return event;
+}
+
+template <typename Scalar>
+void Voronoi2D<Scalar>::delete_circle_event(CircleEvent2D<Scalar> * event) {
     
-    //cout << ret;
+    free_circle_events.push_back(event);
+}
+
+template <typename Scalar>
+unsigned int Voronoi2D<Scalar>::add_vertex(Point2D<Scalar> point) {
     
-    return ret;
+    voronoi_vertices.push_back(point);
+    return (unsigned int)voronoi_vertices.size() - 1;
+}
+
+// Starts an edge between sites a and b at a vertex. It ends there too until it is finished.
+template <typename Scalar>
+int Voronoi2D<Scalar>::add_edge(unsigned int start_idx, Point2D<Scalar> a, Point2D<Scalar> b) {
+    
+    voronoi_edges.push_back(Edge2D(start_idx, start_idx));
+    voronoi_edge_sites.push_back(make_pair(a, b));
+    return (int)voronoi_edges.size() - 1;
 }
 
+// An edge is only finished once, later ends are ignored.
+template <typename Scalar>
+void Voronoi2D<Scalar>::finish_edge(int edge_idx, unsigned int end_idx) {
+    
+    Edge2D & edge = voronoi_edges[edge_idx];
+    if (edge.vidx[1] == edge.vidx[0]) {
+        edge.vidx[1] = end_idx;
+    }
+}
+
+// Heights are geometric so every level has about half the arcs of the one below.
+template <typename Scalar>
+int Voronoi2D<Scalar>::random_height() {
+    
+    int height = 1;
+    unsigned int bits = (unsigned int)height_random();
+    while (height < MAX_SKIPLIST_HEIGHT && (bits & 1)) {
+        height++;
+        bits >>= 1;
+    }
+    return height;
+}
 
+template class Voronoi::Voronoi2D<float>;
+template class Voronoi::Voronoi2D<double>;
@@ -15,112 +15,310 @@
 #include "math.h"
 #include <assert.h>
 #include <limits>
+#include <memory>
+#include <random>
+#include <utility>
 
-//#define INF numeric_limits<float>::max()
-#define INF 100000000.f
+#ifndef MAX_SKIPLIST_HEIGHT
+#define MAX_SKIPLIST_HEIGHT 15
+#endif
 
 //using namespace std;
 
 namespace Voronoi {
 
-    class Voronoi2D;
-    struct Point2D;
-    struct CircleEvent2D;
-    struct Arc2D;
-    struct HalfEdge2D;
+    /*
+     *  Everything planar is templated on the scalar type, float or double. Voronoi2D.cpp
+     *  builds both, so other scalars need their own instantiation there. A float site is
+     *  only as precise as its largest coordinate, so sites far from the origin should be
+     *  given as doubles, which cost little more.
+     */
+    template <typename Scalar> class Voronoi2D;
+    template <typename Scalar> struct Point2D;
+    template <typename Scalar> struct CircleEvent2D;
+    template <typename Scalar> struct Arc2D;
+    struct Edge2D;
+    template <typename T, int BLOCK_SIZE> class Arena2D;
+    template <typename Scalar> struct Strip2D;
+    template <typename Scalar> struct CellPolygons2D;
     
+    template <typename Scalar>
     struct Point2D {
         
-        Point2D(float _x = 0, float _y = 0) : x(_x), y(_y) {}
+        Point2D(Scalar _x = 0, Scalar _y = 0) : x(_x), y(_y) {}
         
         const friend bool operator<(const Point2D & left, const Point2D & right) {return left.x == right.x ? left.y < right.y : left.x < right.x;}
         const friend bool operator>(const Point2D & left, const Point2D & right) {return left.x == right.x ? left.y > right.y : left.x > right.x;}
         
         friend std::ostream & operator<<(std::ostream & out, const Point2D & p) {return out << "(" << p.x << ", " << p.y << ")\n";}
         
-        float x, y;
+        Scalar x, y;
     };
     
+    template <typename Scalar>
     struct CircleEvent2D {
         
-        CircleEvent2D(Arc2D * a, Point2D c, float x) : arc(a), circumcenter(c), right_most_x(x), is_valid(true) {}
+        CircleEvent2D(Arc2D<Scalar> * a = NULL, Point2D<Scalar> c = Point2D<Scalar>(), Scalar x = 0) : arc(a), circumcenter(c), right_most_x(x), is_valid(true) {}
         
-        float right_most_x;
+        Scalar right_most_x;
         
-        Point2D circumcenter;
+        Point2D<Scalar> circumcenter;
         
-        Arc2D * arc;
+        Arc2D<Scalar> * arc;
         
         bool is_valid;
         
     };
     
+    /*
+     *  The beachline is a skiplist of arcs sorted by y. Level 0 links every arc and
+     *  beach_head, the lowest arc, is as tall as the skiplist so searches start there.
+     */
+    template <typename Scalar>
+    struct Arc2D {
+        
+        Arc2D(Point2D<Scalar> l = Point2D<Scalar>(), int h = 0) : location(l), height(h), event(NULL), s0(-1), s1(-1) {}
+        
+        Point2D<Scalar> location;
+        int height;
+        Arc2D ** prev, ** next;
+        CircleEvent2D<Scalar> * event;
+        int s0, s1; // Indices of the edges below and above the arc, or -1
+    };
+    
+    /*
+     *  An edge between two voronoi vertices, as indices into get_voronoi_vertices().
+     *  While the sweep is running an edge that is not finished yet ends where it starts.
+     */
+    struct Edge2D {
+        
+        Edge2D(unsigned int start_idx = 0, unsigned int end_idx = 0) {
+            vidx[0] = start_idx;
+            vidx[1] = end_idx;
+        }
+        
+        unsigned int vidx[2];
+    };
+    
+    /*
+     *  Closed cell polygons, counterclockwise and without the first corner repeated. Cell i
+     *  is the cell of site site_index[i] of the input, and its corners are corners[corner_start[i]]
+     *  up to corners[corner_start[i + 1]].
+     */
+    template <typename Scalar>
+    struct CellPolygons2D {
+        
+        CellPolygons2D() : corner_start(1, 0) {}
+        
+        size_t size() const {return site_index.size();}
+        
+        void clear() {
+            site_index.clear();
+            corner_start.assign(1, 0);
+            corners.clear();
+        }
+        
+        std::vector<int> site_index;
+        std::vector<unsigned int> corner_start;
+        std::vector<Point2D<Scalar>> corners;
+    };
+    
+    /*
+     *  Hands out T's from blocks of BLOCK_SIZE. Nothing is given back until reset(),
+     *  which keeps the blocks so that the next sweep does not allocate them again.
+     */
+    template <typename T, int BLOCK_SIZE = 4096>
+    class Arena2D {
+        
+    public:
+        
+        Arena2D() : block(0), used(0) {}
+        
+        // count must not be more than BLOCK_SIZE.
+        T * allocate(int count = 1) {
+            if (block < blocks.size() && used + count > BLOCK_SIZE) {
+                block++;
+                used = 0;
+            }
+            if (block == blocks.size()) {
+                blocks.push_back(std::unique_ptr<T[]>(new T[BLOCK_SIZE]));
+            }
+            T * ret = &blocks[block][used];
+            used += count;
+            return ret;
+        }
+        
+        void reset() {
+            block = 0;
+            used = 0;
+        }
+        
+    private:
+        
+        std::vector<std::unique_ptr<T[]>> blocks;
+        
+        size_t block;
+        
+        int used;
+    };
+    
+    /*
+     *  All of the storage (arcs, circle events, queues and the output) is kept between
+     *  calls, so generating again with the same or fewer points does not allocate.
+     */
+    template <typename Scalar>
     class Voronoi2D {
         
     public:
         
-        void generate_voronoi_2D(float * points, int num_points, void (*render)(std::vector<HalfEdge2D *>, float), void (*sleep)());
+        Voronoi2D() : num_finite_vertices(0), beach_head(NULL) {}
+        
+        void generate_voronoi_2D(Scalar * points, int num_points, void (*render)(const std::vector<Point2D<Scalar>> &, const std::vector<Edge2D> &, Scalar), void (*sleep)());
+        
+        /*
+         *  Splits the sites into num_threads vertical strips with about as many sites in each
+         *  and sweeps every strip on its own thread. A strip is swept together with a halo of
+         *  sites from the strips next to it and the sites on the convex hull, and only keeps
+         *  the edges whose lower site (by x, then y) it owns. A strip then checks that no site
+         *  it did not sweep is inside the circle of a vertex of the cells it owns, and if one
+         *  is it sweeps again with a halo that reaches over that circle. The edges are the
+         *  same as the ones of generate_voronoi_2D, but vertices are only shared within a strip.
+         */
+        void generate_voronoi_2D_parallel(Scalar * points, int num_points, int num_threads);
+        
+        /*
+         *  Runs generate_voronoi_2D and clips the cell of every site to rect, given as {x0, y0,
+         *  x1, y1}, or to the bounding box of the sites if rect is NULL. A site outside the
+         *  rectangle only gets a cell if part of its cell is inside.
+         */
+        void generate_cell_polygons(Scalar * points, int num_points, const Scalar * rect = NULL);
+        
+        /*
+         *  The same cells, made one tile at a time so that only the sweep of one tile is in
+         *  memory. The rectangle is split into tiles_x by tiles_y tiles and a tile owns the sites
+         *  in it, or closest to it for sites outside the rectangle. A tile is swept with a halo
+         *  of the sites around it, and then again with every site left out that is closer to a
+         *  corner of one of its cells than the site of that cell, until there is none. sink is
+         *  called once per tile, and the cells it gets are only valid until it returns.
+         */
+        void generate_cell_polygons_tiled(Scalar * points, int num_points, int tiles_x, int tiles_y, void (*sink)(const CellPolygons2D<Scalar> & cells, void * data), void * data = NULL, const Scalar * rect = NULL);
+        
+        const CellPolygons2D<Scalar> & get_cell_polygons() const {return cell_polygons;}
+        
+        const std::vector<Point2D<Scalar>> & get_voronoi_vertices() const {return voronoi_vertices;}
         
-        std::vector<HalfEdge2D *> get_voronoi_edges() {return voronoi_edges;}
+        const std::vector<Edge2D> & get_voronoi_edges() const {return voronoi_edges;}
+        
+        // The two sites on either side of each edge, in the same order as the edges.
+        const std::vector<std::pair<Point2D<Scalar>, Point2D<Scalar>>> & get_voronoi_edge_sites() const {return voronoi_edge_sites;}
         
     private:
         
         struct PriorityQueueCompare {
-            bool operator()(const Point2D & left, const Point2D & right) {return left > right;}
-            bool operator()(const CircleEvent2D * left, const CircleEvent2D * right) {return left->right_most_x > right->right_most_x;}
+            bool operator()(const Point2D<Scalar> & left, const Point2D<Scalar> & right) {return left > right;}
+            bool operator()(const CircleEvent2D<Scalar> * left, const CircleEvent2D<Scalar> * right) {return left->right_most_x > right->right_most_x;}
         };
 
         
-        void handle_site_event(Point2D site);
+        void reset_sweep();
         
-        void handle_circle_event(CircleEvent2D * event);
+        void set_bounds(Scalar * points, int num_points);
         
-        bool does_intersect(Point2D point, Arc2D * arc, Point2D * ret);
+        void sweep(void (*render)(const std::vector<Point2D<Scalar>> &, const std::vector<Edge2D> &, Scalar), void (*sleep)());
         
-        Point2D parabolic_intersection(Point2D left, Point2D right);
+        bool circle_event_is_next();
         
-        void check_circle_event(Arc2D * arc);
+        void sweep_strip(const std::vector<Strip2D<Scalar>> * strips, int k, const std::vector<Point2D<Scalar>> * hull, Scalar halo);
         
-        bool make_circle(Point2D a, Point2D b, Point2D c, Point2D & circumcenter, float & right_most_x);
+        Scalar certify_strip(const std::vector<Strip2D<Scalar>> * strips, int k, Scalar cover_lo, Scalar cover_hi);
         
-        //vector<Point2D> voronoi_vertices;
+        void keep_strip_edges(Scalar lo, Scalar hi);
         
-        std::vector<HalfEdge2D *> voronoi_edges;
+        void copy_strip(const Voronoi2D * strip_sweep, size_t vertex_offset, size_t edge_offset);
         
-        std::priority_queue<CircleEvent2D, std::vector<CircleEvent2D *>, PriorityQueueCompare> circle_event_queue;
+        void clip_cells(const Scalar * rect, const Scalar * sites, int num_sites, int num_owned, const int * site_index);
         
-        Arc2D * beach_head;
+        bool certify_tile(const Scalar * points, const Scalar * box, int tiles_x, int tiles_y, int tile, const Scalar * cover, int num_covered);
         
-        float sweep_line;
+        void handle_site_event(Point2D<Scalar> site);
         
-        float X0, X1, Y0, Y1;
+        void handle_circle_event(CircleEvent2D<Scalar> * event);
         
-    };
-
-    struct HalfEdge2D {
+        Arc2D<Scalar> * find_arc(Scalar y);
         
-        HalfEdge2D(Point2D s) : start(s), end(), is_done(false) {}
+        Arc2D<Scalar> * add_arc(Point2D<Scalar> site, Arc2D<Scalar> * left, int height);
         
-        void finish(Point2D e) {
-            if (!is_done) {
-                end = e;
-                is_done = true;
-            }
-        }
+        void remove_arc(Arc2D<Scalar> * arc);
         
-        Point2D start, end;
+        CircleEvent2D<Scalar> * new_circle_event(Arc2D<Scalar> * arc, Point2D<Scalar> circumcenter, Scalar right_most_x);
         
-        bool is_done;
-    };
-    
-    struct Arc2D {
+        void delete_circle_event(CircleEvent2D<Scalar> * event);
+        
+        unsigned int add_vertex(Point2D<Scalar> point);
+        
+        int add_edge(unsigned int start_idx, Point2D<Scalar> a, Point2D<Scalar> b);
+        
+        void finish_edge(int edge_idx, unsigned int end_idx);
+        
+        int random_height();
+        
+        Scalar parabola_x(Point2D<Scalar> focus, Scalar y);
+        
+        Point2D<Scalar> parabolic_intersection(Point2D<Scalar> left, Point2D<Scalar> right);
+        
+        void check_circle_event(Arc2D<Scalar> * arc);
+        
+        bool make_circle(Point2D<Scalar> a, Point2D<Scalar> b, Point2D<Scalar> c, Point2D<Scalar> & circumcenter, Scalar & right_most_x);
+        
+        std::vector<Point2D<Scalar>> voronoi_vertices;
+        
+        std::vector<Edge2D> voronoi_edges;
+        
+        std::vector<std::pair<Point2D<Scalar>, Point2D<Scalar>>> voronoi_edge_sites;
+        
+        // Vertices from here on are where the unbounded edges were cut off at the end of the sweep.
+        unsigned int num_finite_vertices;
+        
+        std::priority_queue<Point2D<Scalar>, std::vector<Point2D<Scalar>>, PriorityQueueCompare> site_event_queue;
+        
+        std::priority_queue<CircleEvent2D<Scalar> *, std::vector<CircleEvent2D<Scalar> *>, PriorityQueueCompare> circle_event_queue;
+        
+        Arena2D<Arc2D<Scalar>> arcs;
+        
+        Arena2D<Arc2D<Scalar> *> arc_links;
+        
+        Arena2D<CircleEvent2D<Scalar>> circle_events;
+        
+        // Arcs that left the beachline, by height, and circle events that were handled.
+        std::vector<Arc2D<Scalar> *> free_arcs[MAX_SKIPLIST_HEIGHT];
+        
+        std::vector<CircleEvent2D<Scalar> *> free_circle_events;
+        
+        CellPolygons2D<Scalar> cell_polygons;
+        
+        // The input sites by tile, and the sites being swept for one tile with their input indices.
+        std::vector<int> tile_start, tile_sites;
+        std::vector<Scalar> tile_points;
+        std::vector<int> tile_index;
+        
+        // Scratch for clip_cells.
+        std::vector<int> site_order, neighbour_start;
+        std::vector<Point2D<Scalar>> neighbours, clipped[2];
+        
+        // One sweep per strip for generate_voronoi_2D_parallel, kept for the next call.
+        std::vector<std::unique_ptr<Voronoi2D>> strip_sweeps;
+        
+        // Skiplist heights, one generator per sweep so that strips do not share one.
+        std::mt19937 height_random;
+        
+        Arc2D<Scalar> * beach_head;
+        
+        Scalar sweep_line;
+        
+        Scalar X0, X1, Y0, Y1;
         
-        Arc2D(Point2D l, Arc2D * p = NULL, Arc2D * n = NULL) : location(l), prev(p), next(n), event(NULL), s0(NULL), s1(NULL) {}
+        Scalar tolerance;
         
-        Point2D location;
-        Arc2D * prev, * next;
-        CircleEvent2D * event;
-        HalfEdge2D * s0, * s1;
     };
 }
 
@@ -12,6 +12,7 @@
 
 #include "Voronoi2D.h"
 #include "voronoi_sphere.h"
+#include "voronoi_mesh.h"
 
 #define SPHERICAL_MODE
 
@@ -44,11 +45,16 @@ unsigned int seed = (unsigned int)time(NULL);
 
 VoronoiDiagramSphere voronoi_diagram;
 
+// The finished diagram as buffers, written once so that a frame takes one draw call for each kind of line.
+CellMeshSphere cell_mesh;
+vector<MeshVertexSphere> mesh_vertices;
+vector<unsigned int> mesh_voronoi_lines, mesh_delaunay_lines;
+
 #ifndef SPHERICAL_MODE
 float points[num_sites * 2];
 #endif
 
-void render_voronoi_sphere(VoronoiDiagramSphere voronoi_diagram, ArcSphere * beach_head = NULL, vector<VoronoiCellSphere> * cells = NULL, double sweep_line = 0)
+void render_voronoi_sphere(const VoronoiDiagramSphere & voronoi_diagram, const ArcSphere * beach_head = NULL, const vector<VoronoiCellSphere> * cells = NULL, double sweep_line = 0)
 {
     bool should_rotate = true;
     bool render_sites = true;
@@ -77,41 +83,63 @@ void render_voronoi_sphere(VoronoiDiagramSphere voronoi_diagram, ArcSphere * bea
     if (render_voronoi)
     {
         glColor3f(1, 1, 0);
-        glBegin(GL_LINES);
-            for (auto edge : voronoi_diagram.voronoi_edges)
-            {
-                PointCartesian start = voronoi_diagram.voronoi_vertices[edge.vidx[0]];
-                PointCartesian end = voronoi_diagram.voronoi_vertices[edge.vidx[1]];
-                
-                glVertex3f((float)start.x, (float)start.y, (float)start.z);
-                glVertex3f((float)end.x, (float)end.y, (float)end.z);
-            }
-        glEnd();
+        if (!mesh_vertices.empty())
+        {
+            glDrawElements(GL_LINES, (GLsizei)mesh_voronoi_lines.size(), GL_UNSIGNED_INT, mesh_voronoi_lines.data());
+        }
+        else
+        {
+            glBegin(GL_LINES);
+                for (auto edge : voronoi_diagram.voronoi_edges)
+                {
+                    PointCartesian start = voronoi_diagram.voronoi_vertices[edge.vidx[0]];
+                    PointCartesian end = voronoi_diagram.voronoi_vertices[edge.vidx[1]];
+                    
+                    glVertex3f((float)start.x, (float)start.y, (float)start.z);
+                    glVertex3f((float)end.x, (float)end.y, (float)end.z);
+                }
+            glEnd();
+        }
     }
     
     if (render_delaunay)
     {
         glColor3f(0, 0, 1);
-        glBegin(GL_LINES);
-            for (auto edge : voronoi_diagram.delaunay_edges)
-            {
-                PointCartesian start = voronoi_diagram.sites[edge.vidx[0]];
-                PointCartesian end = voronoi_diagram.sites[edge.vidx[1]];
-                glVertex3f((float)start.x, (float)start.y, (float)start.z);
-                glVertex3f((float)end.x, (float)end.y, (float)end.z);
-            }
-        glEnd();
+        if (!mesh_vertices.empty())
+        {
+            glDrawElements(GL_LINES, (GLsizei)mesh_delaunay_lines.size(), GL_UNSIGNED_INT, mesh_delaunay_lines.data());
+        }
+        else
+        {
+            glBegin(GL_LINES);
+                for (auto edge : voronoi_diagram.delaunay_edges)
+                {
+                    PointCartesian start = voronoi_diagram.sites[edge.vidx[0]];
+                    PointCartesian end = voronoi_diagram.sites[edge.vidx[1]];
+                    glVertex3f((float)start.x, (float)start.y, (float)start.z);
+                    glVertex3f((float)end.x, (float)end.y, (float)end.z);
+                }
+            glEnd();
+        }
     }
     
     if (render_sites)
     {
         glColor3f(1, 0, 0);
-        glBegin(GL_POINTS);
-            for (auto site : voronoi_diagram.sites)
-            {
-                glVertex3f((float)site.x, (float)site.y, (float)site.z);
-            }
-        glEnd();
+        if (!mesh_vertices.empty())
+        {
+            // The first vertex of every cell is its site.
+            glDrawElements(GL_POINTS, (GLsizei)voronoi_diagram.sites.size(), GL_UNSIGNED_INT, cell_mesh.vertex_start.data());
+        }
+        else
+        {
+            glBegin(GL_POINTS);
+                for (auto site : voronoi_diagram.sites)
+                {
+                    glVertex3f((float)site.x, (float)site.y, (float)site.z);
+                }
+            glEnd();
+        }
     }
     
     if (render_sweep_line)
@@ -130,7 +158,7 @@ void render_voronoi_sphere(VoronoiDiagramSphere voronoi_diagram, ArcSphere * bea
     {
         glColor3f(1, 0, 0);
         glBegin(GL_LINE_LOOP);
-        ArcSphere * cur = beach_head;
+        const ArcSphere * cur = beach_head;
         do
         {
             cur = cur->next[0];
@@ -174,7 +202,7 @@ void render_points(float * points, int num_points, float r, float g, float b)
     glEnd();
 }
 
-void render_edges_2d(vector<HalfEdge2D *> edges)
+void render_edges_2d(const vector<Point2D<float>> & vertices, const vector<Edge2D> & edges)
 {
     
     glLineWidth(1.f);
@@ -186,8 +214,8 @@ void render_edges_2d(vector<HalfEdge2D *> edges)
         glColor3f(0.f, 0.f, 0.f);
         
         glBegin(GL_LINES);
-            glVertex3f(edges[i]->start.x, edges[i]->start.y, 0.f);
-            glVertex3f(edges[i]->end.x, edges[i]->end.y, 0.f);
+            glVertex3f(vertices[edges[i].vidx[0]].x, vertices[edges[i].vidx[0]].y, 0.f);
+            glVertex3f(vertices[edges[i].vidx[1]].x, vertices[edges[i].vidx[1]].y, 0.f);
         glEnd();
         
         glColor3f(0.f, 1.f, 0.f);
@@ -195,13 +223,13 @@ void render_edges_2d(vector<HalfEdge2D *> edges)
 }
 
 #ifndef SPHERICAL_MODE
-void render_2d(vector<HalfEdge2D *> edges, float sweep_line = 0)
+void render_2d(const vector<Point2D<float>> & vertices, const vector<Edge2D> & edges, float sweep_line = 0)
 {
     glClear(GL_COLOR_BUFFER_BIT);
     glLoadIdentity();
 
     render_points(points, num_sites, 1, 0, 0);
-    render_edges_2d(edges);
+    render_edges_2d(vertices, edges);
     
     glBegin(GL_LINES);
         glVertex3f(sweep_line, 0, 0);
@@ -335,10 +363,20 @@ int main(int argc, const char * argv[])
     
     cout << "Generated voronoi from " << verts.size() << " sites in " << run_time.count() << " seconds.\n";
     
+    layout_cell_mesh(voronoi_diagram, &cell_mesh);
+    mesh_vertices.resize(cell_mesh.num_vertices());
+    mesh_voronoi_lines.resize(cell_mesh.num_line_indices());
+    mesh_delaunay_lines.resize(cell_mesh.num_line_indices());
+    write_cell_mesh(voronoi_diagram, cell_mesh, mesh_vertices.data(), NULL, mesh_voronoi_lines.data(), mesh_delaunay_lines.data());
+    
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glVertexPointer(3, GL_FLOAT, sizeof(MeshVertexSphere), &mesh_vertices[0].x);
+    
 #else
-    Voronoi2D voronoi;
+    Voronoi2D<float> voronoi;
     voronoi.generate_voronoi_2D(points, num_sites, render_2d, sleep);
-    vector<HalfEdge2D *> edges = voronoi.get_voronoi_edges();
+    const vector<Point2D<float>> & vertices = voronoi.get_voronoi_vertices();
+    const vector<Edge2D> & edges = voronoi.get_voronoi_edges();
 #endif
     
     while(true)
@@ -347,7 +385,7 @@ int main(int argc, const char * argv[])
 #ifdef SPHERICAL_MODE
         render_voronoi_sphere(voronoi_diagram);
 #else
-        render_2d(edges);
+        render_2d(vertices, edges);
 #endif
         
         while (SDL_PollEvent(&event))
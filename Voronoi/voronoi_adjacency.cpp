@@ -0,0 +1,224 @@
+//
+//  voronoi_adjacency.cpp
+//  Voronoi
+//
+//  Copyright © 2016 Ellis Sparky Hoag. All rights reserved.
+//
+
+#include "voronoi_adjacency.h"
+
+using namespace std;
+
+namespace Voronoi {
+
+    // Below this many sites (or centers, or sites in a level of a search) one thread does the work.
+    static const size_t min_sites_per_thread = 1024;
+
+    static int count_threads(int num_threads, size_t count)
+    {
+        if (num_threads <= 0) {num_threads = max(1, (int)thread::hardware_concurrency());}
+        return (int)min<size_t>(num_threads, max<size_t>(1, count / min_sites_per_thread));
+    }
+
+    // Runs job(k, first, last) for the k-th of num_threads even ranges of [0, count), range 0 on the calling thread.
+    template <typename Job>
+    static void run_ranges(int num_threads, size_t count, const Job & job)
+    {
+        vector<thread> threads;
+        for (int k = 1; k < num_threads; k++)
+        {
+            threads.push_back(thread(job, k, count * k / num_threads, count * (k + 1) / num_threads));
+        }
+        job(0, 0, count / num_threads);
+
+        for (auto & t : threads)
+        {
+            t.join();
+        }
+    }
+
+    void compute_site_adjacency(const VoronoiDiagramSphere & voronoi_diagram, SiteListsSphere * adjacency, int num_threads)
+    {
+        unsigned int num_sites = (unsigned int)voronoi_diagram.sites.size();
+        vector<unsigned int> & offsets = adjacency->offsets;
+        vector<unsigned int> & sites = adjacency->sites;
+
+        // Bucket every edge under both of its sites.
+        offsets.assign(num_sites + 1, 0);
+        for (const Edge & edge : voronoi_diagram.delaunay_edges)
+        {
+            if (edge.vidx[0] == edge.vidx[1]) {continue;}
+            offsets[edge.vidx[0] + 1]++;
+            offsets[edge.vidx[1] + 1]++;
+        }
+        for (unsigned int i = 0; i < num_sites; i++)
+        {
+            offsets[i + 1] += offsets[i];
+        }
+
+        sites.resize(offsets[num_sites]);
+        vector<unsigned int> next_site(offsets.begin(), offsets.end() - 1);
+        for (const Edge & edge : voronoi_diagram.delaunay_edges)
+        {
+            if (edge.vidx[0] == edge.vidx[1]) {continue;}
+            sites[next_site[edge.vidx[0]]++] = edge.vidx[1];
+            sites[next_site[edge.vidx[1]]++] = edge.vidx[0];
+        }
+
+        // Sort every list and count what is left once the repeats are gone.
+        vector<unsigned int> & num_unique = next_site;
+        run_ranges(count_threads(num_threads, num_sites), num_sites, [&](int, size_t first, size_t last)
+        {
+            for (size_t i = first; i < last; i++)
+            {
+                vector<unsigned int>::iterator begin = sites.begin() + offsets[i];
+                sort(begin, sites.begin() + offsets[i + 1]);
+                num_unique[i] = (unsigned int)(unique(begin, sites.begin() + offsets[i + 1]) - begin);
+            }
+        });
+
+        // Every list moves down over the repeats before it.
+        unsigned int kept = 0;
+        for (unsigned int i = 0; i < num_sites; i++)
+        {
+            unsigned int start = offsets[i];
+            offsets[i] = kept;
+            copy(sites.begin() + start, sites.begin() + start + num_unique[i], sites.begin() + kept);
+            kept += num_unique[i];
+        }
+        offsets[num_sites] = kept;
+        sites.resize(kept);
+    }
+
+    // Takes the sites in the sorted range [first, last) out of the sorted values[0, count) and returns how many are left.
+    static size_t remove_sorted(vector<unsigned int> & values, size_t count, vector<unsigned int>::const_iterator first, vector<unsigned int>::const_iterator last)
+    {
+        size_t kept = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            while (first != last && *first < values[i]) {first++;}
+            if (first == last || *first != values[i]) {values[kept++] = values[i];}
+        }
+        return kept;
+    }
+
+    /*
+     *  Appends the ring of center to ring_sites. Every site next to ring d is in ring d - 1,
+     *  ring d or ring d + 1, so the last two rings are all a site has to be looked for in.
+     */
+    static void find_k_ring(const SiteListsSphere & adjacency, unsigned int center, int k, vector<unsigned int> & ring_sites, vector<unsigned int> & next_ring, vector<unsigned int> & found)
+    {
+        // Ring 0 is the center, which is not in the answer.
+        found.assign(1, center);
+        size_t prev_ring_start = 0, prev_ring_end = 0, cur_ring_start = 0, cur_ring_end = 1;
+        for (int d = 1; d <= k && cur_ring_end > cur_ring_start; d++)
+        {
+            next_ring.clear();
+            for (size_t i = cur_ring_start; i < cur_ring_end; i++)
+            {
+                unsigned int site = found[i];
+                next_ring.insert(next_ring.end(), adjacency.sites.begin() + adjacency.offsets[site], adjacency.sites.begin() + adjacency.offsets[site + 1]);
+            }
+            sort(next_ring.begin(), next_ring.end());
+            size_t num_next = unique(next_ring.begin(), next_ring.end()) - next_ring.begin();
+
+            // found holds rings d - 2 and d - 1, each sorted.
+            num_next = remove_sorted(next_ring, num_next, found.begin() + prev_ring_start, found.begin() + prev_ring_end);
+            num_next = remove_sorted(next_ring, num_next, found.begin() + cur_ring_start, found.begin() + cur_ring_end);
+            vector<unsigned int>::iterator next_end = next_ring.begin() + num_next;
+
+            found.erase(found.begin(), found.begin() + cur_ring_start);
+            prev_ring_start = 0;
+            prev_ring_end = cur_ring_end - cur_ring_start;
+            cur_ring_start = prev_ring_end;
+            found.insert(found.end(), next_ring.begin(), next_end);
+            cur_ring_end = found.size();
+
+            ring_sites.insert(ring_sites.end(), next_ring.begin(), next_end);
+        }
+    }
+
+    void compute_k_rings(const SiteListsSphere & adjacency, const vector<unsigned int> & centers, int k, SiteListsSphere * rings, int num_threads)
+    {
+        size_t num_centers = centers.size();
+        num_threads = count_threads(num_threads, num_centers);
+
+        // Every thread finds the rings of its centers on its own, and then they are copied into place.
+        vector<vector<unsigned int>> thread_sites(num_threads);
+        rings->offsets.assign(num_centers + 1, 0);
+        run_ranges(num_threads, num_centers, [&](int thread_idx, size_t first, size_t last)
+        {
+            vector<unsigned int> & ring_sites = thread_sites[thread_idx];
+            vector<unsigned int> next_ring, found;
+            for (size_t i = first; i < last; i++)
+            {
+                size_t start = ring_sites.size();
+                find_k_ring(adjacency, centers[i], k, ring_sites, next_ring, found);
+                rings->offsets[i + 1] = (unsigned int)(ring_sites.size() - start);
+            }
+        });
+
+        for (size_t i = 0; i < num_centers; i++)
+        {
+            rings->offsets[i + 1] += rings->offsets[i];
+        }
+        rings->sites.resize(rings->offsets[num_centers]);
+
+        run_ranges(num_threads, num_centers, [&](int thread_idx, size_t first, size_t)
+        {
+            copy(thread_sites[thread_idx].begin(), thread_sites[thread_idx].end(), rings->sites.begin() + rings->offsets[first]);
+        });
+    }
+
+    void compute_hops(const SiteListsSphere & adjacency, const vector<unsigned int> & sources, int max_hops, vector<int> * hops, int num_threads)
+    {
+        hops->assign(adjacency.size(), -1);
+
+        vector<unsigned int> frontier, next_frontier;
+        for (unsigned int source : sources)
+        {
+            if ((*hops)[source] < 0)
+            {
+                (*hops)[source] = 0;
+                frontier.push_back(source);
+            }
+        }
+
+        /*
+         *  Each level is found in two steps. The threads collect the unseen neighbours of
+         *  their part of the frontier while hops is only read, and then this thread marks
+         *  them in thread order, which takes out the ones that were collected twice.
+         */
+        if (num_threads <= 0) {num_threads = max(1, (int)thread::hardware_concurrency());}
+        vector<vector<unsigned int>> found(num_threads);
+        for (int level = 1; !frontier.empty() && (max_hops < 0 || level <= max_hops); level++)
+        {
+            int level_threads = count_threads(num_threads, frontier.size());
+            run_ranges(level_threads, frontier.size(), [&](int thread_idx, size_t first, size_t last)
+            {
+                vector<unsigned int> & unseen = found[thread_idx];
+                unseen.clear();
+                for (size_t i = first; i < last; i++)
+                {
+                    unsigned int site = frontier[i];
+                    for (unsigned int k = adjacency.offsets[site]; k < adjacency.offsets[site + 1]; k++)
+                    {
+                        if ((*hops)[adjacency.sites[k]] < 0) {unseen.push_back(adjacency.sites[k]);}
+                    }
+                }
+            });
+
+            next_frontier.clear();
+            for (int t = 0; t < level_threads; t++)
+            {
+                for (unsigned int site : found[t])
+                {
+                    if ((*hops)[site] >= 0) {continue;}
+                    (*hops)[site] = level;
+                    next_frontier.push_back(site);
+                }
+            }
+            frontier.swap(next_frontier);
+        }
+    }
+}
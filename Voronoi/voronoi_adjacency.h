@@ -0,0 +1,54 @@
+//
+//  voronoi_adjacency.h
+//  Voronoi
+//
+//  Copyright © 2016 Ellis Sparky Hoag. All rights reserved.
+//
+
+#ifndef VoronoiAdjacency_h
+#define VoronoiAdjacency_h
+
+#include "voronoi_sphere.h"
+
+namespace Voronoi
+{
+    /*
+     *  Lists of sites in compressed sparse row form: list i is sites[offsets[i]] to
+     *  sites[offsets[i + 1] - 1]. Two arrays hold every list, so there is no allocation
+     *  per list and a walk over neighbouring lists stays in cache.
+     */
+    struct SiteListsSphere
+    {
+        std::vector<unsigned int> offsets, sites;
+
+        size_t size() const {return offsets.empty() ? 0 : offsets.size() - 1;}
+    };
+
+    /*
+     *  Sets adjacency to one list per site of voronoi_diagram, holding its delaunay neighbours
+     *  sorted and without repeats (the sweeps can give the same delaunay edge more than once).
+     *  The lists are sorted on num_threads threads (all the hardware threads if it is 0).
+     *  adjacency keeps its capacity between calls.
+     */
+    void compute_site_adjacency(const VoronoiDiagramSphere & voronoi_diagram, SiteListsSphere * adjacency, int num_threads = 0);
+
+    /*
+     *  Sets rings to one list per site of centers, holding every site within k delaunay
+     *  edges of it except itself. The sites one edge away come first, then the ones two
+     *  edges away and so on, each in order of index. Only the last two rings are kept to
+     *  tell which sites have been seen, so a query costs about the size of its answer. The
+     *  centers are split between num_threads threads (all the hardware threads if it is 0).
+     */
+    void compute_k_rings(const SiteListsSphere & adjacency, const std::vector<unsigned int> & centers, int k, SiteListsSphere * rings, int num_threads = 0);
+
+    /*
+     *  A breadth first search from all of sources at once. Sets hops[i] to the number of
+     *  delaunay edges between site i and the nearest source, or to -1 if that is more than
+     *  max_hops (max_hops < 0 for no limit). Every level of the search large enough to be
+     *  worth it is split between num_threads threads (all the hardware threads if it is 0),
+     *  and the answer is the same for any number of threads.
+     */
+    void compute_hops(const SiteListsSphere & adjacency, const std::vector<unsigned int> & sources, int max_hops, std::vector<int> * hops, int num_threads = 0);
+}
+
+#endif /* VoronoiAdjacency_h */
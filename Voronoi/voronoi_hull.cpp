@@ -0,0 +1,900 @@
+//
+//  voronoi_hull.cpp
+//  Voronoi
+//
+//  Copyright © 2016 Ellis Sparky Hoag. All rights reserved.
+//
+
+#include "voronoi_hull.h"
+
+#include <random>
+
+#ifdef __FAST_MATH__
+#error "voronoi_hull.cpp needs IEEE rounding for its exact arithmetic, build it without -ffast-math"
+#endif
+
+using namespace std;
+
+namespace Voronoi {
+
+    /*
+     *  Exact sums of products of doubles as nonoverlapping expansions, from Shewchuk,
+     *  "Adaptive Precision Floating-Point Arithmetic and Fast Robust Geometric Predicates".
+     */
+    static inline void two_sum(double a, double b, double & sum, double & error)
+    {
+        sum = a + b;
+        double b_virtual = sum - a;
+        double a_virtual = sum - b_virtual;
+        error = (a - a_virtual) + (b - b_virtual);
+    }
+
+    static inline void two_product(double a, double b, double & product, double & error)
+    {
+        product = a * b;
+#ifdef FP_FAST_FMA
+        error = fma(a, b, -product);
+#else
+        // Dekker's product, with both factors split into halves of 26 bits.
+        const double splitter = 134217729.0;
+        double c = splitter * a;
+        double a_hi = c - (c - a);
+        double a_lo = a - a_hi;
+        c = splitter * b;
+        double b_hi = c - (c - b);
+        double b_lo = b - b_hi;
+        error = a_lo * b_lo - (((product - a_hi * b_hi) - a_lo * b_hi) - a_hi * b_lo);
+#endif
+    }
+
+    struct ExactSum
+    {
+        ExactSum() : length(0) {}
+
+        void add(double b)
+        {
+            int kept = 0;
+            for (int i = 0; i < length; i++)
+            {
+                double sum, error;
+                two_sum(b, terms[i], sum, error);
+                b = sum;
+                if (error != 0) {terms[kept++] = error;}
+            }
+            if (b != 0) {terms[kept++] = b;}
+            length = kept;
+        }
+
+        // Adds sign * x * y * z, which is four doubles.
+        void add_product(double x, double y, double z, double sign)
+        {
+            double xy, xy_error, high, high_error, low, low_error;
+            two_product(x, y, xy, xy_error);
+            two_product(xy, z, high, high_error);
+            two_product(xy_error, z, low, low_error);
+            add(sign * low_error);
+            add(sign * low);
+            add(sign * high_error);
+            add(sign * high);
+        }
+
+        // The largest term is the last one and has the sign of the sum.
+        int sign() const {return (length == 0) ? 0 : ((terms[length - 1] > 0) ? 1 : -1);}
+
+        // A 4x4 determinant adds up 96 doubles, and every add keeps at most one more term.
+        double terms[96];
+
+        int length;
+    };
+
+    // Adds sign * p . (q x r).
+    static void add_det3(ExactSum & sum, const PointCartesian & p, const PointCartesian & q, const PointCartesian & r, double sign)
+    {
+        sum.add_product(p.x, q.y, r.z, sign);
+        sum.add_product(p.x, q.z, r.y, -sign);
+        sum.add_product(p.y, q.z, r.x, sign);
+        sum.add_product(p.y, q.x, r.z, -sign);
+        sum.add_product(p.z, q.x, r.y, sign);
+        sum.add_product(p.z, q.y, r.x, -sign);
+    }
+
+    /*
+     *  The exact sign of the determinant with the rows (rows[i], is_lifted[i] ? 1 : 0),
+     *  expanded along its last column.
+     */
+    static int det4_sign(const PointCartesian rows[4], const bool is_lifted[4])
+    {
+        ExactSum sum;
+        for (int skip = 0; skip < 4; skip++)
+        {
+            if (!is_lifted[skip]) {continue;}
+
+            const PointCartesian * minor[3];
+            int k = 0;
+            for (int i = 0; i < 4; i++)
+            {
+                if (i != skip) {minor[k++] = &rows[i];}
+            }
+            add_det3(sum, *minor[0], *minor[1], *minor[2], (skip % 2 == 0) ? -1 : 1);
+        }
+        return sum.sign();
+    }
+
+    // The direction of the second tie break. Its coordinates are nothing special, so it is never in the plane of two sites and the center in practice.
+    static const PointCartesian tie_direction(0.2787230876894358, 0.8177520580779547, 0.5034023427939563);
+
+    int orient_sites(const PointCartesian & a, unsigned int a_idx, const PointCartesian & b, unsigned int b_idx, const PointCartesian & c, unsigned int c_idx, const PointCartesian & d, unsigned int d_idx)
+    {
+        /*
+         *  The determinant of (a - d, b - d, c - d) is negative if d is outside. It is worked
+         *  out in doubles first, and Shewchuk's first error bound for orient3d says whether
+         *  its sign can be trusted, which it can for nearly every call.
+         */
+        Real adx = a.x - d.x, ady = a.y - d.y, adz = a.z - d.z;
+        Real bdx = b.x - d.x, bdy = b.y - d.y, bdz = b.z - d.z;
+        Real cdx = c.x - d.x, cdy = c.y - d.y, cdz = c.z - d.z;
+
+        Real bdxcdy = bdx * cdy, cdxbdy = cdx * bdy;
+        Real cdxady = cdx * ady, adxcdy = adx * cdy;
+        Real adxbdy = adx * bdy, bdxady = bdx * ady;
+
+        Real det = adz * (bdxcdy - cdxbdy) + bdz * (cdxady - adxcdy) + cdz * (adxbdy - bdxady);
+        Real permanent = (abs(bdxcdy) + abs(cdxbdy)) * abs(adz) + (abs(cdxady) + abs(adxcdy)) * abs(bdz) + (abs(adxbdy) + abs(bdxady)) * abs(cdz);
+        Real bound = 7.771561172376103e-16 * permanent;
+        if (det > bound) {return -1;}
+        if (det < -bound) {return 1;}
+
+        // The same determinant exactly, as the 4x4 one with rows (site, 1). The sites are sorted by index so the tie breaks do not depend on the order of the arguments.
+        PointCartesian rows[4] = {a, b, c, d};
+        unsigned int ids[4] = {a_idx, b_idx, c_idx, d_idx};
+        int parity = 1;
+        for (int i = 0; i < 3; i++)
+        {
+            for (int k = 0; k < 3 - i; k++)
+            {
+                if (ids[k] > ids[k + 1])
+                {
+                    swap(ids[k], ids[k + 1]);
+                    swap(rows[k], rows[k + 1]);
+                    parity = -parity;
+                }
+            }
+        }
+
+        // Expanded along the last column, it is the sum of the 3x3 minors with the signs -, +, -, +.
+        ExactSum minors[4], sum;
+        for (int skip = 0; skip < 4; skip++)
+        {
+            add_det3(minors[skip], rows[(skip == 0) ? 1 : 0], rows[(skip <= 1) ? 2 : 1], rows[(skip <= 2) ? 3 : 2], 1);
+            for (int i = 0; i < minors[skip].length; i++)
+            {
+                sum.add((skip % 2 == 0) ? -minors[skip].terms[i] : minors[skip].terms[i]);
+            }
+        }
+        int sign = sum.sign();
+
+        // Pushing site k out to (1 + e) * site scales its row to (site, 1 - e) to first order, which takes e times minor k with its sign above from the determinant.
+        for (int k = 3; k >= 0 && sign == 0; k--)
+        {
+            sign = (k % 2 == 0) ? minors[k].sign() : -minors[k].sign();
+        }
+
+        // All four minors are 0 if the four sites are on a great circle, which moving site k by e * tie_direction takes them off.
+        bool is_lifted[4] = {true, true, true, true};
+        for (int k = 3; k >= 0 && sign == 0; k--)
+        {
+            PointCartesian site = rows[k];
+            rows[k] = tie_direction;
+            is_lifted[k] = false;
+            sign = det4_sign(rows, is_lifted);
+            rows[k] = site;
+            is_lifted[k] = true;
+        }
+
+        return -parity * sign;
+    }
+
+    static inline Real dot(const PointCartesian & a, const PointCartesian & b)
+    {
+        return a.x * b.x + a.y * b.y + a.z * b.z;
+    }
+
+    static inline Real angle_between(const PointCartesian & a, const PointCartesian & b)
+    {
+        PointCartesian normal = PointCartesian::cross_product(a, b);
+        return atan2(sqrt(dot(normal, normal)), dot(a, b));
+    }
+
+    static inline bool is_outside(const HullScratchSphere * scratch, const HullFaceSphere & face, int point)
+    {
+        const vector<PointCartesian> & points = scratch->points;
+        const vector<unsigned int> & ids = scratch->point_ids;
+        return orient_sites(points[face.v[0]], ids[face.v[0]], points[face.v[1]], ids[face.v[1]], points[face.v[2]], ids[face.v[2]], points[point], ids[point]) > 0;
+    }
+
+    static int add_face(HullScratchSphere * scratch, unsigned int a, unsigned int b, unsigned int c)
+    {
+        int face_idx;
+        if (scratch->free_faces.empty())
+        {
+            face_idx = (int)scratch->faces.size();
+            scratch->faces.push_back(HullFaceSphere());
+        }
+        else
+        {
+            face_idx = scratch->free_faces.back();
+            scratch->free_faces.pop_back();
+        }
+
+        HullFaceSphere & face = scratch->faces[face_idx];
+        face.v[0] = a;
+        face.v[1] = b;
+        face.v[2] = c;
+        face.adj[0] = face.adj[1] = face.adj[2] = -1;
+        face.first_conflict = -1;
+        face.visit_stamp = 0;
+        face.is_visible = false;
+        face.is_dead = false;
+        return face_idx;
+    }
+
+    static inline void queue_conflict(HullScratchSphere * scratch, int point, int face)
+    {
+        scratch->point_face[point] = face;
+        scratch->next_conflict[point] = scratch->faces[face].first_conflict;
+        scratch->faces[face].first_conflict = point;
+    }
+
+    /*
+     *  Adds point to the hull. The faces it is outside of are found from the face it is
+     *  queued on, they are replaced by a cone from the point to their boundary, and the
+     *  points queued on them move to the first new face they are outside of.
+     */
+    static void add_point(HullScratchSphere * scratch, int point)
+    {
+        vector<HullFaceSphere> & faces = scratch->faces;
+        vector<int> & visible_faces = scratch->visible_faces;
+        vector<int> & new_faces = scratch->new_faces;
+        vector<int> & stack = scratch->stack;
+        unsigned int stamp = ++scratch->visit_stamp;
+
+        visible_faces.clear();
+        new_faces.clear();
+        stack.clear();
+
+        int first_face = scratch->point_face[point];
+        faces[first_face].visit_stamp = stamp;
+        faces[first_face].is_visible = true;
+        stack.push_back(first_face);
+
+        while (!stack.empty())
+        {
+            int face = stack.back();
+            stack.pop_back();
+            visible_faces.push_back(face);
+
+            for (int i = 0; i < 3; i++)
+            {
+                HullFaceSphere & neighbour = faces[faces[face].adj[i]];
+                if (neighbour.visit_stamp == stamp) {continue;}
+
+                neighbour.visit_stamp = stamp;
+                neighbour.is_visible = is_outside(scratch, neighbour, point);
+                if (neighbour.is_visible) {stack.push_back(faces[face].adj[i]);}
+            }
+        }
+
+        // One new face on every edge between a visible face and a hidden one.
+        for (int face : visible_faces)
+        {
+            for (int i = 0; i < 3; i++)
+            {
+                int neighbour = faces[face].adj[i];
+                if (faces[neighbour].is_visible) {continue;}
+
+                unsigned int start = faces[face].v[i];
+                unsigned int end = faces[face].v[(i + 1) % 3];
+                int new_face = add_face(scratch, start, end, point);
+                faces[new_face].adj[0] = neighbour;
+                for (int k = 0; k < 3; k++)
+                {
+                    if (faces[neighbour].v[k] == end) {faces[neighbour].adj[k] = new_face;}
+                }
+                scratch->horizon_face[start] = new_face;
+                new_faces.push_back(new_face);
+            }
+        }
+
+        // The new face after (start, end, point) around the point is the one that starts at end.
+        for (int new_face : new_faces)
+        {
+            int next_face = scratch->horizon_face[faces[new_face].v[1]];
+            faces[new_face].adj[1] = next_face;
+            faces[next_face].adj[2] = new_face;
+        }
+        for (int new_face : new_faces)
+        {
+            scratch->horizon_face[faces[new_face].v[0]] = -1;
+        }
+
+        for (int face : visible_faces)
+        {
+            int queued = faces[face].first_conflict;
+            while (queued >= 0)
+            {
+                int next_queued = scratch->next_conflict[queued];
+                scratch->point_face[queued] = -1;
+                if (queued != point)
+                {
+                    for (int new_face : new_faces)
+                    {
+                        if (is_outside(scratch, faces[new_face], queued))
+                        {
+                            queue_conflict(scratch, queued, new_face);
+                            break;
+                        }
+                    }
+                }
+                queued = next_queued;
+            }
+            faces[face].first_conflict = -1;
+            faces[face].is_dead = true;
+            scratch->free_faces.push_back(face);
+        }
+    }
+
+    /*
+     *  Clears the hull of scratch and starts it with a tetrahedron of the first three points
+     *  and the next one off their plane, which is moved to points[3]. Returns false if there
+     *  are fewer than four points or they are all on one plane.
+     */
+    static bool start_hull(HullScratchSphere * scratch)
+    {
+        vector<HullFaceSphere> & faces = scratch->faces;
+        vector<PointCartesian> & points = scratch->points;
+        vector<unsigned int> & ids = scratch->point_ids;
+        int num_points = (int)points.size();
+
+        faces.clear();
+        scratch->free_faces.clear();
+        scratch->point_face.assign(num_points, -1);
+        scratch->next_conflict.assign(num_points, -1);
+        scratch->horizon_face.assign(num_points, -1);
+        scratch->visit_stamp = 0;
+        if (num_points < 4) {return false;}
+
+        // The first tetrahedron is the first three points and the next one off their plane.
+        int side = 0;
+        for (int i = 3; i < num_points; i++)
+        {
+            side = orient_sites(points[0], ids[0], points[1], ids[1], points[2], ids[2], points[i], ids[i]);
+            if (side != 0)
+            {
+                swap(points[3], points[i]);
+                swap(ids[3], ids[i]);
+                break;
+            }
+        }
+        if (side == 0) {return false;}
+
+        unsigned int second = (side > 0) ? 2 : 1;
+        unsigned int third = (side > 0) ? 1 : 2;
+        add_face(scratch, 0, second, third);
+        add_face(scratch, 0, 3, second);
+        add_face(scratch, second, 3, third);
+        add_face(scratch, third, 3, 0);
+
+        for (int face = 0; face < 4; face++)
+        {
+            for (int i = 0; i < 3; i++)
+            {
+                unsigned int start = faces[face].v[i];
+                unsigned int end = faces[face].v[(i + 1) % 3];
+                for (int other = 0; other < 4; other++)
+                {
+                    for (int k = 0; k < 3; k++)
+                    {
+                        if (faces[other].v[k] == end && faces[other].v[(k + 1) % 3] == start) {faces[face].adj[i] = other;}
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    /*
+     *  Builds the hull of scratch->points with a randomized incremental hull: every point not
+     *  in the hull yet is queued on one face it is outside of. The points are added in their
+     *  order, so the caller shuffles them. Returns false if there are fewer than four points
+     *  or they are all on one plane.
+     */
+    static bool build_hull(HullScratchSphere * scratch)
+    {
+        const vector<HullFaceSphere> & faces = scratch->faces;
+        int num_points = (int)scratch->points.size();
+
+        if (!start_hull(scratch)) {return false;}
+
+        for (int i = 4; i < num_points; i++)
+        {
+            for (int face = 0; face < 4; face++)
+            {
+                if (is_outside(scratch, faces[face], i))
+                {
+                    queue_conflict(scratch, i, face);
+                    break;
+                }
+            }
+        }
+
+        // A point that is outside no face is inside the hull (a repeated site) and is left out.
+        for (int i = 4; i < num_points; i++)
+        {
+            if (scratch->point_face[i] >= 0) {add_point(scratch, i);}
+        }
+        return true;
+    }
+
+    /*
+     *  Works out the unit normal of every face of the hull in scratch, which is 0 for a face
+     *  between two copies of one site.
+     */
+    static void compute_face_normals(HullScratchSphere * scratch)
+    {
+        const vector<HullFaceSphere> & faces = scratch->faces;
+        const vector<PointCartesian> & points = scratch->points;
+        const vector<unsigned int> & ids = scratch->point_ids;
+
+        scratch->face_normals.resize(faces.size());
+        for (unsigned int f = 0; f < faces.size(); f++)
+        {
+            const HullFaceSphere & face = faces[f];
+            if (face.is_dead) {continue;}
+
+            // Start from the site with the smallest index, so every patch rounds the same way.
+            int first = (ids[face.v[0]] < ids[face.v[1]]) ? ((ids[face.v[0]] < ids[face.v[2]]) ? 0 : 2) : ((ids[face.v[1]] < ids[face.v[2]]) ? 1 : 2);
+            const PointCartesian & a = points[face.v[first]];
+            const PointCartesian & b = points[face.v[(first + 1) % 3]];
+            const PointCartesian & c = points[face.v[(first + 2) % 3]];
+
+            PointCartesian normal = PointCartesian::cross_product(b - a, c - a);
+            Real normal_length = sqrt(dot(normal, normal));
+            if (normal_length > 0) {normal = PointCartesian(normal.x / normal_length, normal.y / normal_length, normal.z / normal_length);}
+            scratch->face_normals[f] = normal;
+        }
+    }
+
+    /*
+     *  Shuffles the points of scratch, builds their hull and works out the unit normal of
+     *  every face, which is 0 for a face between two copies of one site. The shuffle is the
+     *  same for the same seed, so the same input gives the same diagram.
+     */
+    static bool build_shuffled_hull(HullScratchSphere * scratch, unsigned int seed)
+    {
+        vector<PointCartesian> & points = scratch->points;
+        vector<unsigned int> & ids = scratch->point_ids;
+
+        mt19937 rng(seed);
+        for (size_t i = points.size(); i > 1; i--)
+        {
+            size_t k = rng() % i;
+            swap(points[i - 1], points[k]);
+            swap(ids[i - 1], ids[k]);
+        }
+
+        if (!build_hull(scratch)) {return false;}
+
+        compute_face_normals(scratch);
+        return true;
+    }
+
+    /*
+     *  Writes the voronoi edges of the hull in scratch between a site and a site with a larger
+     *  index, if the first site belongs to patch, or to a patch in is_patch_left if patch is -1.
+     */
+    static void write_patch_edges(HullWorkspaceSphere * workspace, const HullScratchSphere * scratch, int patch)
+    {
+        const vector<HullFaceSphere> & faces = scratch->faces;
+        const vector<unsigned int> & ids = scratch->point_ids;
+
+        for (unsigned int f = 0; f < faces.size(); f++)
+        {
+            const HullFaceSphere & face = faces[f];
+            if (face.is_dead) {continue;}
+
+            for (int i = 0; i < 3; i++)
+            {
+                unsigned int start = ids[face.v[i]];
+                unsigned int end = ids[face.v[(i + 1) % 3]];
+                unsigned int owner = workspace->owners[start];
+                if (start > end) {continue;}
+                if ((patch >= 0) ? (owner != (unsigned int)patch) : !workspace->is_patch_left[owner]) {continue;}
+
+                HullEdgeSphere edge;
+                edge.sites[0] = start;
+                edge.sites[1] = end;
+                edge.start = scratch->face_normals[f];
+                edge.end = scratch->face_normals[face.adj[i]];
+                workspace->patch_edges[owner].push_back(edge);
+            }
+        }
+    }
+
+    /*
+     *  Builds the hull of the sites of patch and every site within margin of them, and
+     *  writes its edges. Returns false if the margin had to grow to take in more than half
+     *  of the sites, which leaves the patch to the hull of every site.
+     *
+     *  A site within margin of the patch is at most 2 * margin further from the patch's axis
+     *  than from its own, so every such site is in. The empty circle of a face around one
+     *  of the patch's sites holds only sites within twice its radius of that site, so the
+     *  face is in the full hull if its radius is at most margin / 2.
+     */
+    static bool build_patch(HullWorkspaceSphere * workspace, HullScratchSphere * scratch, int patch, Real margin)
+    {
+        const vector<PointCartesian> & sites = workspace->sites;
+        const vector<unsigned int> & owners = workspace->owners;
+        const PointCartesian & axis = workspace->axes[patch];
+        const vector<HullFaceSphere> & faces = scratch->faces;
+        vector<PointCartesian> & points = scratch->points;
+        vector<unsigned int> & ids = scratch->point_ids;
+
+        for (;;)
+        {
+            Real cos_reach = cos(2 * margin);
+            Real sin_reach = sin(2 * margin);
+
+            points.clear();
+            ids.clear();
+            for (unsigned int i = 0; i < sites.size(); i++)
+            {
+                // cos(owner angle + 2 * margin), unless that angle is past pi.
+                Real owner_cos = workspace->owner_cos[i];
+                Real min_cos = (owner_cos <= -cos_reach) ? -2 : owner_cos * cos_reach - workspace->owner_sin[i] * sin_reach;
+                if (owners[i] == (unsigned int)patch || dot(axis, sites[i]) >= min_cos)
+                {
+                    points.push_back(sites[i]);
+                    ids.push_back(i);
+                }
+            }
+            if (2 * margin >= M_PI || points.size() > sites.size() / 2) {return false;}
+            if (!build_shuffled_hull(scratch, patch + 1))
+            {
+                margin *= 2;
+                continue;
+            }
+
+            /*
+             *  More sites only make the empty circles smaller, so a margin of twice the largest
+             *  circle found is enough for the next try, unless a face was flat.
+             */
+            Real max_radius = 0;
+            for (unsigned int f = 0; f < faces.size() && max_radius < M_PI; f++)
+            {
+                const HullFaceSphere & face = faces[f];
+                if (face.is_dead) {continue;}
+                if (owners[ids[face.v[0]]] != (unsigned int)patch && owners[ids[face.v[1]]] != (unsigned int)patch && owners[ids[face.v[2]]] != (unsigned int)patch) {continue;}
+
+                // A face between two copies of a site is flat only because the patch does not hold the center of the sphere.
+                const PointCartesian & normal = scratch->face_normals[f];
+                max_radius = (dot(normal, normal) > 0) ? max(max_radius, angle_between(normal, points[face.v[0]])) : M_PI;
+            }
+            if (max_radius > margin / 2 - 1e-9)
+            {
+                margin = (max_radius < M_PI) ? max(2 * max_radius + 4e-9, margin * 1.25) : 2 * margin;
+                continue;
+            }
+
+            write_patch_edges(workspace, scratch, patch);
+            return true;
+        }
+    }
+
+    // Runs job(k) for k < num_threads, job(0) on the calling thread.
+    template <typename Job>
+    static void run_threads(int num_threads, const Job & job)
+    {
+        vector<thread> threads;
+        for (int k = 1; k < num_threads; k++)
+        {
+            threads.push_back(thread(job, k));
+        }
+        job(0);
+
+        for (auto & t : threads)
+        {
+            t.join();
+        }
+    }
+
+    // Copies the edges of every patch into voronoi_diagram, one patch per thread at a time.
+    static void copy_patch_edges(const HullWorkspaceSphere * workspace, VoronoiDiagramSphere * voronoi_diagram, int num_threads)
+    {
+        int num_patches = (int)workspace->patch_edges.size();
+        vector<unsigned int> first_edges(num_patches + 1, 0);
+        for (int patch = 0; patch < num_patches; patch++)
+        {
+            first_edges[patch + 1] = first_edges[patch] + (unsigned int)workspace->patch_edges[patch].size();
+        }
+
+        unsigned int num_edges = first_edges[num_patches];
+        voronoi_diagram->sites.assign(workspace->sites.begin(), workspace->sites.end());
+        voronoi_diagram->voronoi_vertices.resize(2 * num_edges);
+        voronoi_diagram->voronoi_edges.resize(num_edges);
+        voronoi_diagram->voronoi_edge_sites.resize(num_edges);
+        voronoi_diagram->delaunay_edges.resize(num_edges);
+
+        run_threads(num_threads, [&](int thread_idx)
+        {
+            for (int patch = thread_idx; patch < num_patches; patch += num_threads)
+            {
+                const vector<HullEdgeSphere> & edges = workspace->patch_edges[patch];
+                for (unsigned int i = 0; i < edges.size(); i++)
+                {
+                    unsigned int edge_idx = first_edges[patch] + i;
+                    voronoi_diagram->voronoi_vertices[2 * edge_idx] = edges[i].start;
+                    voronoi_diagram->voronoi_vertices[2 * edge_idx + 1] = edges[i].end;
+                    voronoi_diagram->voronoi_edges[edge_idx] = Edge(2 * edge_idx, 2 * edge_idx + 1);
+                    voronoi_diagram->voronoi_edge_sites[edge_idx] = Edge(edges[i].sites[0], edges[i].sites[1]);
+                    voronoi_diagram->delaunay_edges[edge_idx] = Edge(edges[i].sites[0], edges[i].sites[1]);
+                }
+            }
+        });
+    }
+
+    void generate_voronoi_hull(vector<tuple<Real, Real, Real>> * verts, VoronoiDiagramSphere * voronoi_diagram, int num_threads, bool normalize, HullWorkspaceSphere * workspace)
+    {
+        HullWorkspaceSphere local_workspace;
+        if (workspace == NULL) {workspace = &local_workspace;}
+
+        unsigned int num_sites = (unsigned int)verts->size();
+        voronoi_diagram->clear();
+
+        if (num_threads <= 0) {num_threads = max(1, (int)thread::hardware_concurrency());}
+
+        // A few patches per thread, so the threads that finish first take the patches left.
+        int num_patches = (num_threads == 1) ? 1 : (int)min<unsigned int>(4 * num_threads, max(1U, num_sites / 2048));
+        num_threads = min(num_threads, num_patches);
+
+        workspace->sites.resize(num_sites);
+        workspace->owners.resize(num_sites);
+        workspace->axes.resize(num_patches);
+        workspace->owner_cos.resize(num_sites);
+        workspace->owner_sin.resize(num_sites);
+        workspace->patch_edges.resize(num_patches);
+        workspace->is_patch_left.resize(num_patches);
+        workspace->scratch.resize(num_threads);
+
+        for (int patch = 0; patch < num_patches; patch++)
+        {
+            const tuple<Real, Real, Real> & point = (*verts)[(unsigned long)num_sites * patch / num_patches];
+            workspace->axes[patch] = PointCartesian(get<0>(point), get<1>(point), get<2>(point));
+            workspace->axes[patch].normalize();
+        }
+
+        // Every site goes to the patch of the nearest axis.
+        run_threads(num_threads, [&](int range)
+        {
+            unsigned int first = (unsigned int)((unsigned long)num_sites * range / num_threads);
+            unsigned int last = (unsigned int)((unsigned long)num_sites * (range + 1) / num_threads);
+
+            for (unsigned int i = first; i < last; i++)
+            {
+                const tuple<Real, Real, Real> & point = (*verts)[i];
+                PointCartesian site(get<0>(point), get<1>(point), get<2>(point));
+                if (normalize) {site.normalize();}
+                workspace->sites[i] = site;
+
+                int nearest = 0;
+                Real nearest_cos = -2;
+                for (int patch = 0; patch < num_patches; patch++)
+                {
+                    Real axis_cos = dot(workspace->axes[patch], site);
+                    if (axis_cos > nearest_cos)
+                    {
+                        nearest = patch;
+                        nearest_cos = axis_cos;
+                    }
+                }
+                workspace->owners[i] = nearest;
+                workspace->owner_cos[i] = min<Real>(1, nearest_cos);
+                workspace->owner_sin[i] = sqrt(1 - workspace->owner_cos[i] * workspace->owner_cos[i]);
+            }
+        });
+
+        for (int patch = 0; patch < num_patches; patch++)
+        {
+            workspace->patch_edges[patch].clear();
+        }
+
+        // Five times the mean distance between sites, so a face has to be unusually large to fail.
+        Real margin = 5 * sqrt(4 * M_PI / max(num_sites, 1U));
+        atomic<int> next_patch(0);
+        run_threads(num_threads, [&](int thread_idx)
+        {
+            for (int patch = next_patch++; patch < num_patches; patch = next_patch++)
+            {
+                workspace->is_patch_left[patch] = (num_patches == 1 || !build_patch(workspace, &workspace->scratch[thread_idx], patch, margin));
+            }
+        });
+
+        // The patches left (all of them for one patch) share one hull of every site, built on this thread.
+        if (find(workspace->is_patch_left.begin(), workspace->is_patch_left.end(), 1) != workspace->is_patch_left.end())
+        {
+            HullScratchSphere * scratch = &workspace->scratch[0];
+            scratch->points.assign(workspace->sites.begin(), workspace->sites.end());
+            scratch->point_ids.resize(num_sites);
+            for (unsigned int i = 0; i < num_sites; i++)
+            {
+                scratch->point_ids[i] = i;
+            }
+            if (build_shuffled_hull(scratch, 0)) {write_patch_edges(workspace, scratch, -1);}
+        }
+
+        copy_patch_edges(workspace, voronoi_diagram, num_threads);
+    }
+
+    // The sign of det(a - center, b - center, p - center) in floating point, for walking only.
+    static inline Real orient_from(const PointCartesian & center, const PointCartesian & a, const PointCartesian & b, const PointCartesian & p)
+    {
+        return dot(PointCartesian::cross_product(a - center, b - center), p - center);
+    }
+
+    /*
+     *  Finds a face of the hull in scratch that point is outside of, starting from face and
+     *  walking across the edge the line from center (inside the hull) to point passes. If the
+     *  walk stops or comes back to a face without one, which floating point or a repeated site
+     *  can cause, the faces around the corners of the last face are tried, and then every
+     *  face. Returns -1 if point is inside the hull.
+     */
+    static int locate_point(HullScratchSphere * scratch, const PointCartesian & center, int face, int point)
+    {
+        vector<HullFaceSphere> & faces = scratch->faces;
+        const vector<PointCartesian> & points = scratch->points;
+        const PointCartesian & p = points[point];
+        unsigned int stamp = ++scratch->visit_stamp;
+
+        while (faces[face].visit_stamp != stamp)
+        {
+            HullFaceSphere & current = faces[face];
+            current.visit_stamp = stamp;
+            if (is_outside(scratch, current, point)) {return face;}
+
+            int next = -1;
+            Real most_behind = 0;
+            for (int i = 0; i < 3; i++)
+            {
+                Real side = orient_from(center, points[current.v[i]], points[current.v[(i + 1) % 3]], p);
+                if (side < most_behind)
+                {
+                    next = current.adj[i];
+                    most_behind = side;
+                }
+            }
+            if (next < 0) {break;}
+            face = next;
+        }
+
+        // Only faces around a site can see a point right on top of it.
+        for (int i = 0; i < 3; i++)
+        {
+            unsigned int corner = faces[face].v[i];
+            int around = face;
+            do
+            {
+                const HullFaceSphere & current = faces[around];
+                if (is_outside(scratch, current, point)) {return around;}
+
+                int k = (current.v[0] == corner) ? 0 : ((current.v[1] == corner) ? 1 : 2);
+                around = current.adj[(k + 2) % 3];
+            } while (around != face);
+
+            if (points[corner].x == p.x && points[corner].y == p.y && points[corner].z == p.z) {return -1;}
+        }
+
+        for (unsigned int f = 0; f < faces.size(); f++)
+        {
+            if (!faces[f].is_dead && is_outside(scratch, faces[f], point)) {return f;}
+        }
+        return -1;
+    }
+
+    void generate_voronoi_incremental(vector<tuple<Real, Real, Real>> * verts, VoronoiDiagramSphere * voronoi_diagram, bool normalize, HullWorkspaceSphere * workspace)
+    {
+        HullWorkspaceSphere local_workspace;
+        if (workspace == NULL) {workspace = &local_workspace;}
+
+        unsigned int num_sites = (unsigned int)verts->size();
+        voronoi_diagram->clear();
+
+        workspace->sites.resize(num_sites);
+        workspace->owners.assign(num_sites, 0);
+        workspace->patch_edges.resize(1);
+        workspace->patch_edges[0].clear();
+        workspace->scratch.resize(1);
+
+        vector<pair<unsigned long long, unsigned int>> & order = workspace->insertion_order;
+        order.resize(num_sites);
+        for (unsigned int i = 0; i < num_sites; i++)
+        {
+            const tuple<Real, Real, Real> & point = (*verts)[i];
+            PointCartesian site(get<0>(point), get<1>(point), get<2>(point));
+            if (normalize) {site.normalize();}
+            workspace->sites[i] = site;
+            order[i] = make_pair(sphere_curve_key(site), i);
+        }
+
+        /*
+         *  Biased randomized insertion order: a random half of the sites goes last, a random
+         *  half of the rest before it and so on, and every round is sorted along the curve.
+         *  The rounds keep the expected work of a random order, and the curve keeps every
+         *  site close to the one before it.
+         */
+        mt19937 rng(0);
+        for (size_t i = order.size(); i > 1; i--)
+        {
+            swap(order[i - 1], order[rng() % i]);
+        }
+        for (size_t round_end = order.size(); round_end > 0; round_end /= 2)
+        {
+            size_t round_start = (round_end > 64) ? round_end / 2 : 0;
+            sort(order.begin() + round_start, order.begin() + round_end);
+            if (round_start == 0) {break;}
+        }
+
+        HullScratchSphere * scratch = &workspace->scratch[0];
+        vector<PointCartesian> & points = scratch->points;
+        vector<unsigned int> & ids = scratch->point_ids;
+        points.resize(num_sites);
+        ids.resize(num_sites);
+        for (unsigned int i = 0; i < num_sites; i++)
+        {
+            points[i] = workspace->sites[order[i].second];
+            ids[i] = order[i].second;
+        }
+
+        // The first tetrahedron is made of sites from the first round spread as far apart as they go.
+        unsigned int num_first = min(num_sites, 64U);
+        for (unsigned int k = 1; k < 4 && k < num_first; k++)
+        {
+            unsigned int best = k;
+            Real best_size = -1;
+            for (unsigned int i = k; i < num_first; i++)
+            {
+                // The length, then the area and then the volume the site adds.
+                PointCartesian d = points[i] - points[0];
+                PointCartesian area = PointCartesian::cross_product(points[1] - points[0], d);
+                Real size = (k == 1) ? dot(d, d) : ((k == 2) ? dot(area, area) : fabs(dot(PointCartesian::cross_product(points[1] - points[0], points[2] - points[0]), d)));
+                if (size > best_size)
+                {
+                    best = i;
+                    best_size = size;
+                }
+            }
+            swap(points[k], points[best]);
+            swap(ids[k], ids[best]);
+        }
+
+        if (start_hull(scratch))
+        {
+            PointCartesian center((points[0].x + points[1].x + points[2].x + points[3].x) / 4, (points[0].y + points[1].y + points[2].y + points[3].y) / 4, (points[0].z + points[1].z + points[2].z + points[3].z) / 4);
+
+            int last_face = 0;
+            for (unsigned int i = 4; i < num_sites; i++)
+            {
+                int face = locate_point(scratch, center, last_face, i);
+                if (face < 0) {continue;}
+
+                scratch->point_face[i] = face;
+                add_point(scratch, i);
+                scratch->point_face[i] = -1;
+                last_face = scratch->new_faces.back();
+            }
+
+            compute_face_normals(scratch);
+            write_patch_edges(workspace, scratch, 0);
+        }
+
+        copy_patch_edges(workspace, voronoi_diagram, 1);
+    }
+}
@@ -0,0 +1,140 @@
+//
+//  voronoi_hull.h
+//  Voronoi
+//
+//  Copyright © 2016 Ellis Sparky Hoag. All rights reserved.
+//
+
+#ifndef VoronoiHull_h
+#define VoronoiHull_h
+
+#include "voronoi_sphere.h"
+
+namespace Voronoi
+{
+    /*
+     *  The delaunay triangulation of sites on the unit sphere is their convex hull, and the
+     *  voronoi vertices are the outward normals of its faces. This is the second engine of
+     *  generate_voronoi (HULL_ENGINE), which builds the hull in patches on many threads.
+     *
+     *  Every site belongs to the nearest of a set of axes, which are sites taken at even
+     *  strides through the input so that dense regions get more patches. A patch builds the
+     *  hull of its own sites and of every other site within a margin of them, and keeps the
+     *  edges around its own sites. Those are edges of the full hull as long as the empty
+     *  circle of every face around its own sites is small enough to hold only sites the patch
+     *  saw, which is checked. A patch that fails the check is built again with a margin of
+     *  twice the largest circle it found, and a patch that would take in more than half of
+     *  the sites (around a large empty region, for example) is left to one hull of every
+     *  site, built after the others.
+     *
+     *  The orientation test below is exact, and ties are broken the same way for every
+     *  patch, so the patches agree where they overlap and any input gives a valid diagram.
+     *  The exact arithmetic needs IEEE rounding, so voronoi_hull.cpp must not be built
+     *  with -ffast-math.
+     */
+
+    /*
+     *  Returns 1 if d is outside the plane through a, b and c, which are counterclockwise seen
+     *  from outside, and -1 if it is inside. a_idx to d_idx are the indices of the sites, which
+     *  break ties as if every site were pushed out from the center by an amount that grows
+     *  with its index, and then moved along a fixed direction by a smaller amount that grows
+     *  with its index. Returns 0 only if that still leaves d on the plane.
+     */
+    int orient_sites(const PointCartesian & a, unsigned int a_idx, const PointCartesian & b, unsigned int b_idx, const PointCartesian & c, unsigned int c_idx, const PointCartesian & d, unsigned int d_idx);
+
+    /*
+     *  A face of a hull. v are indices into the points of the hull, counterclockwise seen from
+     *  outside, and adj[i] is the face across the edge from v[i] to v[(i + 1) % 3].
+     */
+    struct HullFaceSphere
+    {
+        unsigned int v[3];
+
+        int adj[3];
+
+        // The first point outside the face that is not in the hull yet, or -1.
+        int first_conflict;
+
+        unsigned int visit_stamp;
+
+        bool is_visible, is_dead;
+    };
+
+    // A voronoi edge from a patch, between sites[0] and sites[1].
+    struct HullEdgeSphere
+    {
+        unsigned int sites[2];
+
+        PointCartesian start, end;
+    };
+
+    // What one thread builds its patches in.
+    struct HullScratchSphere
+    {
+        std::vector<HullFaceSphere> faces;
+
+        // The points of the hull and their indices in the input.
+        std::vector<PointCartesian> points;
+
+        std::vector<unsigned int> point_ids;
+
+        // The face every point outside the hull is queued on (-1 once it is in the hull), and the next point on that face.
+        std::vector<int> point_face, next_conflict;
+
+        // The new face whose first edge starts at a point, while a point is added.
+        std::vector<int> horizon_face;
+
+        std::vector<int> visible_faces, new_faces, stack;
+
+        // Faces that were removed from the hull, to be used again.
+        std::vector<int> free_faces;
+
+        std::vector<PointCartesian> face_normals;
+
+        unsigned int visit_stamp;
+    };
+
+    /*
+     *  Everything generate_voronoi_hull keeps between calls.
+     */
+    struct HullWorkspaceSphere
+    {
+        std::vector<PointCartesian> sites, axes;
+
+        // The patch every site belongs to.
+        std::vector<unsigned int> owners;
+
+        // The cosine and sine of the angle from every site to the axis of its patch.
+        std::vector<Real> owner_cos, owner_sin;
+
+        std::vector<std::vector<HullEdgeSphere>> patch_edges;
+
+        // The patches whose edges come from the hull of every site.
+        std::vector<char> is_patch_left;
+
+        std::vector<HullScratchSphere> scratch;
+
+        // The curve position and index of every site, in the order generate_voronoi_incremental adds them.
+        std::vector<std::pair<unsigned long long, unsigned int>> insertion_order;
+    };
+
+    /*
+     *  Builds the voronoi diagram of verts from their convex hull on num_threads threads (all
+     *  the hardware threads if it is 0). With normalize every site is rescaled to unit length
+     *  first. Every voronoi edge comes once with two vertices of its own, between the sites
+     *  in voronoi_edge_sites, which is also its delaunay edge. Fewer than four sites give no
+     *  edges. workspace, if not NULL, keeps its capacity between calls.
+     */
+    void generate_voronoi_hull(std::vector<std::tuple<Real, Real, Real>> * verts, VoronoiDiagramSphere * voronoi_diagram, int num_threads = 0, bool normalize = false, HullWorkspaceSphere * workspace = NULL);
+
+    /*
+     *  Builds the same diagram as generate_voronoi_hull on one thread by adding the sites to
+     *  the hull one at a time, without conflict lists. The sites go in random rounds that
+     *  double in size, each sorted along a space-filling curve, and every site is found by
+     *  walking the hull from the last faces added, so the walks stay short and the faces
+     *  they touch stay in cache. The hull is left in workspace->scratch[0].
+     */
+    void generate_voronoi_incremental(std::vector<std::tuple<Real, Real, Real>> * verts, VoronoiDiagramSphere * voronoi_diagram, bool normalize = false, HullWorkspaceSphere * workspace = NULL);
+}
+
+#endif /* VoronoiHull_h */
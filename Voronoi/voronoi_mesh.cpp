@@ -0,0 +1,172 @@
+//
+//  voronoi_mesh.cpp
+//  Voronoi
+//
+//  Copyright © 2016 Ellis Sparky Hoag. All rights reserved.
+//
+
+#include "voronoi_mesh.h"
+
+using namespace std;
+
+namespace Voronoi {
+
+    static inline Real dot(const PointCartesian & a, const PointCartesian & b)
+    {
+        return a.x * b.x + a.y * b.y + a.z * b.z;
+    }
+
+    /*
+     *  Grows from 0 to 4 with the angle of (x, y) from the positive x axis, without trig.
+     */
+    static inline Real pseudo_angle(Real x, Real y)
+    {
+        Real p = y / (abs(x) + abs(y));
+        return (x < 0) ? 2 - p : ((y < 0) ? 4 + p : p);
+    }
+
+    /*
+     *  Puts arcs in order counterclockwise around site, by the angle of their starts in a
+     *  plane through the site. The cell is convex and holds its site, so that is the order
+     *  of its corners.
+     */
+    static void sort_arcs_around(const PointCartesian & site, vector<CellArcSphere> & arcs, vector<pair<Real, unsigned int>> & keys, vector<CellArcSphere> & sorted_arcs)
+    {
+        // u and v = site x u are a right handed pair of directions in the plane at the site.
+        PointCartesian axis(1, 0, 0);
+        if (abs(site.y) <= abs(site.x) && abs(site.y) <= abs(site.z)) {axis = PointCartesian(0, 1, 0);}
+        else if (abs(site.z) <= abs(site.x) && abs(site.z) <= abs(site.y)) {axis = PointCartesian(0, 0, 1);}
+        PointCartesian u = PointCartesian::cross_product(site, axis);
+        PointCartesian v = PointCartesian::cross_product(site, u);
+
+        keys.clear();
+        for (unsigned int i = 0; i < arcs.size(); i++)
+        {
+            keys.push_back(make_pair(pseudo_angle(dot(arcs[i].start, u), dot(arcs[i].start, v)), i));
+        }
+        sort(keys.begin(), keys.end());
+
+        sorted_arcs.clear();
+        for (const auto & key : keys)
+        {
+            sorted_arcs.push_back(arcs[key.second]);
+        }
+        arcs.swap(sorted_arcs);
+    }
+
+    // Runs job(first, last) for num_threads even ranges of [0, count), the first on the calling thread.
+    template <typename Job>
+    static void run_cells(int num_threads, unsigned int count, const Job & job)
+    {
+        if (num_threads <= 0) {num_threads = max(1, (int)thread::hardware_concurrency());}
+        num_threads = (int)min<unsigned int>(num_threads, max(1U, count / 1024));
+
+        vector<thread> threads;
+        for (int k = 1; k < num_threads; k++)
+        {
+            threads.push_back(thread(job, (unsigned int)((unsigned long)count * k / num_threads), (unsigned int)((unsigned long)count * (k + 1) / num_threads)));
+        }
+        job(0U, count / num_threads);
+
+        for (auto & t : threads)
+        {
+            t.join();
+        }
+    }
+
+    void layout_cell_mesh(const VoronoiDiagramSphere & voronoi_diagram, CellMeshSphere * mesh, int num_threads)
+    {
+        unsigned int num_cells = (unsigned int)voronoi_diagram.sites.size();
+
+        bucket_cell_edges(voronoi_diagram, &mesh->edge_start, &mesh->cell_edges);
+
+        // Count what every cell needs, one past its own entry, and then add up the counts.
+        mesh->vertex_start.assign(num_cells + 1, 0);
+        mesh->triangle_start.assign(num_cells + 1, 0);
+        mesh->line_start.assign(num_cells + 1, 0);
+        run_cells(num_threads, num_cells, [&](unsigned int first_cell, unsigned int last_cell)
+        {
+            vector<CellArcSphere> arcs;
+            for (unsigned int cell = first_cell; cell < last_cell; cell++)
+            {
+                find_cell_arcs(voronoi_diagram, mesh->edge_start, mesh->cell_edges, cell, &arcs);
+
+                unsigned int num_lines = 0;
+                for (const CellArcSphere & arc : arcs)
+                {
+                    num_lines += (arc.neighbour > cell);
+                }
+                mesh->vertex_start[cell + 1] = 1 + (unsigned int)arcs.size();
+                mesh->triangle_start[cell + 1] = (arcs.size() >= 3) ? (unsigned int)arcs.size() : 0;
+                mesh->line_start[cell + 1] = num_lines;
+            }
+        });
+
+        for (unsigned int i = 0; i < num_cells; i++)
+        {
+            mesh->vertex_start[i + 1] += mesh->vertex_start[i];
+            mesh->triangle_start[i + 1] += mesh->triangle_start[i];
+            mesh->line_start[i + 1] += mesh->line_start[i];
+        }
+    }
+
+    void write_cell_mesh(const VoronoiDiagramSphere & voronoi_diagram, const CellMeshSphere & mesh, MeshVertexSphere * vertices, unsigned int * triangle_indices, unsigned int * voronoi_line_indices, unsigned int * delaunay_line_indices, int num_threads)
+    {
+        if (mesh.vertex_start.empty()) {return;}
+        unsigned int num_cells = (unsigned int)mesh.vertex_start.size() - 1;
+
+        run_cells(num_threads, num_cells, [&](unsigned int first_cell, unsigned int last_cell)
+        {
+            vector<CellArcSphere> arcs, sorted_arcs;
+            vector<pair<Real, unsigned int>> keys;
+            for (unsigned int cell = first_cell; cell < last_cell; cell++)
+            {
+                const PointCartesian & site = voronoi_diagram.sites[cell];
+                find_cell_arcs(voronoi_diagram, mesh.edge_start, mesh.cell_edges, cell, &arcs);
+                sort_arcs_around(site, arcs, keys, sorted_arcs);
+
+                unsigned int center = mesh.vertex_start[cell];
+                unsigned int num_corners = (unsigned int)arcs.size();
+
+                if (vertices != NULL)
+                {
+                    vertices[center] = {(float)site.x, (float)site.y, (float)site.z, cell};
+                    for (unsigned int k = 0; k < num_corners; k++)
+                    {
+                        const PointCartesian & corner = arcs[k].start;
+                        vertices[center + 1 + k] = {(float)corner.x, (float)corner.y, (float)corner.z, cell};
+                    }
+                }
+
+                if (triangle_indices != NULL && num_corners >= 3)
+                {
+                    unsigned int * triangle = triangle_indices + 3 * (size_t)mesh.triangle_start[cell];
+                    for (unsigned int k = 0; k < num_corners; k++, triangle += 3)
+                    {
+                        triangle[0] = center;
+                        triangle[1] = center + 1 + k;
+                        triangle[2] = center + 1 + (k + 1) % num_corners;
+                    }
+                }
+
+                // Arc k runs from corner k to corner k + 1.
+                size_t line = 2 * (size_t)mesh.line_start[cell];
+                for (unsigned int k = 0; k < num_corners; k++)
+                {
+                    if (arcs[k].neighbour <= cell) {continue;}
+                    if (voronoi_line_indices != NULL)
+                    {
+                        voronoi_line_indices[line] = center + 1 + k;
+                        voronoi_line_indices[line + 1] = center + 1 + (k + 1) % num_corners;
+                    }
+                    if (delaunay_line_indices != NULL)
+                    {
+                        delaunay_line_indices[line] = center;
+                        delaunay_line_indices[line + 1] = mesh.vertex_start[arcs[k].neighbour];
+                    }
+                    line += 2;
+                }
+            }
+        });
+    }
+}
@@ -0,0 +1,72 @@
+//
+//  voronoi_mesh.h
+//  Voronoi
+//
+//  Copyright © 2016 Ellis Sparky Hoag. All rights reserved.
+//
+
+#ifndef VoronoiMesh_h
+#define VoronoiMesh_h
+
+#include "voronoi_metrics.h"
+
+namespace Voronoi
+{
+    /*
+     *  One vertex of a cell mesh, laid out to be uploaded as it is: a position and the
+     *  index of the cell it belongs to, 16 bytes in all.
+     */
+    struct MeshVertexSphere
+    {
+        float x, y, z;
+
+        unsigned int cell;
+    };
+
+    /*
+     *  Where every cell of a diagram goes in the mesh buffers. Cell i has the vertices from
+     *  vertex_start[i] to vertex_start[i + 1] - 1: its site, and then the corners of the cell
+     *  counterclockwise seen from outside the sphere. No vertex is shared between cells, so
+     *  every vertex carries the index of its cell.
+     *
+     *  The triangles of cell i are a fan from its site, with three indices each from
+     *  3 * triangle_start[i] on. A cell with fewer than three corners has no triangles.
+     *
+     *  The lines of cell i are its edges to the neighbours with a larger index, with two
+     *  indices each from 2 * line_start[i] on, so every edge is drawn once. There are as many
+     *  delaunay lines, from the site of cell i to the sites of the same neighbours.
+     */
+    struct CellMeshSphere
+    {
+        std::vector<unsigned int> vertex_start, triangle_start, line_start;
+
+        // The voronoi edges of every cell, from bucket_cell_edges.
+        std::vector<unsigned int> edge_start, cell_edges;
+
+        size_t num_vertices() const {return vertex_start.empty() ? 0 : vertex_start.back();}
+
+        size_t num_triangle_indices() const {return triangle_start.empty() ? 0 : 3 * (size_t)triangle_start.back();}
+
+        size_t num_line_indices() const {return line_start.empty() ? 0 : 2 * (size_t)line_start.back();}
+    };
+
+    /*
+     *  Sets mesh to the layout of the cells of voronoi_diagram, so that the caller knows how
+     *  large the buffers have to be. The cells are split between num_threads threads (all the
+     *  hardware threads if it is 0). mesh keeps its capacity between calls.
+     */
+    void layout_cell_mesh(const VoronoiDiagramSphere & voronoi_diagram, CellMeshSphere * mesh, int num_threads = 0);
+
+    /*
+     *  Writes the mesh laid out by layout_cell_mesh into buffers the caller owns, which can be
+     *  mapped GPU memory: mesh.num_vertices() vertices, mesh.num_triangle_indices() triangle
+     *  indices and mesh.num_line_indices() indices for each kind of line. Any buffer can be
+     *  NULL to leave it out. Nothing here needs a window or a GPU.
+     *
+     *  Every cell is written at its own offsets, so the cells are split between num_threads
+     *  threads (all the hardware threads if it is 0) without any copy afterwards.
+     */
+    void write_cell_mesh(const VoronoiDiagramSphere & voronoi_diagram, const CellMeshSphere & mesh, MeshVertexSphere * vertices, unsigned int * triangle_indices, unsigned int * voronoi_line_indices = NULL, unsigned int * delaunay_line_indices = NULL, int num_threads = 0);
+}
+
+#endif /* VoronoiMesh_h */
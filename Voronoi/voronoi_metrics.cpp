@@ -0,0 +1,205 @@
+//
+//  voronoi_metrics.cpp
+//  Voronoi
+//
+//  Copyright © 2016 Ellis Sparky Hoag. All rights reserved.
+//
+
+#include "voronoi_metrics.h"
+
+using namespace std;
+
+namespace Voronoi {
+
+    static inline Real dot(const PointCartesian & a, const PointCartesian & b)
+    {
+        return a.x * b.x + a.y * b.y + a.z * b.z;
+    }
+
+    static inline Real length(const PointCartesian & a)
+    {
+        return sqrt(dot(a, a));
+    }
+
+    static inline Real distance_squared(const PointCartesian & a, const PointCartesian & b)
+    {
+        Real dx = a.x - b.x, dy = a.y - b.y, dz = a.z - b.z;
+        return dx * dx + dy * dy + dz * dz;
+    }
+
+    /*
+     *  Returns the two ends of the union of arcs[first, last), which all lie on the
+     *  same great circle. The ends are the two points that are furthest apart. That is
+     *  measured on the chord, since the dot product of the ends of an arc much shorter
+     *  than 1e-8 rounds to 1 and can not tell an end from itself.
+     */
+    static void join_pieces(const vector<CellArcSphere> & arcs, size_t first, size_t last, PointCartesian & a, PointCartesian & b)
+    {
+        a = arcs[first].start;
+        b = arcs[first].end;
+        if (last - first == 1) {return;}
+
+        Real furthest = distance_squared(a, b);
+        for (size_t i = first; i < last; i++)
+        {
+            const PointCartesian ends[2] = {arcs[i].start, arcs[i].end};
+            for (size_t k = first; k < last; k++)
+            {
+                for (int u = 0; u < 2; u++)
+                {
+                    if (distance_squared(ends[u], arcs[k].start) > furthest)
+                    {
+                        furthest = distance_squared(ends[u], arcs[k].start);
+                        a = ends[u];
+                        b = arcs[k].start;
+                    }
+                    if (distance_squared(ends[u], arcs[k].end) > furthest)
+                    {
+                        furthest = distance_squared(ends[u], arcs[k].end);
+                        a = ends[u];
+                        b = arcs[k].end;
+                    }
+                }
+            }
+        }
+    }
+
+    void bucket_cell_edges(const VoronoiDiagramSphere & voronoi_diagram, vector<unsigned int> * edge_start, vector<unsigned int> * cell_edges)
+    {
+        unsigned int num_cells = (unsigned int)voronoi_diagram.sites.size();
+
+        edge_start->assign(num_cells + 1, 0);
+        for (const Edge & edge_sites : voronoi_diagram.voronoi_edge_sites)
+        {
+            (*edge_start)[edge_sites.vidx[0] + 1]++;
+            (*edge_start)[edge_sites.vidx[1] + 1]++;
+        }
+        for (unsigned int i = 0; i < num_cells; i++)
+        {
+            (*edge_start)[i + 1] += (*edge_start)[i];
+        }
+
+        cell_edges->resize((*edge_start)[num_cells]);
+        vector<unsigned int> next_edge(edge_start->begin(), edge_start->end() - 1);
+        for (unsigned int edge = 0; edge < voronoi_diagram.voronoi_edge_sites.size(); edge++)
+        {
+            (*cell_edges)[next_edge[voronoi_diagram.voronoi_edge_sites[edge].vidx[0]]++] = edge;
+            (*cell_edges)[next_edge[voronoi_diagram.voronoi_edge_sites[edge].vidx[1]]++] = edge;
+        }
+    }
+
+    void find_cell_arcs(const VoronoiDiagramSphere & voronoi_diagram, const vector<unsigned int> & edge_start, const vector<unsigned int> & cell_edges, unsigned int cell, vector<CellArcSphere> * arcs)
+    {
+        const PointCartesian & site = voronoi_diagram.sites[cell];
+        const vector<PointCartesian> & vertices = voronoi_diagram.voronoi_vertices;
+
+        arcs->clear();
+        for (unsigned int i = edge_start[cell]; i < edge_start[cell + 1]; i++)
+        {
+            unsigned int edge = cell_edges[i];
+            const Edge & edge_sites = voronoi_diagram.voronoi_edge_sites[edge];
+            const Edge & voronoi_edge = voronoi_diagram.voronoi_edges[edge];
+
+            CellArcSphere piece;
+            piece.neighbour = (edge_sites.vidx[0] == cell) ? edge_sites.vidx[1] : edge_sites.vidx[0];
+            piece.start = vertices[voronoi_edge.vidx[0]];
+            piece.end = vertices[voronoi_edge.vidx[1]];
+            arcs->push_back(piece);
+        }
+        sort(arcs->begin(), arcs->end());
+
+        // The joined arcs are written over the pieces they came from.
+        size_t num_arcs = 0;
+        for (size_t first = 0, last = 0; first < arcs->size(); first = last)
+        {
+            while (last < arcs->size() && (*arcs)[last].neighbour == (*arcs)[first].neighbour) {last++;}
+
+            PointCartesian a, b;
+            join_pieces(*arcs, first, last, a, b);
+
+            PointCartesian normal = PointCartesian::cross_product(a, b);
+            if (length(normal) == 0) {continue;}
+
+            // The triangle (site, a, b) is counterclockwise if the site is on the positive side.
+            CellArcSphere & arc = (*arcs)[num_arcs++];
+            arc.neighbour = (*arcs)[first].neighbour;
+            arc.start = (dot(site, normal) < 0) ? b : a;
+            arc.end = (dot(site, normal) < 0) ? a : b;
+        }
+        arcs->resize(num_arcs);
+    }
+
+    static void measure_cells(const VoronoiDiagramSphere * voronoi_diagram, const vector<unsigned int> * edge_start, const vector<unsigned int> * cell_edges, CellMetricsSphere * metrics, unsigned int first_cell, unsigned int last_cell)
+    {
+        vector<CellArcSphere> arcs;
+
+        for (unsigned int cell = first_cell; cell < last_cell; cell++)
+        {
+            const PointCartesian & site = voronoi_diagram->sites[cell];
+            find_cell_arcs(*voronoi_diagram, *edge_start, *cell_edges, cell, &arcs);
+
+            Real area = 0, perimeter = 0;
+            PointCartesian centroid;
+
+            for (const CellArcSphere & arc : arcs)
+            {
+                const PointCartesian & a = arc.start;
+                const PointCartesian & b = arc.end;
+
+                PointCartesian normal = PointCartesian::cross_product(a, b);
+                Real normal_length = length(normal);
+                Real triple = dot(site, normal);
+
+                Real angle = atan2(normal_length, dot(a, b));
+
+                // Van Oosterom and Strackee
+                area += 2 * atan2(abs(triple), 1 + dot(site, a) + dot(a, b) + dot(b, site));
+                perimeter += angle;
+
+                centroid.x += angle * normal.x / normal_length;
+                centroid.y += angle * normal.y / normal_length;
+                centroid.z += angle * normal.z / normal_length;
+            }
+
+            if (arcs.empty()) {centroid = site;}
+            centroid.normalize();
+
+            metrics->area[cell] = area;
+            metrics->perimeter[cell] = perimeter;
+            metrics->centroid_x[cell] = centroid.x;
+            metrics->centroid_y[cell] = centroid.y;
+            metrics->centroid_z[cell] = centroid.z;
+            metrics->num_neighbours[cell] = (int)arcs.size();
+        }
+    }
+
+    void compute_cell_metrics(const VoronoiDiagramSphere & voronoi_diagram, CellMetricsSphere * metrics, int num_threads)
+    {
+        unsigned int num_cells = (unsigned int)voronoi_diagram.sites.size();
+
+        metrics->area.resize(num_cells);
+        metrics->perimeter.resize(num_cells);
+        metrics->centroid_x.resize(num_cells);
+        metrics->centroid_y.resize(num_cells);
+        metrics->centroid_z.resize(num_cells);
+        metrics->num_neighbours.resize(num_cells);
+
+        vector<unsigned int> edge_start, cell_edges;
+        bucket_cell_edges(voronoi_diagram, &edge_start, &cell_edges);
+
+        if (num_threads <= 0) {num_threads = max(1, (int)thread::hardware_concurrency());}
+        num_threads = (int)min<unsigned int>(num_threads, max(1U, num_cells / 1024));
+
+        vector<thread> threads;
+        for (int k = 1; k < num_threads; k++)
+        {
+            threads.push_back(thread(measure_cells, &voronoi_diagram, &edge_start, &cell_edges, metrics, (unsigned int)((unsigned long)num_cells * k / num_threads), (unsigned int)((unsigned long)num_cells * (k + 1) / num_threads)));
+        }
+        measure_cells(&voronoi_diagram, &edge_start, &cell_edges, metrics, 0, num_cells / num_threads);
+
+        for (auto & t : threads)
+        {
+            t.join();
+        }
+    }
+}
@@ -0,0 +1,68 @@
+//
+//  voronoi_metrics.h
+//  Voronoi
+//
+//  Copyright © 2016 Ellis Sparky Hoag. All rights reserved.
+//
+
+#ifndef VoronoiMetrics_h
+#define VoronoiMetrics_h
+
+#include "voronoi_sphere.h"
+
+namespace Voronoi
+{
+    /*
+     *  Per cell measures of a spherical diagram, one entry per site in the order of
+     *  voronoi_diagram.sites. Areas are in steradians and perimeters in radians.
+     *  The centroid is the unit vector of the mean position over the cell.
+     */
+    struct CellMetricsSphere
+    {
+        std::vector<Real> area, perimeter;
+
+        std::vector<Real> centroid_x, centroid_y, centroid_z;
+
+        std::vector<int> num_neighbours;
+    };
+
+    /*
+     *  The edge between a cell and one of its neighbours, from start to end counterclockwise
+     *  around the site seen from outside the sphere.
+     */
+    struct CellArcSphere
+    {
+        inline friend bool operator<(const CellArcSphere & left, const CellArcSphere & right) {return left.neighbour < right.neighbour;}
+
+        unsigned int neighbour;
+
+        PointCartesian start, end;
+    };
+
+    /*
+     *  Buckets the voronoi edges of voronoi_diagram by the cells on both of their sides: the
+     *  edges of cell i are cell_edges[edge_start[i]] to cell_edges[edge_start[i + 1] - 1].
+     */
+    void bucket_cell_edges(const VoronoiDiagramSphere & voronoi_diagram, std::vector<unsigned int> * edge_start, std::vector<unsigned int> * cell_edges);
+
+    /*
+     *  Sets arcs to the edges of cell, one per neighbour in order of index. The sweeps can
+     *  split one voronoi edge into pieces, and the two and four thread modes can return the
+     *  same piece twice, so the pieces between two sites are joined into one arc first. Arcs
+     *  of zero length are left out.
+     */
+    void find_cell_arcs(const VoronoiDiagramSphere & voronoi_diagram, const std::vector<unsigned int> & edge_start, const std::vector<unsigned int> & cell_edges, unsigned int cell, std::vector<CellArcSphere> * arcs);
+
+    /*
+     *  Measures every cell of voronoi_diagram with exact spherical formulas. A cell is
+     *  convex and holds its site, so its area is the sum of the triangles from the site
+     *  to each of its edges, and its centroid is the sum over its edges of the arc length
+     *  times the unit normal of the edge's great circle. The edges come from find_cell_arcs.
+     *
+     *  The cells are split between num_threads threads (all the hardware threads if it is
+     *  0). metrics keeps its capacity between calls.
+     */
+    void compute_cell_metrics(const VoronoiDiagramSphere & voronoi_diagram, CellMetricsSphere * metrics, int num_threads = 0);
+}
+
+#endif /* VoronoiMetrics_h */
@@ -0,0 +1,499 @@
+//
+//  voronoi_shard.cpp
+//  Voronoi
+//
+//  Copyright © 2016 Ellis Sparky Hoag. All rights reserved.
+//
+
+#include "voronoi_shard.h"
+
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+
+using namespace std;
+
+namespace Voronoi {
+
+    static const uint32_t shard_job_magic = 0x4a485356; // "VSHJ"
+    static const uint32_t shard_result_magic = 0x52485356; // "VSHR"
+
+    // The first halo is this many mean site spacings wide.
+    static const Real halo_spacings = 4;
+
+#ifdef MSG_NOSIGNAL
+    static const int send_flags = MSG_NOSIGNAL;
+#else
+    static const int send_flags = 0;
+#endif
+
+    /*
+     *  A message is a byte buffer that is sent with its length in front of it.
+     */
+    struct ShardMessage
+    {
+        ShardMessage() : read_pos(0) {}
+
+        template <typename T>
+        void put(const T & value)
+        {
+            const char * data = (const char *)&value;
+            bytes.insert(bytes.end(), data, data + sizeof(T));
+        }
+
+        template <typename T>
+        bool get(T & value)
+        {
+            if (read_pos + sizeof(T) > bytes.size()) {return false;}
+            memcpy(&value, &bytes[read_pos], sizeof(T));
+            read_pos += sizeof(T);
+            return true;
+        }
+
+        std::vector<char> bytes;
+
+        size_t read_pos;
+    };
+
+    static bool write_all(int fd, const char * data, size_t size)
+    {
+        while (size > 0)
+        {
+            // send keeps a closed socket from raising SIGPIPE, plain pipes fall back to write.
+            ssize_t written = send(fd, data, size, send_flags);
+            if (written < 0 && errno == ENOTSOCK) {written = write(fd, data, size);}
+            if (written < 0 && errno == EINTR) {continue;}
+            if (written <= 0) {return false;}
+            data += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    static bool read_all(int fd, char * data, size_t size)
+    {
+        while (size > 0)
+        {
+            ssize_t got = read(fd, data, size);
+            if (got < 0 && errno == EINTR) {continue;}
+            if (got <= 0) {return false;}
+            data += got;
+            size -= got;
+        }
+        return true;
+    }
+
+    static bool send_message(int fd, const ShardMessage & message)
+    {
+        uint64_t size = message.bytes.size();
+        return write_all(fd, (const char *)&size, sizeof(size)) && write_all(fd, message.bytes.data(), message.bytes.size());
+    }
+
+    static bool receive_message(int fd, ShardMessage & message)
+    {
+        uint64_t size;
+        if (!read_all(fd, (char *)&size, sizeof(size))) {return false;}
+        message.bytes.resize(size);
+        message.read_pos = 0;
+        return read_all(fd, message.bytes.data(), size);
+    }
+
+    static void set_no_sigpipe(int fd)
+    {
+#ifdef SO_NOSIGPIPE
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    }
+
+    /*
+     *  Forks a worker that talks to us over a socketpair. The child closes every
+     *  descriptor in open_fds so that it does not hold on to the other workers.
+     */
+    static int open_local_worker(vector<int> & open_fds, vector<pid_t> & children)
+    {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {return -1;}
+
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            close(fds[0]);
+            close(fds[1]);
+            return -1;
+        }
+        if (pid == 0)
+        {
+            close(fds[0]);
+            for (int fd : open_fds) {close(fd);}
+            set_no_sigpipe(fds[1]);
+            bool is_ok = run_shard_worker(fds[1], fds[1]);
+            _exit(is_ok ? 0 : 1);
+        }
+
+        close(fds[1]);
+        set_no_sigpipe(fds[0]);
+        children.push_back(pid);
+        return fds[0];
+    }
+
+    /*
+     *  Connects to a worker at "host:port".
+     */
+    static int connect_worker(const string & address)
+    {
+        size_t colon = address.rfind(':');
+        if (colon == string::npos) {return -1;}
+        string host = address.substr(0, colon);
+        string port = address.substr(colon + 1);
+
+        addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        addrinfo * results = NULL;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &results) != 0) {return -1;}
+
+        int fd = -1;
+        for (addrinfo * info = results; info != NULL; info = info->ai_next)
+        {
+            fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+            if (fd < 0) {continue;}
+            if (connect(fd, info->ai_addr, info->ai_addrlen) == 0) {break;}
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(results);
+
+        if (fd >= 0) {set_no_sigpipe(fd);}
+        return fd;
+    }
+
+    bool run_shard_worker(int in_fd, int out_fd)
+    {
+        ShardMessage job;
+        if (!receive_message(in_fd, job)) {return false;}
+
+        uint32_t magic, num_sites, num_owned;
+        Real bound_theta, covered_theta, rotation[9];
+
+        bool is_ok = job.get(magic) && magic == shard_job_magic && job.get(bound_theta) && job.get(covered_theta);
+        for (int i = 0; is_ok && i < 9; i++) {is_ok = job.get(rotation[i]);}
+        is_ok = is_ok && job.get(num_sites) && job.get(num_owned) && num_owned <= num_sites;
+        if (!is_ok) {return false;}
+
+        vector<uint32_t> ids(num_sites);
+        vector<tuple<Real, Real, Real>> local_verts;
+        for (uint32_t i = 0; is_ok && i < num_sites; i++)
+        {
+            Real x, y, z;
+            is_ok = job.get(ids[i]) && job.get(x) && job.get(y) && job.get(z);
+            local_verts.push_back(rotate(make_tuple(x, y, z), rotation));
+        }
+        if (!is_ok) {return false;}
+
+        VoronoiDiagramSphere diagram;
+        if (num_owned > 0)
+        {
+            compute_priority_queues(&diagram, &local_verts, bound_theta);
+        }
+
+        /*
+         *  Keep the edges of the cells we own. An edge between one of our cells and
+         *  a halo cell is sent by whichever shard owns the smaller site index.
+         *  A vertex can only be trusted if its empty circle lies inside the sites we
+         *  were given. Otherwise a site we never saw could be inside it.
+         */
+        bool is_certified = covered_theta >= M_PI;
+        vector<int> vertex_map(diagram.voronoi_vertices.size(), -1);
+        vector<PointCartesian> vertices;
+        vector<Edge> edges, edge_sites;
+
+        for (int i = 0; i < diagram.voronoi_edges.size(); i++)
+        {
+            Edge sites = diagram.voronoi_edge_sites[i];
+            bool is_owned[2] = {sites.vidx[0] < num_owned, sites.vidx[1] < num_owned};
+            int keeper = ids[sites.vidx[0]] < ids[sites.vidx[1]] ? 0 : 1;
+            if (!is_owned[keeper]) {continue;}
+
+            PointCartesian site = diagram.sites[sites.vidx[0]];
+            Edge edge;
+            for (int k = 0; k < 2; k++)
+            {
+                int vidx = diagram.voronoi_edges[i].vidx[k];
+                if (vertex_map[vidx] < 0)
+                {
+                    PointCartesian vertex = diagram.voronoi_vertices[vidx];
+
+                    Real theta = acos(max<Real>(-1, min<Real>(1, vertex.z)));
+                    Real radius = acos(max<Real>(-1, min<Real>(1, vertex.x * site.x + vertex.y * site.y + vertex.z * site.z)));
+                    if (theta + radius > covered_theta) {is_certified = false;}
+
+                    auto original = rotate_inverse(make_tuple(vertex.x, vertex.y, vertex.z), rotation);
+                    vertex_map[vidx] = (int)vertices.size();
+                    vertices.push_back(PointCartesian(get<0>(original), get<1>(original), get<2>(original)));
+                }
+                edge.vidx[k] = vertex_map[vidx];
+            }
+            edges.push_back(edge);
+            edge_sites.push_back(Edge(ids[sites.vidx[0]], ids[sites.vidx[1]]));
+        }
+
+        ShardMessage result;
+        result.put(shard_result_magic);
+        result.put((uint32_t)is_certified);
+        result.put((uint32_t)vertices.size());
+        for (auto vertex : vertices)
+        {
+            result.put(vertex.x);
+            result.put(vertex.y);
+            result.put(vertex.z);
+        }
+        result.put((uint32_t)edges.size());
+        for (int i = 0; i < edges.size(); i++)
+        {
+            result.put(edges[i].vidx[0]);
+            result.put(edges[i].vidx[1]);
+            result.put(edge_sites[i].vidx[0]);
+            result.put(edge_sites[i].vidx[1]);
+        }
+
+        return send_message(out_fd, result);
+    }
+
+    bool serve_shard_workers(int port)
+    {
+        int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (listen_fd < 0) {return false;}
+
+        int on = 1;
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        address.sin_port = htons(port);
+
+        if (::bind(listen_fd, (sockaddr *)&address, sizeof(address)) != 0 || listen(listen_fd, 64) != 0)
+        {
+            close(listen_fd);
+            return false;
+        }
+
+        // The jobs still running. Finished ones are reaped at least once a second, and
+        // only ever our own children, so the signal handling of the process is left alone.
+        vector<pid_t> children;
+
+        while (true)
+        {
+            pollfd listener = {listen_fd, POLLIN, 0};
+            int fd = (poll(&listener, 1, 1000) > 0) ? accept(listen_fd, NULL, NULL) : -1;
+
+            for (size_t i = 0; i < children.size(); )
+            {
+                pid_t reaped = waitpid(children[i], NULL, WNOHANG);
+                if (reaped == children[i] || (reaped < 0 && errno == ECHILD))
+                {
+                    children[i] = children.back();
+                    children.pop_back();
+                }
+                else {i++;}
+            }
+
+            if (fd < 0) {continue;}
+
+            pid_t pid = fork();
+            if (pid == 0)
+            {
+                close(listen_fd);
+                set_no_sigpipe(fd);
+                bool is_ok = run_shard_worker(fd, fd);
+                _exit(is_ok ? 0 : 1);
+            }
+            if (pid > 0) {children.push_back(pid);}
+            close(fd);
+        }
+    }
+
+    VoronoiDiagramSphere generate_voronoi_sharded(vector<tuple<Real, Real, Real>> * verts, int num_shards, const vector<string> * worker_addresses)
+    {
+        VoronoiDiagramSphere diagram;
+
+        if (num_shards < 2 || verts->size() < 4) {return generate_voronoi_one_thread(verts);}
+
+        // The cap centers are spread over the sphere with the golden angle.
+        const Real golden_angle = M_PI * (3 - sqrt(5.0));
+        vector<PointCartesian> centers;
+        for (int i = 0; i < num_shards; i++)
+        {
+            Real z = 1 - (2 * i + 1.0) / num_shards;
+            Real r = sqrt(1 - z * z);
+            centers.push_back(PointCartesian(r * cos(golden_angle * i), r * sin(golden_angle * i), z));
+        }
+
+        // The sites every shard owns, in index order.
+        vector<vector<uint32_t>> owned_sites(num_shards);
+        vector<Real> bound_thetas(num_shards, 0), halos(num_shards, halo_spacings * sqrt(4 * M_PI / verts->size()));
+
+        for (uint32_t i = 0; i < verts->size(); i++)
+        {
+            auto point = (*verts)[i];
+            int owner = 0;
+            Real closest_dot = -2;
+            for (int k = 0; k < num_shards; k++)
+            {
+                Real dot = get<0>(point) * centers[k].x + get<1>(point) * centers[k].y + get<2>(point) * centers[k].z;
+                if (dot > closest_dot)
+                {
+                    closest_dot = dot;
+                    owner = k;
+                }
+            }
+            Real theta = acos(max<Real>(-1, min<Real>(1, closest_dot)));
+            bound_thetas[owner] = max(bound_thetas[owner], theta);
+            owned_sites[owner].push_back(i);
+        }
+
+        vector<int> pending;
+        for (int k = 0; k < num_shards; k++)
+        {
+            if (!owned_sites[k].empty()) {pending.push_back(k);}
+        }
+
+        vector<ShardMessage> results(num_shards);
+        vector<pid_t> children;
+        bool is_ok = true;
+
+        while (is_ok && !pending.empty())
+        {
+            // Send every pending shard before reading any result so the workers run side by side.
+            vector<int> fds;
+            for (int i = 0; is_ok && i < pending.size(); i++)
+            {
+                int shard = pending[i];
+
+                Real rotation[9];
+                rotation_to_pole(centers[shard], rotation);
+
+                // The sweep stops once every site of the cap is finished. The halo
+                // is every other site that is at most the halo further out.
+                Real bound_theta = bound_thetas[shard] + 1e-9;
+                Real covered_theta = bound_theta + halos[shard];
+
+                ShardMessage job;
+                job.put(shard_job_magic);
+                job.put(bound_theta);
+                job.put(covered_theta);
+                for (int k = 0; k < 9; k++) {job.put(rotation[k]);}
+
+                // Only a cap that reaches within covered_theta of our center can have
+                // halo sites, so the others are never looked at.
+                vector<uint32_t> halo;
+                Real min_halo_dot = cos(min<Real>(M_PI, covered_theta));
+                for (int other = 0; other < num_shards; other++)
+                {
+                    if (other == shard || owned_sites[other].empty()) {continue;}
+                    Real center_dot = centers[other].x * centers[shard].x + centers[other].y * centers[shard].y + centers[other].z * centers[shard].z;
+                    if (acos(max<Real>(-1, min<Real>(1, center_dot))) > covered_theta + bound_thetas[other]) {continue;}
+
+                    for (uint32_t k : owned_sites[other])
+                    {
+                        auto point = (*verts)[k];
+                        Real dot = get<0>(point) * centers[shard].x + get<1>(point) * centers[shard].y + get<2>(point) * centers[shard].z;
+                        if (dot >= min_halo_dot) {halo.push_back(k);}
+                    }
+                }
+
+                job.put((uint32_t)(owned_sites[shard].size() + halo.size()));
+                job.put((uint32_t)owned_sites[shard].size());
+                auto put_site = [&](uint32_t k)
+                {
+                    job.put(k);
+                    job.put(get<0>((*verts)[k]));
+                    job.put(get<1>((*verts)[k]));
+                    job.put(get<2>((*verts)[k]));
+                };
+                for (uint32_t k : owned_sites[shard]) {put_site(k);}
+                for (uint32_t k : halo) {put_site(k);}
+
+                int fd = worker_addresses == NULL ? open_local_worker(fds, children) : connect_worker((*worker_addresses)[i % worker_addresses->size()]);
+                is_ok = fd >= 0 && send_message(fd, job);
+                if (fd >= 0) {fds.push_back(fd);}
+            }
+
+            vector<int> retry;
+            for (int i = 0; is_ok && i < pending.size(); i++)
+            {
+                int shard = pending[i];
+                uint32_t magic, is_certified;
+
+                is_ok = receive_message(fds[i], results[shard]) && results[shard].get(magic) && magic == shard_result_magic && results[shard].get(is_certified);
+                if (is_ok && !is_certified)
+                {
+                    // The halo was too thin for this cap, so send it again with twice the halo.
+                    halos[shard] *= 2;
+                    retry.push_back(shard);
+                }
+            }
+
+            for (int fd : fds) {close(fd);}
+            for (pid_t pid : children) {waitpid(pid, NULL, 0);}
+            children.clear();
+
+            pending = retry;
+        }
+
+        if (!is_ok) {return VoronoiDiagramSphere();}
+
+        // Stitch the caps together. Every seam edge was only sent by one shard.
+        for (auto point : *verts)
+        {
+            diagram.sites.push_back(PointCartesian(get<0>(point), get<1>(point), get<2>(point)));
+        }
+
+        for (int shard = 0; shard < num_shards; shard++)
+        {
+            if (owned_sites[shard].empty()) {continue;}
+
+            ShardMessage & result = results[shard];
+            unsigned int vertex_offset = (unsigned int)diagram.voronoi_vertices.size();
+
+            uint32_t num_vertices = 0, num_edges = 0;
+            result.get(num_vertices);
+            for (uint32_t i = 0; i < num_vertices; i++)
+            {
+                Real x = 0, y = 0, z = 0;
+                result.get(x);
+                result.get(y);
+                result.get(z);
+                diagram.voronoi_vertices.push_back(PointCartesian(x, y, z));
+            }
+
+            result.get(num_edges);
+            for (uint32_t i = 0; i < num_edges; i++)
+            {
+                Edge edge, sites;
+                result.get(edge.vidx[0]);
+                result.get(edge.vidx[1]);
+                result.get(sites.vidx[0]);
+                result.get(sites.vidx[1]);
+
+                edge.vidx[0] += vertex_offset;
+                edge.vidx[1] += vertex_offset;
+
+                diagram.voronoi_edges.push_back(edge);
+                diagram.voronoi_edge_sites.push_back(sites);
+                diagram.delaunay_edges.push_back(sites);
+            }
+        }
+
+        return diagram;
+    }
+}
@@ -0,0 +1,55 @@
+//
+//  voronoi_shard.h
+//  Voronoi
+//
+//  Copyright © 2016 Ellis Sparky Hoag. All rights reserved.
+//
+
+#ifndef VoronoiShard_h
+#define VoronoiShard_h
+
+#include <string>
+#include "voronoi_sphere.h"
+
+namespace Voronoi
+{
+    /*
+     *  Sharded generation spreads one diagram over several worker processes, which may
+     *  live on other machines. The sphere is split into num_shards caps around well spread
+     *  centers and every site belongs to the cap with the closest center. A worker gets
+     *  the sites of its cap plus a halo of seam sites from the neighbouring caps, rotates
+     *  its center to the north pole and runs the bounded sweep in compute_priority_queues.
+     *  It sends back only the edges of the cells it owns, and an edge between two caps is
+     *  kept by the cap that owns the smaller site index, so the coordinator can stitch the
+     *  seams by simply concatenating the results.
+     *
+     *  A worker also checks that the empty circle of every vertex it sends back lies inside
+     *  the sites it was given. If one does not, the halo was too thin and the coordinator
+     *  sends that shard again with twice the halo.
+     *
+     *  Messages are raw native endian values, so the coordinator and the workers need to
+     *  run on the same kind of machine.
+     */
+
+    /*
+     *  If worker_addresses is NULL, num_shards local worker processes are forked and talk
+     *  to the coordinator over socketpairs. Otherwise every shard connects to one of the
+     *  "host:port" addresses (round robin), each of which runs serve_shard_workers.
+     *  Returns an empty diagram if a worker can not be reached.
+     */
+    VoronoiDiagramSphere generate_voronoi_sharded(std::vector<std::tuple<Real, Real, Real>> * verts, int num_shards, const std::vector<std::string> * worker_addresses = NULL);
+
+    /*
+     *  Reads one shard job from in_fd, sweeps it and writes the result to out_fd.
+     *  Returns false if the job could not be read or the result could not be written.
+     */
+    bool run_shard_worker(int in_fd, int out_fd);
+
+    /*
+     *  Listens on port and runs every job that comes in on its own forked process.
+     *  Only returns (with false) if the socket can not be set up.
+     */
+    bool serve_shard_workers(int port);
+}
+
+#endif /* VoronoiShard_h */
@@ -7,27 +7,571 @@
 //
 
 #include "voronoi_sphere.h"
+#include "voronoi_hull.h"
+
+#include <chrono>
+#include <mutex>
+#include <fstream>
+#include <random>
+#include <limits>
 
 using namespace std;
 
+/*
+ *  VORONOI_STAT(statement) runs statement only when VORONOI_STATS is defined and
+ *  the current sweep was given a VoronoiStatsSphere. VORONOI_STAT_CLOCK(name)
+ *  starts a timer for a phase. Both compile to nothing without VORONOI_STATS.
+ */
+#ifdef VORONOI_STATS
+#define VORONOI_STAT(statement) do { if (sweep_stats != NULL) {statement;} } while (0)
+#define VORONOI_STAT_CLOCK(name) chrono::steady_clock::time_point name = chrono::steady_clock::now()
+#else
+#define VORONOI_STAT(statement) do {} while (0)
+#define VORONOI_STAT_CLOCK(name) do {} while (0)
+#endif
+
+/*
+ *  VORONOI_TRACE_BEGIN(name) marks the start of a span and VORONOI_TRACE_END(label, name)
+ *  records it for the calling thread. Both compile to nothing without VORONOI_TRACE.
+ */
+#ifdef VORONOI_TRACE
+#define VORONOI_TRACE_BEGIN(name) double name = trace_now()
+#define VORONOI_TRACE_END(label, name) add_trace_span(label, name)
+#define VORONOI_TRACE_END_COUNT(label, name, half_edges) add_trace_span(label, name, half_edges)
+#else
+#define VORONOI_TRACE_BEGIN(name) do {} while (0)
+#define VORONOI_TRACE_END(label, name) do {} while (0)
+#define VORONOI_TRACE_END_COUNT(label, name, half_edges) do {} while (0)
+#endif
+
 namespace Voronoi {
     
-    VoronoiDiagramSphere generate_voronoi(std::vector<std::tuple<Real, Real, Real>> * verts, THREAD_NUMBER num_threads, void (*render)(VoronoiDiagramSphere, ArcSphere *, vector<VoronoiCellSphere> *, Real), bool (*is_sleeping)())
+#ifdef VORONOI_STATS
+    // The stats of the sweep running on this thread.
+    static thread_local VoronoiStatsSphere * sweep_stats = NULL;
+    
+    static double seconds_since(chrono::steady_clock::time_point start)
+    {
+        return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+#endif
+    
+#ifdef VORONOI_TRACE
+    struct TraceSpan
+    {
+        const char * name;
+        
+        int tid;
+        
+        double start_us, duration_us;
+        
+        long half_edges;
+    };
+    
+    static mutex trace_mutex;
+    static vector<TraceSpan> trace_spans;
+    static vector<thread::id> trace_threads;
+    static chrono::steady_clock::time_point trace_origin = chrono::steady_clock::now();
+    
+    static double trace_now()
+    {
+        return chrono::duration<double, micro>(chrono::steady_clock::now() - trace_origin).count();
+    }
+    
+    static void add_trace_span(const char * name, double start_us, long half_edges = -1)
+    {
+        double end_us = trace_now();
+        
+        lock_guard<mutex> lock(trace_mutex);
+        
+        // Threads are numbered in the order they first record a span.
+        int tid = (int)(find(trace_threads.begin(), trace_threads.end(), this_thread::get_id()) - trace_threads.begin());
+        if (tid == trace_threads.size())
+        {
+            trace_threads.push_back(this_thread::get_id());
+        }
+        
+        TraceSpan span = {name, tid, start_us, end_us - start_us, half_edges};
+        trace_spans.push_back(span);
+    }
+    
+    void clear_trace()
+    {
+        lock_guard<mutex> lock(trace_mutex);
+        trace_spans.clear();
+        trace_threads.clear();
+        trace_origin = chrono::steady_clock::now();
+    }
+    
+    bool write_trace(const char * path)
+    {
+        lock_guard<mutex> lock(trace_mutex);
+        
+        ofstream out(path);
+        if (!out) {return false;}
+        
+        out << fixed << setprecision(3);
+        out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+        for (int tid = 0; tid < trace_threads.size(); tid++)
+        {
+            out << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": " << tid << ", \"args\": {\"name\": \"";
+            if (tid == 0) {out << "main";}
+            else {out << "worker " << tid;}
+            out << "\"}},\n";
+        }
+        for (int i = 0; i < trace_spans.size(); i++)
+        {
+            const TraceSpan & span = trace_spans[i];
+            out << "{\"name\": \"" << span.name << "\", \"cat\": \"voronoi\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << span.tid << ", \"ts\": " << span.start_us << ", \"dur\": " << span.duration_us;
+            if (span.half_edges >= 0)
+            {
+                out << ", \"args\": {\"half_edges\": " << span.half_edges << "}";
+            }
+            out << "}" << (i + 1 < trace_spans.size() ? ",\n" : "\n");
+        }
+        out << "]}\n";
+        
+        return (bool)out;
+    }
+#endif
+    
+    static inline void invalidate_circle_event(CircleEventSphere * event)
+    {
+        VORONOI_STAT(if (event->is_valid) {sweep_stats->circle_events_invalidated++;});
+        event->is_valid = false;
+    }
+    
+    // The workspace of the sweep running on this thread.
+    static thread_local SweepWorkspaceSphere * sweep_workspace = NULL;
+    
+    static inline ArcSphere * allocate_arc_sphere(int cell_id, int height)
+    {
+        ArcSphere * arc;
+        if (!sweep_workspace->free_arcs.empty())
+        {
+            arc = sweep_workspace->free_arcs.back();
+            sweep_workspace->free_arcs.pop_back();
+        }
+        else
+        {
+            arc = sweep_workspace->arcs.allocate();
+            arc->prev = sweep_workspace->links.allocate(MAX_SKIPLIST_HEIGHT);
+            arc->next = sweep_workspace->links.allocate(MAX_SKIPLIST_HEIGHT);
+        }
+        
+        arc->cell_idx = cell_id;
+        arc->height = height;
+        arc->event = NULL;
+        arc->left_edge_idx = arc->right_edge_idx = -1;
+        return arc;
+    }
+    
+    static inline CircleEventSphere * allocate_circle_event(ArcSphere * arc, PointSphere circumcenter, Real key)
+    {
+        CircleEventSphere * event;
+        if (!sweep_workspace->free_circle_events.empty())
+        {
+            event = sweep_workspace->free_circle_events.back();
+            sweep_workspace->free_circle_events.pop_back();
+        }
+        else
+        {
+            event = sweep_workspace->circle_events.allocate();
+        }
+        
+        *event = CircleEventSphere(arc, circumcenter, key);
+        return event;
+    }
+    
+    static inline void release_circle_event(CircleEventSphere * event)
+    {
+        sweep_workspace->free_circle_events.push_back(event);
+    }
+    
+#ifdef VORONOI_RECORD_KERNELS
+    KernelRecording * kernel_recording = NULL;
+    
+    void set_sweep_workspace(SweepWorkspaceSphere * workspace)
+    {
+        sweep_workspace = workspace;
+    }
+#endif
+    
+    // About four times the mean spacing of n sites. Sweeps go this far past their bound before they look further.
+    static inline Real sweep_margin(size_t n)
+    {
+        return 4 * sqrt(4 * M_PI / max<size_t>(n, 1));
+    }
+    
+    // The row major matrices of rotate_y and rotate_z.
+    static inline void rotation_y(Real sin_theta, Real cos_theta, Real rotation[9])
+    {
+        Real matrix[9] = {cos_theta, 0, -sin_theta, 0, 1, 0, sin_theta, 0, cos_theta};
+        copy(matrix, matrix + 9, rotation);
+    }
+    
+    static inline void rotation_z(Real sin_theta, Real cos_theta, Real rotation[9])
+    {
+        Real matrix[9] = {cos_theta, sin_theta, 0, -sin_theta, cos_theta, 0, 0, 0, 1};
+        copy(matrix, matrix + 9, rotation);
+    }
+    
+    // Sets product to the rotation that does second after first. product can be either of them.
+    static void multiply_rotations(const Real second[9], const Real first[9], Real product[9])
+    {
+        Real matrix[9];
+        for (int row = 0; row < 3; row++)
+        {
+            for (int col = 0; col < 3; col++)
+            {
+                matrix[3 * row + col] = second[3 * row] * first[col] + second[3 * row + 1] * first[3 + col] + second[3 * row + 2] * first[6 + col];
+            }
+        }
+        copy(matrix, matrix + 9, product);
+    }
+    
+    // How far a sweep of n sites bounded at bound_theta queues sites before it looks further.
+    static inline Real initial_reach(Real bound_theta, size_t n)
+    {
+        return (bound_theta < M_PI) ? bound_theta + sweep_margin(n) : INFINITY;
+    }
+    
+    /*
+     *  The depth of the point at theta from the sine and cosine of theta, for theta in [0, 2 PI).
+     *  Near the north pole 1 - cos(theta) is worked out as sin(theta)^2 / (1 + cos(theta)) so it
+     *  keeps its precision.
+     */
+    static inline Real depth(Real sin_theta, Real cos_theta)
+    {
+        if (sin_theta < 0) {return 3 + cos_theta;}
+        return (cos_theta > 0) ? sin_theta * sin_theta / (1 + cos_theta) : 1 - cos_theta;
+    }
+    
+    static inline Real site_depth(Real x, Real y, Real z)
+    {
+        return depth(sqrt(x * x + y * y), z);
+    }
+    
+    // sin(theta) of a site, which always has its Cartesian coordinates. cos(theta) is its z.
+    static inline Real site_sin_theta(const PointSphere & site)
+    {
+        return sqrt(site.x * site.x + site.y * site.y);
+    }
+    
+    // The key of the sweep line at theta. Anything from 2 PI on is past every event.
+    static inline Real theta_to_key(SWEEP_KEY sweep_key, Real theta)
+    {
+        if (sweep_key == THETA_KEY) {return theta;}
+        if (theta < 0) {return theta;}
+        if (!(theta < 2 * M_PI)) {return INFINITY;}
+        return depth(sin(theta), cos(theta));
+    }
+    
+    static inline Real key_to_theta(SWEEP_KEY sweep_key, Real key)
+    {
+        if (sweep_key == THETA_KEY) {return key;}
+        return (key <= 2) ? 2 * asin(sqrt(key / 2)) : 2 * M_PI - 2 * asin(sqrt((4 - key) / 2));
+    }
+    
+    VoronoiDiagramSphere generate_voronoi(std::vector<std::tuple<Real, Real, Real>> * verts, THREAD_NUMBER num_threads, void (*render)(const VoronoiDiagramSphere &, const ArcSphere *, const vector<VoronoiCellSphere> *, Real), bool (*is_sleeping)(), VoronoiStatsSphere * stats, PARTITION_MODE partition, ENGINE_MODE engine)
+    {
+        VoronoiSphereGenerator generator;
+        generator.generate_voronoi(verts, num_threads, render, is_sleeping, stats, partition, engine);
+        return generator.take_voronoi_diagram();
+    }
+    
+    VoronoiDiagramSphere generate_voronoi_one_thread(vector<tuple<Real, Real, Real>> * verts, void (*render)(const VoronoiDiagramSphere &, const ArcSphere *, const vector<VoronoiCellSphere> *, Real), bool (*is_sleeping)(), VoronoiStatsSphere * stats)
+    {
+        return generate_voronoi(verts, ONE_THREAD, render, is_sleeping, stats);
+    }
+    
+    VoronoiDiagramSphere generate_voronoi_two_threads(vector<tuple<Real, Real, Real>> * verts, VoronoiStatsSphere * stats, PARTITION_MODE partition)
+    {
+        return generate_voronoi(verts, TWO_THREADS, NULL, NULL, stats, partition);
+    }
+    
+    VoronoiDiagramSphere generate_voronoi_four_threads(vector<tuple<Real, Real, Real>> * verts, VoronoiStatsSphere * stats, PARTITION_MODE partition)
+    {
+        return generate_voronoi(verts, FOUR_THREADS, NULL, NULL, stats, partition);
+    }
+    
+    VoronoiDiagramSphere generate_voronoi_cap(vector<tuple<Real, Real, Real>> * verts, PointCartesian center, Real cap_radius, vector<unsigned int> * site_ids, VoronoiStatsSphere * stats)
+    {
+        VoronoiSphereGenerator generator;
+        generator.generate_voronoi_cap(verts, center, cap_radius, site_ids, stats);
+        return generator.take_voronoi_diagram();
+    }
+    
+    VoronoiSnapshotSphere::VoronoiSnapshotSphere(unsigned long _events_per_publish) : newest(-1), events_per_publish(max(_events_per_publish, 1UL)), num_events(0)
+    {
+        num_readers[0] = 0;
+        num_readers[1] = 0;
+    }
+    
+    void VoronoiSnapshotSphere::observe(const VoronoiDiagramSphere & voronoi_diagram, const ArcSphere * beach_head, const vector<VoronoiCellSphere> & cells, Real sweep_line, void * data)
+    {
+        VoronoiSnapshotSphere * snapshot = (VoronoiSnapshotSphere *)data;
+        
+        if (beach_head == NULL)
+        {
+            // The sweep is finished so the viewer has to get this one.
+            while (!snapshot->publish(voronoi_diagram, beach_head, sweep_line))
+            {
+                this_thread::yield();
+            }
+        }
+        else if (++snapshot->num_events % snapshot->events_per_publish == 0)
+        {
+            snapshot->publish(voronoi_diagram, beach_head, sweep_line);
+        }
+    }
+    
+    template <typename T>
+    static void append_new(vector<T> & frame, const vector<T> & source)
+    {
+        frame.insert(frame.end(), source.begin() + frame.size(), source.end());
+    }
+    
+    bool VoronoiSnapshotSphere::publish(const VoronoiDiagramSphere & voronoi_diagram, const ArcSphere * beach_head, Real sweep_line)
+    {
+        int back = 1 - max(newest.load(), 0);
+        if (num_readers[back].load() != 0) {return false;}
+        
+        SnapshotFrameSphere & frame = frames[back];
+        VoronoiDiagramSphere & diagram = frame.voronoi_diagram;
+        
+        // The sweep line only moves forward and the diagram only grows, unless this is a new sweep.
+        if (sweep_line < frame.sweep_line || diagram.sites.size() != voronoi_diagram.sites.size() || diagram.voronoi_vertices.size() > voronoi_diagram.voronoi_vertices.size() || diagram.voronoi_edges.size() > voronoi_diagram.voronoi_edges.size() || diagram.delaunay_edges.size() > voronoi_diagram.delaunay_edges.size())
+        {
+            diagram.clear();
+        }
+        
+        append_new(diagram.sites, voronoi_diagram.sites);
+        append_new(diagram.voronoi_vertices, voronoi_diagram.voronoi_vertices);
+        append_new(diagram.voronoi_edges, voronoi_diagram.voronoi_edges);
+        append_new(diagram.delaunay_edges, voronoi_diagram.delaunay_edges);
+        append_new(diagram.voronoi_edge_sites, voronoi_diagram.voronoi_edge_sites);
+        
+        frame.beachline.clear();
+        if (beach_head != NULL)
+        {
+            const ArcSphere * cur = beach_head;
+            do
+            {
+                cur = cur->next[0];
+                frame.beachline.push_back(cur->cell_idx);
+            } while (cur != beach_head);
+        }
+        
+        frame.sweep_line = sweep_line;
+        frame.num_events = num_events;
+        
+        newest.store(back);
+        return true;
+    }
+    
+    const SnapshotFrameSphere * VoronoiSnapshotSphere::acquire()
+    {
+        while (true)
+        {
+            int frame = newest.load();
+            if (frame < 0) {return NULL;}
+            
+            num_readers[frame]++;
+            
+            /*
+             *  The sweep only fills the frame that is not the newest, so if this one is
+             *  still the newest after we marked it the sweep will leave it alone.
+             */
+            if (newest.load() == frame) {return &frames[frame];}
+            
+            num_readers[frame]--;
+        }
+    }
+    
+    void VoronoiSnapshotSphere::release(const SnapshotFrameSphere * frame)
+    {
+        if (frame != NULL)
+        {
+            num_readers[frame - frames]--;
+        }
+    }
+    
+    VoronoiSphereGenerator::VoronoiSphereGenerator() : site_order(INPUT_ORDER), prepass_verts(NULL), prepass_order(NULL), num_prepass_partitions(0), num_prepass_ranges(0), normalize_sites(false), observer(NULL), observer_data(NULL), num_workers(0), num_jobs_running(0), num_jobs_left(0), worker_job(NULL), generation(0), is_stopping(false) {}
+    
+    VoronoiSphereGenerator::~VoronoiSphereGenerator()
     {
+        {
+            lock_guard<mutex> lock(worker_mutex);
+            is_stopping = true;
+        }
+        worker_condition.notify_all();
+        
+        for (int i = 0; i < num_workers; i++)
+        {
+            workers[i].join();
+        }
+    }
+    
+    const VoronoiDiagramSphere & VoronoiSphereGenerator::generate_voronoi(vector<tuple<Real, Real, Real>> * verts, THREAD_NUMBER num_threads, void (*render)(const VoronoiDiagramSphere &, const ArcSphere *, const vector<VoronoiCellSphere> *, Real), bool (*is_sleeping)(), VoronoiStatsSphere * stats, PARTITION_MODE partition, ENGINE_MODE engine)
+    {
+        if (engine == HULL_ENGINE || engine == INCREMENTAL_ENGINE)
+        {
+            if (!hull_workspace) {hull_workspace.reset(new HullWorkspaceSphere());}
+            if (engine == HULL_ENGINE) {generate_voronoi_hull(verts, &diagrams[0], num_threads, normalize_sites, hull_workspace.get());}
+            else {generate_voronoi_incremental(verts, &diagrams[0], normalize_sites, hull_workspace.get());}
+            return diagrams[0];
+        }
+        
+        prepass_order = NULL;
+        if (site_order != INPUT_ORDER)
+        {
+            order_sites(verts);
+            prepass_order = site_permutation.data();
+        }
+        
         switch (num_threads) {
             case ONE_THREAD:
-                return generate_voronoi_one_thread(verts, render, is_sleeping);
+                generate_one_thread(verts, render, is_sleeping, stats);
                 break;
             case TWO_THREADS:
-                return generate_voronoi_two_threads(verts);
+                generate_two_threads(verts, stats, partition);
                 break;
             case FOUR_THREADS:
-                return generate_voronoi_four_threads(verts);
+                generate_four_threads(verts, stats, partition);
+                break;
+            default:
+                diagrams[0].clear();
                 break;
         }
+        
+        if (prepass_order != NULL) {restore_site_order();}
+        return diagrams[0];
+    }
+    
+    void VoronoiSphereGenerator::order_sites(vector<tuple<Real, Real, Real>> * verts)
+    {
+        // The curve keys fit in a double exactly.
+        site_keys.resize(verts->size());
+        for (unsigned int i = 0; i < verts->size(); i++)
+        {
+            PointCartesian point(get<0>((*verts)[i]), get<1>((*verts)[i]), get<2>((*verts)[i]));
+            Real key = (site_order == CURVE_ORDER) ? (Real)sphere_curve_key(point) : -point.z / sqrt(point.x * point.x + point.y * point.y + point.z * point.z);
+            site_keys[i] = make_pair(key, i);
+        }
+        sort(site_keys.begin(), site_keys.end());
+        
+        site_permutation.resize(verts->size());
+        for (unsigned int i = 0; i < verts->size(); i++)
+        {
+            site_permutation[i] = site_keys[i].second;
+        }
+    }
+    
+    void VoronoiSphereGenerator::restore_site_order()
+    {
+        VoronoiDiagramSphere & voronoi_diagram = diagrams[0];
+        const vector<unsigned int> & order = site_permutation;
+        
+        ordered_sites.swap(voronoi_diagram.sites);
+        voronoi_diagram.sites.resize(ordered_sites.size());
+        for (unsigned int i = 0; i < ordered_sites.size(); i++)
+        {
+            voronoi_diagram.sites[order[i]] = ordered_sites[i];
+        }
+        
+        for (Edge & edge : voronoi_diagram.voronoi_edge_sites)
+        {
+            edge.vidx[0] = order[edge.vidx[0]];
+            edge.vidx[1] = order[edge.vidx[1]];
+        }
+        for (Edge & edge : voronoi_diagram.delaunay_edges)
+        {
+            edge.vidx[0] = order[edge.vidx[0]];
+            edge.vidx[1] = order[edge.vidx[1]];
+        }
+    }
+    
+    void VoronoiSphereGenerator::run_sweeps(int num_sweeps)
+    {
+        run_jobs(&VoronoiSphereGenerator::run_sweep, num_sweeps);
+    }
+    
+    void VoronoiSphereGenerator::run_sweep(int sweep)
+    {
+        compute_priority_queues(&diagrams[sweep], sub_sweep_sites[sweep], sub_sweep_bound_theta[sweep], sub_sweep_stats[sweep], &workspaces[sweep]);
+    }
+    
+    void VoronoiSphereGenerator::run_prepass(vector<tuple<Real, Real, Real>> * verts, int num_partitions, int num_jobs)
+    {
+        for (int k = 0; k < num_partitions; k++)
+        {
+            sweep_sites[k].resize(verts->size());
+        }
+        
+        prepass_verts = verts;
+        num_prepass_partitions = num_partitions;
+        num_prepass_ranges = num_jobs;
+        
+        run_jobs(&VoronoiSphereGenerator::run_prepass_range, num_jobs);
+    }
+    
+    void VoronoiSphereGenerator::run_prepass_range(int range)
+    {
+        size_t n = prepass_verts->size();
+        prepare_sweep_sites(prepass_verts, num_prepass_partitions, prepass_rotations, sweep_sites, normalize_sites, n * range / num_prepass_ranges, n * (range + 1) / num_prepass_ranges, workspaces[0].sweep_key, prepass_order);
+    }
+    
+    void VoronoiSphereGenerator::run_jobs(void (VoronoiSphereGenerator::*job)(int), int num_jobs)
+    {
+        // Workers are only started the first time they are needed.
+        while (num_workers < num_jobs - 1)
+        {
+            workers[num_workers] = thread(&VoronoiSphereGenerator::run_worker, this, num_workers + 1, generation);
+            num_workers++;
+        }
+        
+        {
+            lock_guard<mutex> lock(worker_mutex);
+            worker_job = job;
+            num_jobs_running = num_jobs;
+            num_jobs_left = num_jobs - 1;
+            generation++;
+        }
+        worker_condition.notify_all();
+        
+        (this->*job)(0);
+        
+        VORONOI_TRACE_BEGIN(join_trace);
+        unique_lock<mutex> lock(worker_mutex);
+        worker_condition.wait(lock, [this] {return num_jobs_left == 0;});
+        VORONOI_TRACE_END("join wait", join_trace);
+    }
+    
+    void VoronoiSphereGenerator::run_worker(int worker, unsigned long seen_generation)
+    {
+        unique_lock<mutex> lock(worker_mutex);
+        while (true)
+        {
+            worker_condition.wait(lock, [&] {return is_stopping || generation != seen_generation;});
+            if (is_stopping) {return;}
+            
+            seen_generation = generation;
+            if (worker >= num_jobs_running) {continue;}
+            
+            void (VoronoiSphereGenerator::*job)(int) = worker_job;
+            lock.unlock();
+            (this->*job)(worker);
+            lock.lock();
+            
+            if (--num_jobs_left == 0)
+            {
+                worker_condition.notify_all();
+            }
+        }
     }
 
-    VoronoiDiagramSphere generate_voronoi_four_threads(vector<tuple<Real, Real, Real>> * verts)
+    void VoronoiSphereGenerator::generate_four_threads(vector<tuple<Real, Real, Real>> * verts, VoronoiStatsSphere * stats, PARTITION_MODE partition)
     {
         /*
          *  The voronoi diagram is computed from sites on the sphere corresponding
@@ -38,37 +582,76 @@ namespace Voronoi {
          *  B: (arcsin(1/3) + PI/2, 0)
          *  C: (arcsin(1/3) + PI/2, 2PI/3)
          *  D: (arcsin(1/3) + PI/2, 4PI/3)
+         *  With BALANCED_PARTITION the sites are first rotated to take sites off
+         *  the fullest cap, and the results are rotated back.
          */
         
-        VoronoiDiagramSphere diagram_a, diagram_b, diagram_c, diagram_d;
+        VoronoiDiagramSphere & diagram_a = diagrams[0];
+        VoronoiDiagramSphere & diagram_b = diagrams[1];
+        VoronoiDiagramSphere & diagram_c = diagrams[2];
+        VoronoiDiagramSphere & diagram_d = diagrams[3];
+        
+        VoronoiStatsSphere stats_a, stats_b, stats_c, stats_d;
+        VoronoiStatsSphere * sub_stats[4] = {NULL, NULL, NULL, NULL};
+        VORONOI_STAT_CLOCK(rotation_start);
+        VORONOI_TRACE_BEGIN(rotation_trace);
+#ifdef VORONOI_STATS
+        if (stats != NULL)
+        {
+            sub_stats[0] = &stats_a;
+            sub_stats[1] = &stats_b;
+            sub_stats[2] = &stats_c;
+            sub_stats[3] = &stats_d;
+        }
+#endif
         
-        vector<tuple<Real, Real, Real>> b_verts, c_verts, d_verts;
+        Real rotation[9] = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+        bool is_rotated = partition == BALANCED_PARTITION;
+        if (is_rotated)
+        {
+            balance_four_thread_partition(verts, rotation, &partition_sample);
+        }
         
-        for (auto point : *verts)
+        // We transform vertices to corresponding points on the tetrahedron
+        Real to_b[9], to_c[9], to_d[9];
+        rotation_y(SIN_NEG_ARCSIN_ONE_THIRD_PLUS_PI_2, COS_NEG_ARCSIN_ONE_THIRD_PLUS_PI_2, to_b);
+        rotation_z(SIN_TWO_PI_3, COS_TWO_PI_3, to_c);
+        multiply_rotations(to_b, to_c, to_c);
+        rotation_z(SIN_FOUR_PI_3, COS_FOUR_PI_3, to_d);
+        multiply_rotations(to_b, to_d, to_d);
+        
+        prepass_rotations[0] = is_rotated ? rotation : NULL;
+        const Real * to_corner[4] = {NULL, to_b, to_c, to_d};
+        for (int i = 1; i < 4; i++)
         {
-            // We transform vertices to corresponding points on the tetrahedron
-            auto b = rotate_y(point, SIN_NEG_ARCSIN_ONE_THIRD_PLUS_PI_2, COS_NEG_ARCSIN_ONE_THIRD_PLUS_PI_2);
-            
-            auto c = rotate_z(point, SIN_TWO_PI_3, COS_TWO_PI_3);
-            c = rotate_y(c, SIN_NEG_ARCSIN_ONE_THIRD_PLUS_PI_2, COS_NEG_ARCSIN_ONE_THIRD_PLUS_PI_2);
-            
-            auto d = rotate_z(point, SIN_FOUR_PI_3, COS_FOUR_PI_3);
-            d = rotate_y(d, SIN_NEG_ARCSIN_ONE_THIRD_PLUS_PI_2, COS_NEG_ARCSIN_ONE_THIRD_PLUS_PI_2);
-            
-            b_verts.push_back(b);
-            c_verts.push_back(c);
-            d_verts.push_back(d);
+            if (is_rotated)
+            {
+                multiply_rotations(to_corner[i], rotation, prepass_rotation_storage[i]);
+            }
+            else
+            {
+                copy(to_corner[i], to_corner[i] + 9, prepass_rotation_storage[i]);
+            }
+            prepass_rotations[i] = prepass_rotation_storage[i];
         }
+        run_prepass(verts, 4, 4);
+        
+#ifdef VORONOI_STATS
+        double rotation_seconds = seconds_since(rotation_start);
+#endif
+        VORONOI_TRACE_END("rotation", rotation_trace);
         
-        thread b_thread(compute_priority_queues, &diagram_b, &b_verts, ARCTAN_2_ROOT_2);
-        thread c_thread(compute_priority_queues, &diagram_c, &c_verts, ARCTAN_2_ROOT_2);
-        thread d_thread(compute_priority_queues, &diagram_d, &d_verts, ARCTAN_2_ROOT_2);
+        for (int i = 0; i < 4; i++)
+        {
+            sub_sweep_sites[i] = &sweep_sites[i];
+            sub_sweep_bound_theta[i] = ARCTAN_2_ROOT_2;
+            sub_sweep_stats[i] = sub_stats[i];
+        }
         
-        compute_priority_queues(&diagram_a, verts, ARCTAN_2_ROOT_2);
+        run_sweeps(4);
         
-        b_thread.join();
-        c_thread.join();
-        d_thread.join();
+        VORONOI_STAT_CLOCK(merge_start);
+        VORONOI_TRACE_BEGIN(merge_trace);
         
         unsigned long a_voronoi_vertex_length = diagram_a.voronoi_vertices.size();
         unsigned long b_voronoi_vertex_length = diagram_b.voronoi_vertices.size();
@@ -77,226 +660,935 @@ namespace Voronoi {
         // Merge the voronoi vertices
         for (int i = 0; i < diagram_b.voronoi_vertices.size(); i++)
         {
-            auto vert = diagram_b.voronoi_vertices[i];
-            auto transformed_vert = rotate_y(make_tuple(vert.x, vert.y, vert.z), SIN_ARCSIN_ONE_THIRD_PLUS_PI_2, COS_ARCSIN_ONE_THIRD_PLUS_PI_2);
+            auto vert = diagram_b.voronoi_vertices[i];
+            auto transformed_vert = rotate_y(make_tuple(vert.x, vert.y, vert.z), SIN_ARCSIN_ONE_THIRD_PLUS_PI_2, COS_ARCSIN_ONE_THIRD_PLUS_PI_2);
+            
+            diagram_a.voronoi_vertices.push_back(PointCartesian(get<0>(transformed_vert), get<1>(transformed_vert), get<2>(transformed_vert)));
+        }
+        for (int i = 0; i < diagram_c.voronoi_vertices.size(); i++)
+        {
+            auto vert = diagram_c.voronoi_vertices[i];
+            auto transformed_vert = rotate_y(make_tuple(vert.x, vert.y, vert.z), SIN_ARCSIN_ONE_THIRD_PLUS_PI_2, COS_ARCSIN_ONE_THIRD_PLUS_PI_2);
+            transformed_vert = rotate_z(transformed_vert, SIN_FOUR_PI_3, COS_FOUR_PI_3);
+            
+            diagram_a.voronoi_vertices.push_back(PointCartesian(get<0>(transformed_vert), get<1>(transformed_vert), get<2>(transformed_vert)));
+        }
+        for (int i = 0; i < diagram_d.voronoi_vertices.size(); i++)
+        {
+            auto vert = diagram_d.voronoi_vertices[i];
+            auto transformed_vert = rotate_y(make_tuple(vert.x, vert.y, vert.z), SIN_ARCSIN_ONE_THIRD_PLUS_PI_2, COS_ARCSIN_ONE_THIRD_PLUS_PI_2);
+            transformed_vert = rotate_z(transformed_vert, SIN_TWO_PI_3, COS_TWO_PI_3);
+            
+            diagram_a.voronoi_vertices.push_back(PointCartesian(get<0>(transformed_vert), get<1>(transformed_vert), get<2>(transformed_vert)));
+        }
+
+        // Merge the voronoi edges
+        for (auto voronoi_edge : diagram_b.voronoi_edges)
+        {
+            voronoi_edge.vidx[0] += a_voronoi_vertex_length;
+            voronoi_edge.vidx[1] += a_voronoi_vertex_length;
+
+            diagram_a.voronoi_edges.push_back(voronoi_edge);
+        }
+        for (auto voronoi_edge : diagram_c.voronoi_edges)
+        {
+            voronoi_edge.vidx[0] += a_voronoi_vertex_length + b_voronoi_vertex_length;
+            voronoi_edge.vidx[1] += a_voronoi_vertex_length + b_voronoi_vertex_length;
+            
+            diagram_a.voronoi_edges.push_back(voronoi_edge);
+        }
+        for (auto voronoi_edge : diagram_d.voronoi_edges)
+        {
+            voronoi_edge.vidx[0] += a_voronoi_vertex_length + b_voronoi_vertex_length + c_voronoi_vertex_length;
+            voronoi_edge.vidx[1] += a_voronoi_vertex_length + b_voronoi_vertex_length + c_voronoi_vertex_length;
+            
+            diagram_a.voronoi_edges.push_back(voronoi_edge);
+        }
+        
+        diagram_a.voronoi_edge_sites.insert(diagram_a.voronoi_edge_sites.end(), diagram_b.voronoi_edge_sites.begin(), diagram_b.voronoi_edge_sites.end());
+        diagram_a.voronoi_edge_sites.insert(diagram_a.voronoi_edge_sites.end(), diagram_c.voronoi_edge_sites.begin(), diagram_c.voronoi_edge_sites.end());
+        diagram_a.voronoi_edge_sites.insert(diagram_a.voronoi_edge_sites.end(), diagram_d.voronoi_edge_sites.begin(), diagram_d.voronoi_edge_sites.end());
+        
+        // Merge the delaunay edges
+        for (auto delaunay_edge : diagram_b.delaunay_edges)
+        {
+            diagram_a.delaunay_edges.push_back(delaunay_edge);
+        }
+        for (auto delaunay_edge : diagram_c.delaunay_edges)
+        {
+            diagram_a.delaunay_edges.push_back(delaunay_edge);
+        }
+        for (auto delaunay_edge : diagram_d.delaunay_edges)
+        {
+            diagram_a.delaunay_edges.push_back(delaunay_edge);
+        }
+        
+        if (is_rotated)
+        {
+            // Rotate everything back to where the caller's sites are
+            for (int i = 0; i < diagram_a.voronoi_vertices.size(); i++)
+            {
+                auto vert = diagram_a.voronoi_vertices[i];
+                auto transformed_vert = rotate_inverse(make_tuple(vert.x, vert.y, vert.z), rotation);
+                diagram_a.voronoi_vertices[i] = PointCartesian(get<0>(transformed_vert), get<1>(transformed_vert), get<2>(transformed_vert));
+            }
+            for (int i = 0; i < verts->size(); i++)
+            {
+                const tuple<Real, Real, Real> & point = (*verts)[(prepass_order != NULL) ? prepass_order[i] : i];
+                diagram_a.sites[i] = PointCartesian(get<0>(point), get<1>(point), get<2>(point));
+            }
+        }
+        
+#ifdef VORONOI_STATS
+        if (stats != NULL)
+        {
+            for (int i = 0; i < 4; i++) {stats->add_sub_sweep(*sub_stats[i]);}
+            stats->input_seconds += rotation_seconds;
+            stats->merge_seconds = seconds_since(merge_start);
+        }
+#endif
+        VORONOI_TRACE_END("merge", merge_trace);
+    }
+
+    void VoronoiSphereGenerator::generate_two_threads(vector<tuple<Real, Real, Real>> * verts, VoronoiStatsSphere * stats, PARTITION_MODE partition)
+    {
+        VoronoiDiagramSphere & diagram_top_down = diagrams[0];
+        VoronoiDiagramSphere & diagram_bottom_up = diagrams[1];
+        
+        VoronoiStatsSphere stats_top_down, stats_bottom_up;
+        VoronoiStatsSphere * stats_top_down_ptr = NULL, * stats_bottom_up_ptr = NULL;
+        VORONOI_STAT_CLOCK(rotation_start);
+        VORONOI_TRACE_BEGIN(rotation_trace);
+#ifdef VORONOI_STATS
+        if (stats != NULL)
+        {
+            stats_top_down_ptr = &stats_top_down;
+            stats_bottom_up_ptr = &stats_bottom_up;
+        }
+#endif
+        
+        /*
+         *  The top down sweep handles the sites with theta < bound_theta and the
+         *  bottom up sweep, on the mirrored sites, handles the rest.
+         *  With BALANCED_PARTITION the sites are rotated first and the seam is moved
+         *  so both sweeps get about the same number of sites.
+         */
+        Real rotation[9] = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+        Real bound_theta = M_PI_2;
+        bool is_rotated = partition == BALANCED_PARTITION;
+        if (is_rotated)
+        {
+            balance_two_thread_partition(verts, rotation, bound_theta, &partition_sample, &partition_angles);
+        }
+        
+        // The bottom up sweep sees the sites mirrored through the equator.
+        Real * mirror = prepass_rotation_storage[1];
+        copy(rotation, rotation + 9, mirror);
+        for (int i = 6; i < 9; i++)
+        {
+            mirror[i] = -mirror[i];
+        }
+        
+        prepass_rotations[0] = is_rotated ? rotation : NULL;
+        prepass_rotations[1] = mirror;
+        
+        run_prepass(verts, 2, 2);
+     
+#ifdef VORONOI_STATS
+        double rotation_seconds = seconds_since(rotation_start);
+#endif
+        VORONOI_TRACE_END("rotation", rotation_trace);
+     
+        // The worker processes the southern hemisphere
+        sub_sweep_sites[0] = &sweep_sites[0];
+        sub_sweep_bound_theta[0] = bound_theta;
+        sub_sweep_stats[0] = stats_top_down_ptr;
+        sub_sweep_sites[1] = &sweep_sites[1];
+        sub_sweep_bound_theta[1] = M_PI - bound_theta;
+        sub_sweep_stats[1] = stats_bottom_up_ptr;
+        
+        run_sweeps(2);
+        
+        VORONOI_STAT_CLOCK(merge_start);
+        VORONOI_TRACE_BEGIN(merge_trace);
+        
+        // Merge the two voronoi diagrams
+        unsigned int vertices_length = (unsigned int)diagram_top_down.voronoi_vertices.size();
+        
+        for (auto vertex : diagram_bottom_up.voronoi_vertices)
+        {
+            diagram_top_down.voronoi_vertices.push_back(PointCartesian(vertex.x, vertex.y, -vertex.z));
+        }
+        
+        for (auto voronoi_edge : diagram_bottom_up.voronoi_edges)
+        {
+            voronoi_edge.vidx[0] += vertices_length;
+            voronoi_edge.vidx[1] += vertices_length;
+            
+            diagram_top_down.voronoi_edges.push_back(voronoi_edge);
+        }
+        
+        diagram_top_down.voronoi_edge_sites.insert(diagram_top_down.voronoi_edge_sites.end(), diagram_bottom_up.voronoi_edge_sites.begin(), diagram_bottom_up.voronoi_edge_sites.end());
+        
+        for (auto delaunay_edge : diagram_bottom_up.delaunay_edges)
+        {
+            diagram_top_down.delaunay_edges.push_back(delaunay_edge);
+        }
+        
+        if (is_rotated)
+        {
+            // Rotate everything back to where the caller's sites are
+            for (int i = 0; i < diagram_top_down.voronoi_vertices.size(); i++)
+            {
+                auto vert = diagram_top_down.voronoi_vertices[i];
+                auto transformed_vert = rotate_inverse(make_tuple(vert.x, vert.y, vert.z), rotation);
+                diagram_top_down.voronoi_vertices[i] = PointCartesian(get<0>(transformed_vert), get<1>(transformed_vert), get<2>(transformed_vert));
+            }
+            for (int i = 0; i < verts->size(); i++)
+            {
+                const tuple<Real, Real, Real> & point = (*verts)[(prepass_order != NULL) ? prepass_order[i] : i];
+                diagram_top_down.sites[i] = PointCartesian(get<0>(point), get<1>(point), get<2>(point));
+            }
+        }
+        
+#ifdef VORONOI_STATS
+        if (stats != NULL)
+        {
+            stats->add_sub_sweep(stats_top_down);
+            stats->add_sub_sweep(stats_bottom_up);
+            stats->input_seconds += rotation_seconds;
+            stats->merge_seconds = seconds_since(merge_start);
+        }
+#endif
+        VORONOI_TRACE_END("merge", merge_trace);
+    }
+    
+    const VoronoiDiagramSphere & VoronoiSphereGenerator::generate_voronoi_cap(vector<tuple<Real, Real, Real>> * verts, PointCartesian center, Real cap_radius, vector<unsigned int> * site_ids, VoronoiStatsSphere * stats)
+    {
+        VoronoiDiagramSphere & voronoi_diagram = diagrams[0];
+        VoronoiDiagramSphere & cap_diagram = diagrams[1];
+        if (site_ids == NULL) {site_ids = &cap_site_ids;}
+        
+        center.normalize();
+        Real rotation[9];
+        rotation_to_pole(center, rotation);
+        
+        /*
+         *  A cell in the cap is done once the sweep has passed its site and every
+         *  circle event of its arc, which happens a few site spacings past the cap.
+         *  Only the sites up to sweep_limit are swept. The sweep is exact up to there
+         *  since every site it could have seen by then is in it, so if it has to stop
+         *  at sweep_limit before the cap is done the margin is doubled and it goes again.
+         */
+        Real margin = sweep_margin(verts->size());
+        bool is_complete = false;
+        while (!is_complete)
+        {
+            Real sweep_limit = cap_radius + margin;
+            bool is_whole_sphere = sweep_limit >= M_PI;
+            Real min_z = is_whole_sphere ? -2 : cos(sweep_limit);
+            
+            cap_verts.clear();
+            site_ids->clear();
+            for (unsigned int i = 0; i < verts->size(); i++)
+            {
+                const tuple<Real, Real, Real> & point = (*verts)[i];
+                
+                // Only the z of the rotated site decides whether it is swept.
+                if (rotation[6] * get<0>(point) + rotation[7] * get<1>(point) + rotation[8] * get<2>(point) < min_z) {continue;}
+                
+                cap_verts.push_back(rotate(point, rotation));
+                site_ids->push_back(i);
+            }
+            
+            is_complete = compute_priority_queues(&cap_diagram, &cap_verts, cap_radius, stats, &workspaces[0], is_whole_sphere ? INFINITY : sweep_limit);
+            margin *= 2;
+        }
+        
+        vector<HalfEdgeSphere> & half_edges = workspaces[0].half_edges;
+        if (workspaces[0].site_event_queue.empty() && workspaces[0].circle_event_queue.empty())
+        {
+            // The sweep went over the whole sphere, so the final two edges need to be connected.
+            int last_edges[2], num_last_edges = 0;
+            for (int i = 0; i < half_edges.size() && num_last_edges < 2; i++)
+            {
+                if (!half_edges[i].is_finished) {last_edges[num_last_edges++] = i;}
+            }
+            if (num_last_edges == 2)
+            {
+                finish_half_edge_sphere(&cap_diagram, &half_edges, last_edges[0], cap_diagram.voronoi_vertices[half_edges[last_edges[1]].start_idx]);
+                finish_half_edge_sphere(&cap_diagram, &half_edges, last_edges[1], cap_diagram.voronoi_vertices[half_edges[last_edges[0]].start_idx]);
+            }
+        }
+        
+        // Keep the edges of the cells in the cap and rotate them back.
+        const vector<VoronoiCellSphere> & cells = workspaces[0].cells;
+        Real cap_key = theta_to_key(workspaces[0].sweep_key, cap_radius);
+        voronoi_diagram.clear();
+        
+        for (unsigned int i = 0; i < site_ids->size(); i++)
+        {
+            const tuple<Real, Real, Real> & point = (*verts)[(*site_ids)[i]];
+            voronoi_diagram.sites.push_back(PointCartesian(get<0>(point), get<1>(point), get<2>(point)));
+        }
+        
+        for (unsigned int i = 0; i < cap_diagram.voronoi_edges.size(); i++)
+        {
+            const Edge & edge_sites = cap_diagram.voronoi_edge_sites[i];
+            if (cells[edge_sites.vidx[0]].key >= cap_key && cells[edge_sites.vidx[1]].key >= cap_key) {continue;}
+            
+            unsigned int start_idx = (unsigned int)voronoi_diagram.voronoi_vertices.size();
+            for (int k = 0; k < 2; k++)
+            {
+                const PointCartesian & vert = cap_diagram.voronoi_vertices[cap_diagram.voronoi_edges[i].vidx[k]];
+                auto transformed_vert = rotate_inverse(make_tuple(vert.x, vert.y, vert.z), rotation);
+                voronoi_diagram.voronoi_vertices.push_back(PointCartesian(get<0>(transformed_vert), get<1>(transformed_vert), get<2>(transformed_vert)));
+            }
+            voronoi_diagram.voronoi_edges.push_back(Edge(start_idx, start_idx + 1));
+            voronoi_diagram.voronoi_edge_sites.push_back(edge_sites);
+        }
+        
+        for (auto delaunay_edge : cap_diagram.delaunay_edges)
+        {
+            if (cells[delaunay_edge.vidx[0]].key < cap_key || cells[delaunay_edge.vidx[1]].key < cap_key)
+            {
+                voronoi_diagram.delaunay_edges.push_back(delaunay_edge);
+            }
+        }
+        
+        return voronoi_diagram;
+    }
+    
+    // At most this many sites are looked at to balance a partition.
+    static const size_t partition_sample_size = 4096;
+    
+    static void sample_sites(vector<tuple<Real, Real, Real>> * verts, vector<PointCartesian> & sample)
+    {
+        sample.clear();
+        size_t stride = max<size_t>(1, verts->size() / partition_sample_size);
+        for (size_t i = 0; i < verts->size(); i += stride)
+        {
+            sample.push_back(PointCartesian(get<0>((*verts)[i]), get<1>((*verts)[i]), get<2>((*verts)[i])));
+        }
+    }
+    
+    void balance_two_thread_partition(vector<tuple<Real, Real, Real>> * verts, Real rotation[9], Real & bound_theta, vector<PointCartesian> * sample_buffer, vector<Real> * angles_buffer)
+    {
+        /*
+         *  Every candidate axis is split at the median angle of the sampled sites so
+         *  both sweeps get the same number of site events. The sweeps keep going past
+         *  the seam until the cells along it are finished, and that extra work grows
+         *  with the number of sites near the seam. So we keep the axis with the
+         *  fewest samples in a band around its seam.
+         */
+        const int num_axes = 32;
+        const Real band = 0.1;
+        const Real golden_angle = M_PI * (3 - sqrt(5.0));
+        
+        vector<PointCartesian> own_sample;
+        vector<Real> own_angles;
+        vector<PointCartesian> & sample = (sample_buffer != NULL) ? *sample_buffer : own_sample;
+        vector<Real> & angles = (angles_buffer != NULL) ? *angles_buffer : own_angles;
+        sample_sites(verts, sample);
+        
+        PointCartesian axis(0, 0, 1);
+        bound_theta = M_PI_2;
+        
+        if (sample.size() >= 2)
+        {
+            // The default axis goes first so it wins ties.
+            PointCartesian axes[num_axes + 1] = {PointCartesian(0, 0, 1)};
+            for (int i = 0; i < num_axes; i++)
+            {
+                Real z = 1 - (i + 0.5) / num_axes;
+                Real r = sqrt(1 - z * z);
+                axes[i + 1] = PointCartesian(r * cos(golden_angle * i), r * sin(golden_angle * i), z);
+            }
+            
+            angles.resize(sample.size());
+            unsigned long best_cost = numeric_limits<unsigned long>::max();
+            
+            for (auto candidate : axes)
+            {
+                for (int i = 0; i < sample.size(); i++)
+                {
+                    Real dot = candidate.x * sample[i].x + candidate.y * sample[i].y + candidate.z * sample[i].z;
+                    angles[i] = acos(max<Real>(-1, min<Real>(1, dot)));
+                }
+                
+                nth_element(angles.begin(), angles.begin() + angles.size() / 2, angles.end());
+                Real seam = angles[angles.size() / 2];
+                
+                unsigned long cost = 0;
+                for (Real angle : angles)
+                {
+                    if (abs(angle - seam) < band) {cost++;}
+                }
+                
+                if (cost < best_cost)
+                {
+                    best_cost = cost;
+                    axis = candidate;
+                    bound_theta = seam;
+                }
+            }
+        }
+        
+        rotation_to_pole(axis, rotation);
+    }
+    
+    void rotation_to_pole(PointCartesian axis, Real rotation[9])
+    {
+        // The rows of the rotation are an orthonormal basis with the axis last.
+        PointCartesian helper = (abs(axis.x) < 0.9) ? PointCartesian(1, 0, 0) : PointCartesian(0, 1, 0);
+        PointCartesian u = PointCartesian::cross_product(helper, axis);
+        u.normalize();
+        PointCartesian v = PointCartesian::cross_product(axis, u);
+        
+        Real basis[9] = {u.x, u.y, u.z, v.x, v.y, v.z, axis.x, axis.y, axis.z};
+        copy(basis, basis + 9, rotation);
+    }
+    
+    unsigned long long sphere_curve_key(const PointCartesian & p)
+    {
+        Real ax = fabs(p.x), ay = fabs(p.y), az = fabs(p.z);
+        unsigned int face;
+        Real u, v, w;
+        if (ax >= ay && ax >= az) {face = (p.x > 0) ? 0 : 1; u = p.y; v = p.z; w = ax;}
+        else if (ay >= az) {face = (p.y > 0) ? 2 : 3; u = p.z; v = p.x; w = ay;}
+        else {face = (p.z > 0) ? 4 : 5; u = p.x; v = p.y; w = az;}
+        
+        const unsigned int side = 1 << 16;
+        unsigned int x = (w > 0) ? min(side - 1, (unsigned int)((u / w + 1) * (side / 2))) : 0;
+        unsigned int y = (w > 0) ? min(side - 1, (unsigned int)((v / w + 1) * (side / 2))) : 0;
+        
+        // The quadrant at every level, then the turn the curve makes in it, done with masks since the branches would be random.
+        unsigned long long d = 0;
+        for (int level = 15; level >= 0; level--)
+        {
+            unsigned int rx = (x >> level) & 1;
+            unsigned int ry = (y >> level) & 1;
+            d |= (unsigned long long)((3 * rx) ^ ry) << (2 * level);
             
-            diagram_a.voronoi_vertices.push_back(PointCartesian(get<0>(transformed_vert), get<1>(transformed_vert), get<2>(transformed_vert)));
+            unsigned int is_lower = ry ^ 1;
+            unsigned int flip = (0u - (rx & is_lower)) & (side - 1);
+            x ^= flip;
+            y ^= flip;
+            unsigned int exchange = (x ^ y) & (0u - is_lower);
+            x ^= exchange;
+            y ^= exchange;
         }
-        for (int i = 0; i < diagram_c.voronoi_vertices.size(); i++)
+        return ((unsigned long long)face << 32) | d;
+    }
+    
+    typedef vector<pair<unsigned long long, unsigned int>> SortKeys;
+    
+    /*
+     *  Sorts keys, which are in order of their second member, on their first member with a
+     *  least significant digit radix sort of 11 bits at a time, which leaves equal keys in
+     *  order. Only the digits up to the highest bit set in any key are sorted.
+     */
+    static void radix_sort(SortKeys & keys, SortKeys & scratch)
+    {
+        const int digit_bits = 11;
+        const size_t num_buckets = 1 << digit_bits;
+        
+        unsigned long long all_bits = 0;
+        for (const auto & key : keys)
         {
-            auto vert = diagram_c.voronoi_vertices[i];
-            auto transformed_vert = rotate_y(make_tuple(vert.x, vert.y, vert.z), SIN_ARCSIN_ONE_THIRD_PLUS_PI_2, COS_ARCSIN_ONE_THIRD_PLUS_PI_2);
-            transformed_vert = rotate_z(transformed_vert, SIN_FOUR_PI_3, COS_FOUR_PI_3);
-            
-            diagram_a.voronoi_vertices.push_back(PointCartesian(get<0>(transformed_vert), get<1>(transformed_vert), get<2>(transformed_vert)));
+            all_bits |= key.first;
         }
-        for (int i = 0; i < diagram_d.voronoi_vertices.size(); i++)
+        
+        scratch.resize(keys.size());
+        vector<size_t> starts(num_buckets);
+        for (int shift = 0; shift < 64 && (all_bits >> shift) != 0; shift += digit_bits)
         {
-            auto vert = diagram_d.voronoi_vertices[i];
-            auto transformed_vert = rotate_y(make_tuple(vert.x, vert.y, vert.z), SIN_ARCSIN_ONE_THIRD_PLUS_PI_2, COS_ARCSIN_ONE_THIRD_PLUS_PI_2);
-            transformed_vert = rotate_z(transformed_vert, SIN_TWO_PI_3, COS_TWO_PI_3);
+            fill(starts.begin(), starts.end(), 0);
+            for (const auto & key : keys)
+            {
+                starts[(key.first >> shift) & (num_buckets - 1)]++;
+            }
             
-            diagram_a.voronoi_vertices.push_back(PointCartesian(get<0>(transformed_vert), get<1>(transformed_vert), get<2>(transformed_vert)));
+            size_t start = 0;
+            for (size_t & bucket_start : starts)
+            {
+                size_t count = bucket_start;
+                bucket_start = start;
+                start += count;
+            }
+            
+            for (const auto & key : keys)
+            {
+                scratch[starts[(key.first >> shift) & (num_buckets - 1)]++] = key;
+            }
+            keys.swap(scratch);
         }
-
-        // Merge the voronoi edges
-        for (auto voronoi_edge : diagram_b.voronoi_edges)
+    }
+    
+    /*
+     *  Sets order to the indices of points sorted on sphere_curve_key, and new_index to where
+     *  every point goes.
+     */
+    static void curve_order(const vector<PointCartesian> & points, SortKeys & keys, SortKeys & scratch, vector<unsigned int> & order, vector<unsigned int> & new_index)
+    {
+        keys.resize(points.size());
+        for (unsigned int i = 0; i < points.size(); i++)
         {
-            voronoi_edge.vidx[0] += a_voronoi_vertex_length;
-            voronoi_edge.vidx[1] += a_voronoi_vertex_length;
-
-            diagram_a.voronoi_edges.push_back(voronoi_edge);
+            keys[i] = make_pair(sphere_curve_key(points[i]), i);
         }
-        for (auto voronoi_edge : diagram_c.voronoi_edges)
+        radix_sort(keys, scratch);
+        
+        order.resize(points.size());
+        new_index.resize(points.size());
+        for (unsigned int i = 0; i < points.size(); i++)
         {
-            voronoi_edge.vidx[0] += a_voronoi_vertex_length + b_voronoi_vertex_length;
-            voronoi_edge.vidx[1] += a_voronoi_vertex_length + b_voronoi_vertex_length;
-            
-            diagram_a.voronoi_edges.push_back(voronoi_edge);
+            order[i] = keys[i].second;
+            new_index[keys[i].second] = i;
         }
-        for (auto voronoi_edge : diagram_d.voronoi_edges)
+    }
+    
+    // Sets order to the indices of edges sorted on their (smaller, larger) vidx.
+    static void edge_order(const vector<Edge> & edges, SortKeys & keys, SortKeys & scratch, vector<unsigned int> & order)
+    {
+        keys.resize(edges.size());
+        for (unsigned int i = 0; i < edges.size(); i++)
         {
-            voronoi_edge.vidx[0] += a_voronoi_vertex_length + b_voronoi_vertex_length + c_voronoi_vertex_length;
-            voronoi_edge.vidx[1] += a_voronoi_vertex_length + b_voronoi_vertex_length + c_voronoi_vertex_length;
-            
-            diagram_a.voronoi_edges.push_back(voronoi_edge);
+            unsigned long long first = min(edges[i].vidx[0], edges[i].vidx[1]);
+            unsigned long long second = max(edges[i].vidx[0], edges[i].vidx[1]);
+            keys[i] = make_pair((first << 32) | second, i);
         }
+        radix_sort(keys, scratch);
         
-        // Merge the delaunay edges
-        for (auto delaunay_edge : diagram_b.delaunay_edges)
+        order.resize(edges.size());
+        for (unsigned int i = 0; i < edges.size(); i++)
         {
-            diagram_a.delaunay_edges.push_back(delaunay_edge);
+            order[i] = keys[i].second;
         }
-        for (auto delaunay_edge : diagram_c.delaunay_edges)
+    }
+    
+    template <typename T>
+    static void apply_order(vector<T> & values, const vector<unsigned int> & order)
+    {
+        vector<T> old_values;
+        old_values.swap(values);
+        values.resize(order.size());
+        for (unsigned int i = 0; i < order.size(); i++)
         {
-            diagram_a.delaunay_edges.push_back(delaunay_edge);
+            values[i] = old_values[order[i]];
         }
-        for (auto delaunay_edge : diagram_d.delaunay_edges)
+    }
+    
+    static void renumber_edges(vector<Edge> & edges, const vector<unsigned int> & new_index)
+    {
+        for (Edge & edge : edges)
         {
-            diagram_a.delaunay_edges.push_back(delaunay_edge);
+            edge.vidx[0] = new_index[edge.vidx[0]];
+            edge.vidx[1] = new_index[edge.vidx[1]];
         }
-
-        return diagram_a;
     }
-
-    VoronoiDiagramSphere generate_voronoi_two_threads(vector<tuple<Real, Real, Real>> * verts)
+    
+    void renumber_voronoi_diagram(VoronoiDiagramSphere * voronoi_diagram, DiagramPermutationSphere * permutation)
     {
-        VoronoiDiagramSphere diagram_top_down, diagram_bottom_up;
+        DiagramPermutationSphere own_permutation;
+        if (permutation == NULL) {permutation = &own_permutation;}
+        
+        SortKeys keys, scratch;
+        vector<unsigned int> new_site_index, new_vertex_index;
+        
+        curve_order(voronoi_diagram->sites, keys, scratch, permutation->sites, new_site_index);
+        apply_order(voronoi_diagram->sites, permutation->sites);
+        renumber_edges(voronoi_diagram->voronoi_edge_sites, new_site_index);
+        renumber_edges(voronoi_diagram->delaunay_edges, new_site_index);
+        
+        curve_order(voronoi_diagram->voronoi_vertices, keys, scratch, permutation->voronoi_vertices, new_vertex_index);
+        apply_order(voronoi_diagram->voronoi_vertices, permutation->voronoi_vertices);
+        renumber_edges(voronoi_diagram->voronoi_edges, new_vertex_index);
         
-        vector<tuple<Real, Real, Real>> bottom_up_verts;
+        // voronoi_edge_sites goes along with voronoi_edges if it is there.
+        bool has_edge_sites = voronoi_diagram->voronoi_edge_sites.size() == voronoi_diagram->voronoi_edges.size();
+        edge_order(has_edge_sites ? voronoi_diagram->voronoi_edge_sites : voronoi_diagram->voronoi_edges, keys, scratch, permutation->voronoi_edges);
+        apply_order(voronoi_diagram->voronoi_edges, permutation->voronoi_edges);
+        if (has_edge_sites) {apply_order(voronoi_diagram->voronoi_edge_sites, permutation->voronoi_edges);}
+        
+        edge_order(voronoi_diagram->delaunay_edges, keys, scratch, permutation->delaunay_edges);
+        apply_order(voronoi_diagram->delaunay_edges, permutation->delaunay_edges);
+    }
+    
+    void prepare_sweep_sites(const vector<tuple<Real, Real, Real>> * verts, int num_partitions, const Real * const rotations[], SweepSitesSphere * partitions, bool normalize, size_t first, size_t last, SWEEP_KEY sweep_key, const unsigned int * order)
+    {
+        const size_t block_size = 256;
+        Real in_x[block_size], in_y[block_size], in_z[block_size];
         
-        for (auto point : *verts)
+        for (size_t start = first; start < last; start += block_size)
         {
-            bottom_up_verts.push_back(make_tuple(get<0>(point), get<1>(point), -get<2>(point)));
+            size_t count = min(block_size, last - start);
+            
+            for (size_t i = 0; i < count; i++)
+            {
+                const tuple<Real, Real, Real> & point = (*verts)[(order != NULL) ? order[start + i] : start + i];
+                in_x[i] = get<0>(point);
+                in_y[i] = get<1>(point);
+                in_z[i] = get<2>(point);
+            }
+            
+            if (normalize)
+            {
+                for (size_t i = 0; i < count; i++)
+                {
+                    Real scale = 1 / sqrt(in_x[i] * in_x[i] + in_y[i] * in_y[i] + in_z[i] * in_z[i]);
+                    in_x[i] *= scale;
+                    in_y[i] *= scale;
+                    in_z[i] *= scale;
+                }
+            }
+            
+            for (int k = 0; k < num_partitions; k++)
+            {
+                Real * x = &partitions[k].x[start];
+                Real * y = &partitions[k].y[start];
+                Real * z = &partitions[k].z[start];
+                Real * theta = &partitions[k].theta[start];
+                Real * phi = &partitions[k].phi[start];
+                
+                const Real * r = rotations[k];
+                if (r == NULL)
+                {
+                    copy(in_x, in_x + count, x);
+                    copy(in_y, in_y + count, y);
+                    copy(in_z, in_z + count, z);
+                }
+                else
+                {
+                    for (size_t i = 0; i < count; i++)
+                    {
+                        x[i] = r[0] * in_x[i] + r[1] * in_y[i] + r[2] * in_z[i];
+                        y[i] = r[3] * in_x[i] + r[4] * in_y[i] + r[5] * in_z[i];
+                        z[i] = r[6] * in_x[i] + r[7] * in_y[i] + r[8] * in_z[i];
+                    }
+                }
+                
+                // The whole block goes through the array versions, which vectorize.
+                if (sweep_key == THETA_KEY)
+                {
+                    fast_acos(z, theta, count);
+                }
+                fast_atan2(y, x, phi, count);
+            }
         }
-     
-        // Create a new thread to process the southern hemisphere
-        thread diagram_bottom_up_thread(compute_priority_queues, &diagram_bottom_up, &bottom_up_verts, M_PI_2);
+    }
+    
+    void balance_four_thread_partition(vector<tuple<Real, Real, Real>> * verts, Real rotation[9], vector<PointCartesian> * sample_buffer)
+    {
+        /*
+         *  Every thread sweeps all the sites in the cap of radius ARCTAN_2_ROOT_2
+         *  around its tetrahedron corner, so a site within that of two corners is
+         *  work for both. We try a fixed set of random rotations and keep the one
+         *  with the fewest sites in its fullest cap plus the average cap, as the
+         *  caps overlap more a rotation can even out the caps while adding to the
+         *  work of all of them. The identity goes first so it wins ties.
+         */
+        const int num_rotations = 64;
         
-        compute_priority_queues(&diagram_top_down, verts, M_PI_2);
-
-        diagram_bottom_up_thread.join();
+        vector<PointCartesian> own_sample;
+        vector<PointCartesian> & sample = (sample_buffer != NULL) ? *sample_buffer : own_sample;
+        sample_sites(verts, sample);
         
-        // Merge the two voronoi diagrams
-        unsigned int vertices_length = (unsigned int)diagram_top_down.voronoi_vertices.size();
+        // The tetrahedron corners, found the same way the merge maps vertices back.
+        tuple<Real, Real, Real> pole = make_tuple(0, 0, 1);
+        tuple<Real, Real, Real> b = rotate_y(pole, SIN_ARCSIN_ONE_THIRD_PLUS_PI_2, COS_ARCSIN_ONE_THIRD_PLUS_PI_2);
+        tuple<Real, Real, Real> corners[4] = {pole, b, rotate_z(b, SIN_FOUR_PI_3, COS_FOUR_PI_3), rotate_z(b, SIN_TWO_PI_3, COS_TWO_PI_3)};
         
-        for (auto vertex : diagram_bottom_up.voronoi_vertices)
+        Real identity[9] = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+        copy(identity, identity + 9, rotation);
+        
+        mt19937 rng(0);
+        uniform_real_distribution<Real> unit(0, 1);
+        
+        unsigned long best_cost = numeric_limits<unsigned long>::max();
+        
+        for (int r = 0; r < num_rotations; r++)
         {
-            diagram_top_down.voronoi_vertices.push_back(PointCartesian(vertex.x, vertex.y, -vertex.z));
+            Real candidate[9];
+            copy(identity, identity + 9, candidate);
+            
+            if (r > 0)
+            {
+                // Uniformly random unit quaternion (Shoemake)
+                Real u1 = unit(rng), u2 = unit(rng), u3 = unit(rng);
+                Real w = sqrt(1 - u1) * sin(2 * M_PI * u2);
+                Real x = sqrt(1 - u1) * cos(2 * M_PI * u2);
+                Real y = sqrt(u1) * sin(2 * M_PI * u3);
+                Real z = sqrt(u1) * cos(2 * M_PI * u3);
+                
+                Real matrix[9] = {
+                    1 - 2 * (y*y + z*z), 2 * (x*y - z*w), 2 * (x*z + y*w),
+                    2 * (x*y + z*w), 1 - 2 * (x*x + z*z), 2 * (y*z - x*w),
+                    2 * (x*z - y*w), 2 * (y*z + x*w), 1 - 2 * (x*x + y*y)
+                };
+                copy(matrix, matrix + 9, candidate);
+            }
+            
+            unsigned long loads[4] = {0, 0, 0, 0};
+            for (auto point : sample)
+            {
+                auto rotated = rotate(make_tuple(point.x, point.y, point.z), candidate);
+                
+                // cos(ARCTAN_2_ROOT_2) is 1/3.
+                for (int k = 0; k < 4; k++)
+                {
+                    Real dot = get<0>(rotated) * get<0>(corners[k]) + get<1>(rotated) * get<1>(corners[k]) + get<2>(rotated) * get<2>(corners[k]);
+                    loads[k] += (3 * dot >= 1);
+                }
+            }
+            
+            unsigned long cost = 4 * *max_element(loads, loads + 4) + loads[0] + loads[1] + loads[2] + loads[3];
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                copy(candidate, candidate + 9, rotation);
+            }
         }
+    }
+    
+    /*
+     *  The cell of site idx of sites for a sweep ordered on sweep_key, with the angles the
+     *  pre-pass worked out. A DEPTH_KEY sweep has no theta, so its sites get NAN there.
+     */
+    static inline VoronoiCellSphere make_site_cell(SWEEP_KEY sweep_key, const SweepSitesSphere * sites, unsigned int idx)
+    {
+        Real x = sites->x[idx], y = sites->y[idx], z = sites->z[idx];
+        if (sweep_key == DEPTH_KEY)
+        {
+            return VoronoiCellSphere(PointSphere(NAN, sites->phi[idx], x, y, z), idx, site_depth(x, y, z));
+        }
+        return VoronoiCellSphere(PointSphere(sites->theta[idx], sites->phi[idx], x, y, z), idx);
+    }
+    
+    /*
+     *  Readies workspace for a sweep of sites and adds the sites to voronoi_diagram.
+     *  Only the sites with theta <= reach are queued, the rest are deferred.
+     */
+    static void begin_sweep(SweepWorkspaceSphere * workspace, VoronoiDiagramSphere * voronoi_diagram, const SweepSitesSphere * sites, Real bound_theta = INFINITY, Real reach = INFINITY)
+    {
+        sweep_workspace = workspace;
+        workspace->reset();
+        workspace->bound_key = theta_to_key(workspace->sweep_key, bound_theta);
+        voronoi_diagram->clear();
         
-        for (auto voronoi_edge : diagram_bottom_up.voronoi_edges)
+        Real min_z = (reach < M_PI) ? cos(reach) : -2;
+        
+        for (unsigned int i = 0; i < sites->size(); i++)
         {
-            voronoi_edge.vidx[0] += vertices_length;
-            voronoi_edge.vidx[1] += vertices_length;
+            PointCartesian point_cartesian = PointCartesian(sites->x[i], sites->y[i], sites->z[i]);
             
-            diagram_top_down.voronoi_edges.push_back(voronoi_edge);
+            voronoi_diagram->sites.push_back(point_cartesian);
+            
+            if (point_cartesian.z < min_z)
+            {
+                workspace->deferred_sites.push_back(i);
+                workspace->cells.push_back(VoronoiCellSphere(PointSphere(), i, INFINITY));
+                continue;
+            }
+            
+            VoronoiCellSphere cell = make_site_cell(workspace->sweep_key, sites, i);
+            
+            workspace->site_event_queue.push(cell);
+            
+            workspace->cells.push_back(cell);
         }
+    }
+    
+    /*
+     *  Queues the deferred sites with theta <= reach.
+     */
+    static void queue_deferred_sites(SweepWorkspaceSphere * workspace, VoronoiDiagramSphere * voronoi_diagram, const SweepSitesSphere * sites, Real reach)
+    {
+        Real min_z = (reach < M_PI) ? cos(reach) : -2;
         
-        for (auto delaunay_edge : diagram_bottom_up.delaunay_edges)
+        vector<unsigned int> & deferred_sites = workspace->deferred_sites;
+        size_t num_left = 0;
+        for (unsigned int idx : deferred_sites)
         {
-            diagram_top_down.delaunay_edges.push_back(delaunay_edge);
+            if (voronoi_diagram->sites[idx].z < min_z)
+            {
+                deferred_sites[num_left++] = idx;
+                continue;
+            }
+            
+            workspace->cells[idx] = make_site_cell(workspace->sweep_key, sites, idx);
+            workspace->site_event_queue.push(workspace->cells[idx]);
         }
+        deferred_sites.resize(num_left);
+    }
+    
+    bool compute_priority_queues(VoronoiDiagramSphere * voronoi_diagram, vector<tuple<Real, Real, Real>> * verts, Real bound_theta, VoronoiStatsSphere * stats, SweepWorkspaceSphere * workspace, Real sweep_limit)
+    {
+        SweepWorkspaceSphere own_workspace;
+        if (workspace == NULL) {workspace = &own_workspace;}
+        
+        const Real * no_rotation[1] = {NULL};
+        workspace->input_sites.resize(verts->size());
+        prepare_sweep_sites(verts, 1, no_rotation, &workspace->input_sites, false, 0, verts->size(), workspace->sweep_key);
         
-        return diagram_top_down;
+        return compute_priority_queues(voronoi_diagram, &workspace->input_sites, bound_theta, stats, workspace, sweep_limit);
     }
     
-    void compute_priority_queues(VoronoiDiagramSphere * voronoi_diagram, vector<tuple<Real, Real, Real>> * verts, Real bound_theta)
-    {        
+    bool compute_priority_queues(VoronoiDiagramSphere * voronoi_diagram, const SweepSitesSphere * sites, Real bound_theta, VoronoiStatsSphere * stats, SweepWorkspaceSphere * workspace, Real sweep_limit)
+    {
+#ifdef VORONOI_STATS
+        sweep_stats = stats;
+#endif
+        VORONOI_STAT_CLOCK(input_start);
+        VORONOI_TRACE_BEGIN(input_trace);
+        
+        SweepWorkspaceSphere own_workspace;
+        if (workspace == NULL) {workspace = &own_workspace;}
+        
+        /*
+         *  A bounded sweep only needs the sites up to a little past bound_theta, since it
+         *  stops once the arcs of the sites before bound_theta are gone. The sites past reach
+         *  are only queued if the next event would be past it, and reach moves out further
+         *  every time. Every event up to reach is the same as with all the sites queued.
+         */
+        Real margin = sweep_margin(sites->size());
+        Real reach = initial_reach(bound_theta, sites->size());
+        
+        begin_sweep(workspace, voronoi_diagram, sites, bound_theta, reach);
+        
+        // The sweep line and the limits are all keys from here on.
+        SWEEP_KEY sweep_key = workspace->sweep_key;
+        Real bound_key = workspace->bound_key;
+        Real limit_key = theta_to_key(sweep_key, sweep_limit);
+        Real reach_key = theta_to_key(sweep_key, reach);
+        
         Real sweep_line = 0;
         
         ArcSphere * beach_head = NULL;
                 
-        vector<HalfEdgeSphere> half_edges;
+        vector<HalfEdgeSphere> & half_edges = workspace->half_edges;
         
-        vector<VoronoiCellSphere> cells;
+        vector<VoronoiCellSphere> & cells = workspace->cells;
 
-        priority_queue<VoronoiCellSphere, vector<VoronoiCellSphere>, PriorityQueueCompare> site_event_queue;
+        SweepQueueSphere<VoronoiCellSphere> & site_event_queue = workspace->site_event_queue;
 
-        priority_queue<CircleEventSphere *, vector<CircleEventSphere *>, PriorityQueueCompare> circle_event_queue;
+        SweepQueueSphere<CircleEventSphere *> & circle_event_queue = workspace->circle_event_queue;
         
-        for (auto point : *verts)
-        {
-            PointCartesian point_cartesian = PointCartesian(get<0>(point), get<1>(point), get<2>(point));
-   
-            VoronoiCellSphere cell = VoronoiCellSphere(point_cartesian, (unsigned int)cells.size());
-            
-            site_event_queue.push(cell);
-            
-            cells.push_back(cell);
-            
-            voronoi_diagram->sites.push_back(point_cartesian);
-        }
+        VORONOI_STAT(sweep_stats->input_seconds += seconds_since(input_start));
+        VORONOI_STAT_CLOCK(sweep_start);
+        VORONOI_TRACE_END("input", input_trace);
+        VORONOI_TRACE_BEGIN(sweep_trace);
         
-        while (!site_event_queue.empty() || !circle_event_queue.empty())
+        bool is_complete = true;
+        
+        while (!site_event_queue.empty() || !circle_event_queue.empty() || !workspace->deferred_sites.empty())
         {
-            if (sweep_line > bound_theta)
+            // We have finished this hemisphere once no site before bound_theta is left in the beachline
+            if (sweep_line > bound_key && workspace->num_bound_arcs == 0) {break;}
+            
+            if (!workspace->deferred_sites.empty())
             {
-                // We need to check if this hemisphere is finished
-                bool is_finished = true;
-                ArcSphere * cur = beach_head;
-                do
+                Real next_key = site_event_queue.empty() ? INFINITY : site_event_queue.top().key;
+                if (!circle_event_queue.empty()) {next_key = min(next_key, circle_event_queue.top()->key);}
+                
+                if (next_key > reach_key)
                 {
-                    if (cells[cur->cell_idx].site.theta < bound_theta)
-                    {
-                        // There is still a site in the beachline we need to process
-                        is_finished = false;
-                        break;
-                    }
-                } while ((cur = cur->next[0]) != beach_head);
-
-                if (is_finished) {break;} // We have finished this hemisphere
+                    margin *= 2;
+                    reach = (bound_theta + margin < M_PI) ? bound_theta + margin : INFINITY;
+                    reach_key = theta_to_key(sweep_key, reach);
+                    queue_deferred_sites(workspace, voronoi_diagram, sites, reach);
+                    continue;
+                }
             }
             
             if (!circle_event_queue.empty() && !circle_event_queue.top()->is_valid)
             {
                 // Remove invalid circle events
-                delete circle_event_queue.top();
+                release_circle_event(circle_event_queue.top());
                 circle_event_queue.pop();
             }
-            else if (site_event_queue.empty() || (!circle_event_queue.empty() && site_event_queue.top().site.theta > circle_event_queue.top()->lowest_theta))
+            else if (site_event_queue.empty() || (!circle_event_queue.empty() && site_event_queue.top().key > circle_event_queue.top()->key))
             {
                 CircleEventSphere * circle = circle_event_queue.top();
-                sweep_line = circle->lowest_theta;
+                if (circle->key > limit_key) {is_complete = false; break;}
+                sweep_line = circle->key;
+                VORONOI_STAT(sweep_stats->circle_events_processed++);
                 handle_circle_event(circle, voronoi_diagram, &cells, &half_edges, &circle_event_queue, beach_head);
                 circle_event_queue.pop();
-                delete circle;
+                release_circle_event(circle);
             }
             else
             {
                 VoronoiCellSphere cell = site_event_queue.top();
-                sweep_line = cell.site.theta;
-                handle_site_event(cell, voronoi_diagram, &cells, &half_edges, &circle_event_queue, beach_head, sweep_line, sin(sweep_line), cos(sweep_line));
+                if (cell.key > limit_key) {is_complete = false; break;}
+                sweep_line = cell.key;
+                VORONOI_STAT(sweep_stats->site_events++);
+                handle_site_event(cell, voronoi_diagram, &cells, &half_edges, &circle_event_queue, beach_head, sweep_line, site_sin_theta(cell.site), cell.site.z);
                 site_event_queue.pop();
             }
         }
         
-        // Clean up
-        while (beach_head->next[0] != beach_head && beach_head->prev[0] != beach_head)
-        {
-            // Deallocate the beachline
-            remove_arc_sphere(beach_head, beach_head);
-        }
-        remove_arc_sphere(beach_head, beach_head);
+        VORONOI_STAT(sweep_stats->sweep_seconds += seconds_since(sweep_start));
+        VORONOI_STAT_CLOCK(finalize_start);
+        VORONOI_TRACE_END_COUNT("sweep", sweep_trace, (long)half_edges.size());
+        VORONOI_TRACE_BEGIN(finalize_trace);
         
-        while (!circle_event_queue.empty())
-        {
-            // Deallocate all the remaining circle events
-            delete circle_event_queue.top();
-            circle_event_queue.pop();
-        }
+        // The arcs and circle events that are left go back to the arenas on the next reset.
+        
+        VORONOI_STAT(sweep_stats->finalize_seconds += seconds_since(finalize_start));
+#ifdef VORONOI_STATS
+        sweep_stats = NULL;
+#endif
+        sweep_workspace = NULL;
+        VORONOI_TRACE_END("finalize", finalize_trace);
+        
+        return is_complete;
     }
 
-    VoronoiDiagramSphere generate_voronoi_one_thread(vector<tuple<Real, Real, Real>> * verts, void (*render)(VoronoiDiagramSphere, ArcSphere *, vector<VoronoiCellSphere> *, Real), bool (*is_sleeping)())
+    void VoronoiSphereGenerator::generate_one_thread(vector<tuple<Real, Real, Real>> * verts, void (*render)(const VoronoiDiagramSphere &, const ArcSphere *, const vector<VoronoiCellSphere> *, Real), bool (*is_sleeping)(), VoronoiStatsSphere * stats)
     {
+#ifdef VORONOI_STATS
+        sweep_stats = stats;
+#endif
+        VORONOI_STAT_CLOCK(input_start);
+        VORONOI_TRACE_BEGIN(input_trace);
+        
         bool should_render = (false) && render != NULL && is_sleeping != NULL;
 
-        VoronoiDiagramSphere voronoi_diagram;
+        VoronoiDiagramSphere & voronoi_diagram = diagrams[0];
+        
+        const Real * no_rotation[1] = {NULL};
+        SweepSitesSphere & sites = workspaces[0].input_sites;
+        sites.resize(verts->size());
+        prepare_sweep_sites(verts, 1, no_rotation, &sites, normalize_sites, 0, verts->size(), workspaces[0].sweep_key, prepass_order);
+        
+        begin_sweep(&workspaces[0], &voronoi_diagram, &sites);
+        
+        SWEEP_KEY sweep_key = workspaces[0].sweep_key;
         
         ArcSphere * beach_head = NULL;
         
         Real sweep_line = 0;
         
-        vector<HalfEdgeSphere> half_edges;
+        vector<HalfEdgeSphere> & half_edges = workspaces[0].half_edges;
         
-        vector<VoronoiCellSphere> cells;
+        vector<VoronoiCellSphere> & cells = workspaces[0].cells;
 
-        priority_queue<VoronoiCellSphere, vector<VoronoiCellSphere>, PriorityQueueCompare> site_event_queue;
+        SweepQueueSphere<VoronoiCellSphere> & site_event_queue = workspaces[0].site_event_queue;
         
-        priority_queue<CircleEventSphere *, vector<CircleEventSphere *>, PriorityQueueCompare> circle_event_queue;
+        SweepQueueSphere<CircleEventSphere *> & circle_event_queue = workspaces[0].circle_event_queue;
         
-        for (auto point : *verts)
+        VORONOI_STAT(sweep_stats->input_seconds += seconds_since(input_start));
+        VORONOI_STAT_CLOCK(sweep_start);
+        VORONOI_TRACE_END("input", input_trace);
+        VORONOI_TRACE_BEGIN(sweep_trace);
+        
+#ifdef VORONOI_RECORD_KERNELS
+        unsigned long num_site_events = 0;
+        if (kernel_recording != NULL)
         {
-            PointCartesian point_cartesian = PointCartesian(get<0>(point), get<1>(point), get<2>(point));
-            
-            VoronoiCellSphere cell = VoronoiCellSphere(point_cartesian, (unsigned int)cells.size());
-            
-            site_event_queue.push(cell);
-            
-            cells.push_back(cell);
-            
-            voronoi_diagram.sites.push_back(point_cartesian);
+            for (auto & cell : cells) {kernel_recording->sites.push_back(cell.site);}
         }
+#endif
         
         while (!site_event_queue.empty() || !circle_event_queue.empty())
         {
@@ -308,43 +1600,65 @@ namespace Voronoi {
             if (!circle_event_queue.empty() && !circle_event_queue.top()->is_valid)
             {
                 // Remove invalid circle events
-                delete circle_event_queue.top();
+#ifdef VORONOI_RECORD_KERNELS
+                if (kernel_recording != NULL) {kernel_recording->circle_queue_ops.push_back(-1);}
+#endif
+                release_circle_event(circle_event_queue.top());
                 circle_event_queue.pop();
             }
-            else if (site_event_queue.empty() || (!circle_event_queue.empty() && circle_event_queue.top()->lowest_theta < site_event_queue.top().site.theta))
+            else if (site_event_queue.empty() || (!circle_event_queue.empty() && circle_event_queue.top()->key < site_event_queue.top().key))
             {
                 CircleEventSphere * circle = circle_event_queue.top();
-                sweep_line = circle->lowest_theta;
+                sweep_line = circle->key;
+                VORONOI_STAT(sweep_stats->circle_events_processed++);
+#ifdef VORONOI_RECORD_KERNELS
+                if (kernel_recording != NULL) {kernel_recording->circle_queue_ops.push_back(-1);}
+#endif
                 handle_circle_event(circle, &voronoi_diagram, &cells, &half_edges, &circle_event_queue, beach_head);
-                delete circle;
                 circle_event_queue.pop();
+                release_circle_event(circle);
+                
+                if (observer != NULL) {observer(voronoi_diagram, beach_head, cells, key_to_theta(sweep_key, sweep_line), observer_data);}
                 
                 while (should_render && is_sleeping())
                 {
-                    render(voronoi_diagram, beach_head, &cells, (Real)sweep_line);
+                    render(voronoi_diagram, beach_head, &cells, key_to_theta(sweep_key, sweep_line));
                 }
             }
             else
             {
                 VoronoiCellSphere cell = site_event_queue.top();
-                sweep_line = cell.site.theta;
-                handle_site_event(cell, &voronoi_diagram, &cells, &half_edges, &circle_event_queue, beach_head, sweep_line, sin(sweep_line), cos(sweep_line));
+                sweep_line = cell.key;
+                VORONOI_STAT(sweep_stats->site_events++);
+                handle_site_event(cell, &voronoi_diagram, &cells, &half_edges, &circle_event_queue, beach_head, sweep_line, site_sin_theta(cell.site), cell.site.z);
                 site_event_queue.pop();
                 
+                if (observer != NULL) {observer(voronoi_diagram, beach_head, cells, key_to_theta(sweep_key, sweep_line), observer_data);}
+                
+#ifdef VORONOI_RECORD_KERNELS
+                if (kernel_recording != NULL && ++num_site_events == cells.size() / 2)
+                {
+                    ArcSphere * cur = beach_head;
+                    do
+                    {
+                        kernel_recording->beachline.push_back(cur->cell_idx);
+                    } while ((cur = cur->next[0]) != beach_head);
+                }
+#endif
+                
                 while (should_render && is_sleeping())
                 {
-                    render(voronoi_diagram, beach_head, &cells, (Real)sweep_line);
+                    render(voronoi_diagram, beach_head, &cells, key_to_theta(sweep_key, sweep_line));
                 }
             }
         }
         
-        // Clean up
-        while (beach_head != NULL && beach_head->next[0] != beach_head && beach_head->prev[0] != beach_head)
-        {
-            // Deallocate the beachline
-            remove_arc_sphere(beach_head, beach_head);
-        }
-        remove_arc_sphere(beach_head, beach_head);
+        VORONOI_STAT(sweep_stats->sweep_seconds += seconds_since(sweep_start));
+        VORONOI_STAT_CLOCK(finalize_start);
+        VORONOI_TRACE_END_COUNT("sweep", sweep_trace, (long)half_edges.size());
+        VORONOI_TRACE_BEGIN(finalize_trace);
+        
+        // The arcs and circle events that are left go back to the arenas on the next reset.
         
         // The final two edges need to be connected.
         for (int i = 0; i < half_edges.size(); i++)
@@ -358,7 +1672,16 @@ namespace Voronoi {
                         finish_half_edge_sphere(&voronoi_diagram, &half_edges, i, voronoi_diagram.voronoi_vertices[half_edges[k].start_idx]);
                         finish_half_edge_sphere(&voronoi_diagram, &half_edges, k, voronoi_diagram.voronoi_vertices[half_edges[i].start_idx]);
                         
-                        return voronoi_diagram;
+                        if (observer != NULL) {observer(voronoi_diagram, NULL, cells, key_to_theta(sweep_key, sweep_line), observer_data);}
+                        
+                        VORONOI_STAT(sweep_stats->finalize_seconds += seconds_since(finalize_start));
+#ifdef VORONOI_STATS
+                        sweep_stats = NULL;
+#endif
+                        sweep_workspace = NULL;
+                        VORONOI_TRACE_END("finalize", finalize_trace);
+                        
+                        return;
                     }
                 }
             }
@@ -366,7 +1689,8 @@ namespace Voronoi {
         
         //This should never happen
         assert(0);
-        return VoronoiDiagramSphere();
+        voronoi_diagram.clear();
+        sweep_workspace = NULL;
     }
 
     void handle_site_event(VoronoiCellSphere cell, VoronoiDiagramSphere * voronoi_diagram, vector<VoronoiCellSphere> * cells, vector<HalfEdgeSphere> * half_edges, priority_queue<CircleEventSphere *, vector<CircleEventSphere *>, PriorityQueueCompare> * circle_event_queue_ptr, ArcSphere * & beach_head, Real sweep_line, Real sin_sweep_line, Real cos_sweep_line)
@@ -441,7 +1765,7 @@ namespace Voronoi {
                 
                 if (arc->event != NULL)
                 {
-                    arc->event->is_valid = false;
+                    invalidate_circle_event(arc->event);
                 }
                 
                 //duplicate arc
@@ -464,6 +1788,8 @@ namespace Voronoi {
                 return;
             }
             
+            VORONOI_STAT(sweep_stats->linear_walk_steps++);
+            
             if (move_right)
             {
                 arc = right;
@@ -507,13 +1833,16 @@ namespace Voronoi {
         //invalidate old circle events
         if (left->event != NULL)
         {
-            left->event->is_valid = false;
+            invalidate_circle_event(left->event);
         }
         if (right->event != NULL)
         {
-            right->event->is_valid = false;
+            invalidate_circle_event(right->event);
         }
         
+        // This event is being handled so it should not count as invalidated.
+        event->arc->event = NULL;
+        
         remove_arc_sphere(event->arc, beach_head);
         
         //check for new circle events
@@ -530,24 +1859,39 @@ namespace Voronoi {
         }
         
         PointSphere circumcenter;
-        Real lowest_theta;
+        Real key;
         
         PointSphere cur_site = (*cells)[arc->cell_idx].site;
         PointSphere prev_site = (*cells)[arc->prev[0]->cell_idx].site;
         PointSphere next_site = (*cells)[arc->next[0]->cell_idx].site;
         
-        make_circle(prev_site, cur_site, next_site, circumcenter, lowest_theta);
+        if (sweep_workspace->sweep_key == DEPTH_KEY)
+        {
+            make_circle_depth(prev_site, cur_site, next_site, circumcenter, key);
+        }
+        else
+        {
+            make_circle(prev_site, cur_site, next_site, circumcenter, key);
+        }
         
         //This if statement breaks my code for some reason...
-        //if (lowest_theta > sweep_line)
+        //if (key > sweep_line)
         {
-            arc->event = new CircleEventSphere(arc, circumcenter, lowest_theta);
+            arc->event = allocate_circle_event(arc, circumcenter, key);
             circle_event_queue_ptr->push(arc->event);
+            VORONOI_STAT(sweep_stats->circle_events_created++; sweep_stats->peak_event_queue_size = max(sweep_stats->peak_event_queue_size, (unsigned long)circle_event_queue_ptr->size()));
+#ifdef VORONOI_RECORD_KERNELS
+            if (kernel_recording != NULL) {kernel_recording->circle_queue_ops.push_back(key);}
+#endif
         }
     }
 
     void make_circle(PointSphere a, PointSphere b, PointSphere c, PointSphere & circumcenter, Real & lowest_theta)
-    {    
+    {
+#ifdef VORONOI_RECORD_KERNELS
+        if (kernel_recording != NULL) {kernel_recording->circles.push_back({a, b, c});}
+#endif
+        
         PointCartesian i = a.get_cartesian();
         PointCartesian j = b.get_cartesian();
         PointCartesian k = c.get_cartesian();
@@ -561,10 +1905,38 @@ namespace Voronoi {
         
         lowest_theta = circumcenter.theta + radius;
     }
+    
+    void make_circle_depth(PointSphere a, PointSphere b, PointSphere c, PointSphere & circumcenter, Real & lowest_depth)
+    {
+        PointCartesian i = a.get_cartesian();
+        PointCartesian j = b.get_cartesian();
+        PointCartesian k = c.get_cartesian();
+        
+        PointCartesian center = PointCartesian::cross_product(i - j, k - j);
+        center.normalize();
+        
+        circumcenter = PointSphere(NAN, NAN, center.x, center.y, center.z);
+        
+        // The radius from a as the angle between center and a.
+        PointCartesian normal = PointCartesian::cross_product(center, i);
+        Real sin_radius = sqrt(normal.x * normal.x + normal.y * normal.y + normal.z * normal.z);
+        Real cos_radius = center.x * i.x + center.y * i.y + center.z * i.z;
+        
+        Real sin_theta = sqrt(center.x * center.x + center.y * center.y);
+        Real cos_theta = center.z;
+        
+        // The lowest point is at theta + radius.
+        lowest_depth = depth(sin_theta * cos_radius + cos_theta * sin_radius, cos_theta * cos_radius - sin_theta * sin_radius);
+    }
 
     bool parabolic_intersection(PointSphere left, PointSphere right, Real & phi_intersection, ArcSphere * & beach_head, Real sweep_line, Real sin_sweep_line, Real cos_sweep_line)
     {
-        if (left.theta == sweep_line && right.theta == sweep_line)
+#ifdef VORONOI_RECORD_KERNELS
+        if (kernel_recording != NULL) {kernel_recording->intersections.push_back({left, right, sweep_line, sin_sweep_line, cos_sweep_line});}
+#endif
+        
+        // Site events pass the z of their site as cos_sweep_line, so a site on the sweep line has exactly that z.
+        if (left.z == cos_sweep_line && right.z == cos_sweep_line)
         {
             /*
              *  Both sites are on the sweep line so our intersection is at the north pole.
@@ -573,7 +1945,7 @@ namespace Voronoi {
             cout << "Intersection is at north pole.\n";
             return false;
         }
-        else if (left.theta == sweep_line)
+        else if (left.z == cos_sweep_line)
         {
             /*
              *  The left site is on our sweep line so it contains our intersection phi.
@@ -582,7 +1954,7 @@ namespace Voronoi {
             //cout << "Left site is on sweep line.\n";
             return true;
         }
-        else if (right.theta == sweep_line)
+        else if (right.z == cos_sweep_line)
         {
             /*
              *  The right site is on our sweep line so it contains our intersection phi.
@@ -602,8 +1974,8 @@ namespace Voronoi {
             return true;
         }
         
-        Real cos_left_theta = cos(left.theta);
-        Real cos_right_theta = cos(right.theta);
+        Real cos_left_theta = left.z;
+        Real cos_right_theta = right.z;
         
         Real cos_minus_cos_right = cos_sweep_line - cos_right_theta;
         Real cos_minus_cos_left = cos_sweep_line - cos_left_theta;
@@ -628,7 +2000,7 @@ namespace Voronoi {
              *  to cause problems. So one of the parabolas is actually a line.
              *  The lower site contains the phi of our intersection.
              */
-            phi_intersection = (left.theta > right.theta) ? left.phi : right.phi;
+            phi_intersection = (left.z < right.z) ? left.phi : right.phi;
             /*cout << "cos(left.theta) = " << cos_left_theta << endl;
             cout << "a = " << a << "\nb = " << b << endl;
             cout << "Arc is close to sweep line.\n" << abs(e) << " > " << sqrt_a_b << endl << left << right << sweep_line << endl << endl;*/
@@ -638,9 +2010,9 @@ namespace Voronoi {
         
         Real sin_phi_int_plus_gamma = e / sqrt_a_b;
         
-        Real gamma = atan2(a, b);
+        Real gamma = fast_atan2(a, b);
         
-        phi_intersection = asin(sin_phi_int_plus_gamma) - gamma;
+        phi_intersection = fast_asin(sin_phi_int_plus_gamma) - gamma;
         
         if (phi_intersection > M_PI)
         {
@@ -655,19 +2027,26 @@ namespace Voronoi {
 
     PointSphere phi_to_point(PointSphere arc, Real phi, Real sweep_line, Real sin_sweep_line, Real cos_sweep_line)
     {
-        Real a = cos(arc.theta) - cos_sweep_line;
-        Real b = sin_sweep_line - sin(arc.theta) * cos(phi - arc.phi);
-        return PointSphere(atan2(a, b), phi);
+#ifdef VORONOI_RECORD_KERNELS
+        if (kernel_recording != NULL) {kernel_recording->phi_to_points.push_back({arc, phi, sweep_line, sin_sweep_line, cos_sweep_line});}
+#endif
+        
+        Real sin_theta = site_sin_theta(arc);
+        Real cos_theta = arc.z;
+        Real a = cos_theta - cos_sweep_line;
+        Real b = sin_sweep_line - sin_theta * fast_cos(phi - arc.phi);
+        return PointSphere(fast_atan2(a, b), phi);
     }
 
     void add_initial_arc_sphere(int cell_id, ArcSphere * & beach_head)
     {    
         int height = random_height();
         
-        beach_head = new ArcSphere(cell_id, height);
+        beach_head = allocate_arc_sphere(cell_id, height);
+        
+        VORONOI_STAT(sweep_stats->beachline_length = 1; sweep_stats->peak_beachline_length = max(sweep_stats->peak_beachline_length, 1UL));
         
-        beach_head->prev = new ArcSphere*[height];
-        beach_head->next = new ArcSphere*[height];
+        if (sweep_workspace->cells[cell_id].key < sweep_workspace->bound_key) {sweep_workspace->num_bound_arcs = 1;}
         
         for (int i = 0; i < height; i++)
         {
@@ -679,10 +2058,11 @@ namespace Voronoi {
     {
         int height = random_height();
         
-        ArcSphere * arc = new ArcSphere(cell_id, height);
-
-        arc->prev = new ArcSphere*[height];
-        arc->next = new ArcSphere*[height];
+        ArcSphere * arc = allocate_arc_sphere(cell_id, height);
+        
+        VORONOI_STAT(sweep_stats->peak_beachline_length = max(sweep_stats->peak_beachline_length, ++sweep_stats->beachline_length));
+        
+        if (sweep_workspace->cells[cell_id].key < sweep_workspace->bound_key) {sweep_workspace->num_bound_arcs++;}
         
         for (int i = 0; i < height; i++)
         {
@@ -714,9 +2094,13 @@ namespace Voronoi {
         
         if (arc->event != NULL)
         {
-            arc->event->is_valid = false;
+            invalidate_circle_event(arc->event);
         }
         
+        VORONOI_STAT(sweep_stats->beachline_length--);
+        
+        if (sweep_workspace->cells[arc->cell_idx].key < sweep_workspace->bound_key) {sweep_workspace->num_bound_arcs--;}
+        
         for (int i = 0; i < arc->height; i++)
         {
             ArcSphere * left = arc->prev[i];
@@ -724,10 +2108,7 @@ namespace Voronoi {
             arc->next[i]->prev[i] = left;
         }
         
-        delete [] arc->prev;
-        delete [] arc->next;
-        
-        delete arc;
+        sweep_workspace->free_arcs.push_back(arc);
     }
 
     void add_half_edge_sphere(VoronoiDiagramSphere * voronoi_diagram, vector<VoronoiCellSphere> * cells, vector<HalfEdgeSphere> * half_edges, PointCartesian start, ArcSphere * left, ArcSphere *right)
@@ -742,9 +2123,6 @@ namespace Voronoi {
         HalfEdgeSphere half_edge(voronoi_vertex_id);
         half_edges->push_back(half_edge);
         
-        (*cells)[left->cell_idx].edge_ids.push_back(edge_id);
-        (*cells)[right->cell_idx].edge_ids.push_back(edge_id);
-        
         left->right_edge_idx = right->left_edge_idx = edge_id;
     }
 
@@ -758,6 +2136,9 @@ namespace Voronoi {
             voronoi_diagram->voronoi_vertices.push_back(end);
             
             voronoi_diagram->voronoi_edges.push_back(Edge((*half_edges)[edge_idx].start_idx, (*half_edges)[edge_idx].end_idx));
+            
+            // Half edges and delaunay edges are made together so they share an index.
+            voronoi_diagram->voronoi_edge_sites.push_back(voronoi_diagram->delaunay_edges[edge_idx]);
         }
     }
 
@@ -770,6 +2151,10 @@ namespace Voronoi {
          *  But it will most likely move closer to the destination.
          */
         
+#ifdef VORONOI_RECORD_KERNELS
+        if (kernel_recording != NULL && !kernel_recording->beachline.empty()) {kernel_recording->traverse_phis.push_back(phi);}
+#endif
+        
         int level = arc->height - 1;
         
         while (level >= 0)
@@ -787,6 +2172,8 @@ namespace Voronoi {
             Real prev_delta = abs(phi - (*cells)[prev_index].site.phi);
             if (prev_delta > M_PI) {prev_delta = 2.f * M_PI - prev_delta;}
             
+            VORONOI_STAT(sweep_stats->skiplist_steps++);
+            
             if (next_delta < delta && next_delta < prev_delta) // if next_delta is the min
             {
                 arc = arc->next[level];
@@ -821,6 +2208,25 @@ namespace Voronoi {
         return make_tuple(cos_theta * x + sin_theta * y, cos_theta * y - sin_theta * x, z);
     }
     
+    tuple<Real, Real, Real> rotate(tuple<Real, Real, Real> point, const Real rotation[9])
+    {
+        Real x = get<0>(point);
+        Real y = get<1>(point);
+        Real z = get<2>(point);
+        
+        return make_tuple(rotation[0] * x + rotation[1] * y + rotation[2] * z, rotation[3] * x + rotation[4] * y + rotation[5] * z, rotation[6] * x + rotation[7] * y + rotation[8] * z);
+    }
+    
+    tuple<Real, Real, Real> rotate_inverse(tuple<Real, Real, Real> point, const Real rotation[9])
+    {
+        Real x = get<0>(point);
+        Real y = get<1>(point);
+        Real z = get<2>(point);
+        
+        // The inverse of a rotation is its transpose
+        return make_tuple(rotation[0] * x + rotation[3] * y + rotation[6] * z, rotation[1] * x + rotation[4] * y + rotation[7] * z, rotation[2] * x + rotation[5] * y + rotation[8] * z);
+    }
+    
     int random_height()
     {
         int height = MAX_SKIPLIST_HEIGHT;
@@ -13,13 +13,21 @@
 #include <vector>
 #include <queue>
 #include <cmath>
+#include <algorithm>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <tuple>
 #include <assert.h>
 
 //#include <boost/multiprecision/float128.hpp>
 
 #include <iomanip>
 
+#include "voronoi_math.h"
+
 #define MAX_SKIPLIST_HEIGHT 15
 
 #define TWO_PI_3 2.0943951023931954923084289221863353 // 2 * PI / 3
@@ -49,6 +57,7 @@ namespace Voronoi
     
     struct Edge;
     struct VoronoiDiagramSphere;
+    struct VoronoiStatsSphere;
     struct PointCartesian;
     struct CircleEventSphere;
     struct ArcSphere;
@@ -57,6 +66,12 @@ namespace Voronoi
     struct HalfEdgeSphere;
     struct CompareTopDown;
     struct CompareBottomUp;
+    struct SweepWorkspaceSphere;
+    struct SweepSitesSphere;
+    struct SnapshotFrameSphere;
+    struct HullWorkspaceSphere;
+    class VoronoiSnapshotSphere;
+    class VoronoiSphereGenerator;
     
     enum THREAD_NUMBER
     {
@@ -65,7 +80,69 @@ namespace Voronoi
         FOUR_THREADS = 4
     };
     
-    VoronoiDiagramSphere generate_voronoi(std::vector<std::tuple<Real, Real, Real>> * verts, THREAD_NUMBER num_threads = ONE_THREAD, void (*render)(VoronoiDiagramSphere, ArcSphere *, std::vector<VoronoiCellSphere> *, Real) = NULL, bool (*is_sleeping)() = NULL);
+    /*
+     *  How the sphere is split between the threads.
+     *  FIXED_PARTITION splits at the equator (two threads) or along a fixed tetrahedron (four threads).
+     *  BALANCED_PARTITION samples the sites and rotates the sphere (and for two threads
+     *  moves the seam off the equator) to take sites off the busiest thread. That only
+     *  pays for uneven sites: for even ones it keeps the fixed split and just adds the
+     *  sampling, and a cluster smaller than a cap still ends up on one thread.
+     */
+    enum PARTITION_MODE
+    {
+        FIXED_PARTITION,
+        BALANCED_PARTITION
+    };
+    
+    /*
+     *  What the sweep orders its events on.
+     *  THETA_KEY orders on theta, which takes an acos for every site and circle event.
+     *  DEPTH_KEY orders on the depth 1 - cos(theta) below the north pole, which grows with
+     *  theta and is worked out from the Cartesian coordinates alone, so the sites and circle
+     *  events need no inverse trig. A circle that reaches past the south pole ends at a depth
+     *  of 3 + cos(theta) for its lowest theta, between 2 and 4.
+     *  Either key orders the beachline on phi, so every breakpoint parabolic_intersection
+     *  works out still takes an atan2 and an asin, and every voronoi vertex phi_to_point
+     *  places at a site event takes an atan2.
+     */
+    enum SWEEP_KEY
+    {
+        THETA_KEY,
+        DEPTH_KEY
+    };
+    
+    /*
+     *  What builds the diagram.
+     *  SWEEP_ENGINE runs Fortune's sweep on num_threads threads.
+     *  HULL_ENGINE builds the convex hull of the sites in patches on num_threads threads (see
+     *  voronoi_hull.h). It has no sweep line, so it ignores render, is_sleeping, stats and partition.
+     *  INCREMENTAL_ENGINE builds the same hull one site at a time on one thread, and ignores the
+     *  same arguments and num_threads.
+     */
+    enum ENGINE_MODE
+    {
+        SWEEP_ENGINE,
+        HULL_ENGINE,
+        INCREMENTAL_ENGINE
+    };
+    
+    /*
+     *  The order a generator keeps the sites of a sweep in. The sweep looks cells up by
+     *  site, so sites close on the sphere that sit close in memory make those lookups hit
+     *  the cache.
+     *  INPUT_ORDER keeps the caller's order.
+     *  CURVE_ORDER sorts the sites along a Hilbert curve over the sphere (see sphere_curve_key).
+     *  SWEEP_ORDER sorts them from the north pole down, the order the one thread sweep meets them.
+     *  The diagram is always given back with the caller's site indices.
+     */
+    enum SITE_ORDER
+    {
+        INPUT_ORDER,
+        CURVE_ORDER,
+        SWEEP_ORDER
+    };
+    
+    VoronoiDiagramSphere generate_voronoi(std::vector<std::tuple<Real, Real, Real>> * verts, THREAD_NUMBER num_threads = ONE_THREAD, void (*render)(const VoronoiDiagramSphere &, const ArcSphere *, const std::vector<VoronoiCellSphere> *, Real) = NULL, bool (*is_sleeping)() = NULL, VoronoiStatsSphere * stats = NULL, PARTITION_MODE partition = FIXED_PARTITION, ENGINE_MODE engine = SWEEP_ENGINE);
     
     struct Edge
     {
@@ -82,6 +159,67 @@ namespace Voronoi
         std::vector<PointCartesian> sites, voronoi_vertices;
         
         std::vector<Edge> voronoi_edges, delaunay_edges;
+        
+        // The two sites that voronoi_edges[i] lies between.
+        std::vector<Edge> voronoi_edge_sites;
+        
+        // Empties the diagram but keeps the capacity of every vector.
+        void clear()
+        {
+            sites.clear();
+            voronoi_vertices.clear();
+            voronoi_edges.clear();
+            delaunay_edges.clear();
+            voronoi_edge_sites.clear();
+        }
+    };
+    
+    /*
+     *  Statistics of a sweep. They are only gathered when VORONOI_STATS is defined.
+     *  Otherwise every counter and timer in the sweep compiles away and the struct
+     *  is left as it was passed in.
+     *  For the two and four thread modes the counters are summed over the sub-sweeps
+     *  and the phase times are those of the slowest sub-sweep.
+     */
+    struct VoronoiStatsSphere
+    {
+        VoronoiStatsSphere() : site_events(0), circle_events_created(0), circle_events_invalidated(0), circle_events_processed(0), beachline_length(0), peak_beachline_length(0), peak_event_queue_size(0), skiplist_steps(0), linear_walk_steps(0), input_seconds(0), sweep_seconds(0), finalize_seconds(0), merge_seconds(0) {}
+        
+        void add_sub_sweep(const VoronoiStatsSphere & sub_sweep)
+        {
+            site_events += sub_sweep.site_events;
+            circle_events_created += sub_sweep.circle_events_created;
+            circle_events_invalidated += sub_sweep.circle_events_invalidated;
+            circle_events_processed += sub_sweep.circle_events_processed;
+            peak_beachline_length = std::max(peak_beachline_length, sub_sweep.peak_beachline_length);
+            peak_event_queue_size = std::max(peak_event_queue_size, sub_sweep.peak_event_queue_size);
+            skiplist_steps += sub_sweep.skiplist_steps;
+            linear_walk_steps += sub_sweep.linear_walk_steps;
+            input_seconds = std::max(input_seconds, sub_sweep.input_seconds);
+            sweep_seconds = std::max(sweep_seconds, sub_sweep.sweep_seconds);
+            finalize_seconds = std::max(finalize_seconds, sub_sweep.finalize_seconds);
+        }
+        
+        friend std::ostream & operator<<(std::ostream & out, const VoronoiStatsSphere & s)
+        {
+            out << "Site events: " << s.site_events << "\n";
+            out << "Circle events created/invalidated/processed: " << s.circle_events_created << "/" << s.circle_events_invalidated << "/" << s.circle_events_processed << "\n";
+            out << "Peak beachline length: " << s.peak_beachline_length << "\n";
+            out << "Peak circle event queue size: " << s.peak_event_queue_size << "\n";
+            out << "Skiplist steps: " << s.skiplist_steps << "\n";
+            out << "Linear walk steps: " << s.linear_walk_steps << "\n";
+            return out << "Input/sweep/finalize/merge: " << s.input_seconds << "/" << s.sweep_seconds << "/" << s.finalize_seconds << "/" << s.merge_seconds << " seconds\n";
+        }
+        
+        unsigned long site_events, circle_events_created, circle_events_invalidated, circle_events_processed;
+        
+        // beachline_length is the current length while sweeping.
+        unsigned long beachline_length, peak_beachline_length, peak_event_queue_size;
+        
+        // Steps taken through the skiplist and along the beachline in handle_site_event.
+        unsigned long skiplist_steps, linear_walk_steps;
+        
+        double input_seconds, sweep_seconds, finalize_seconds, merge_seconds;
     };
     
     struct PointCartesian
@@ -132,10 +270,12 @@ namespace Voronoi
         
         PointSphere(Real t = 0, Real p = 0) : theta(t), phi(p), x(0), y(0), z(0), has_cartesian(false) {}
         
-        PointSphere(Real _x, Real _y, Real _z) : theta(acos(_z)), phi(atan2(_y, _x)), x(_x), y(_y), z(_z), has_cartesian(true) {}
+        PointSphere(Real _x, Real _y, Real _z) : theta(fast_acos(_z)), phi(fast_atan2(_y, _x)), x(_x), y(_y), z(_z), has_cartesian(true) {}
         
         PointSphere(PointCartesian point) : PointSphere(point.x, point.y, point.z) {}
         
+        PointSphere(Real t, Real p, Real _x, Real _y, Real _z) : theta(t), phi(p), x(_x), y(_y), z(_z), has_cartesian(true) {}
+        
         inline friend bool operator<(const PointSphere & left, const PointSphere & right) {return left.theta == right.theta ? left.phi < right.phi : left.theta < right.theta;}
         inline friend bool operator>(const PointSphere & left, const PointSphere & right) {return left.theta == right.theta ? left.phi > right.phi : left.theta > right.theta;}
         
@@ -151,7 +291,7 @@ namespace Voronoi
         {
             a.set_cartesian();
             b.set_cartesian();
-            return acos(a.x * b.x + a.y * b.y + a.z * b.z);
+            return fast_acos(a.x * b.x + a.y * b.y + a.z * b.z);
         }
         
     private:
@@ -160,10 +300,12 @@ namespace Voronoi
         {
             if (!has_cartesian)
             {
-                Real sin_theta = sin(theta);
-                x = sin_theta * cos(phi);
-                y = sin_theta * sin(phi);
-                z = cos(theta);
+                Real sin_theta, cos_theta, sin_phi, cos_phi;
+                fast_sincos(theta, sin_theta, cos_theta);
+                fast_sincos(phi, sin_phi, cos_phi);
+                x = sin_theta * cos_phi;
+                y = sin_theta * sin_phi;
+                z = cos_theta;
                 //has_cartesian = true;
             }
         }
@@ -173,7 +315,7 @@ namespace Voronoi
     
     struct ArcSphere
     {
-        ArcSphere(int _cell_idx, int _height) : cell_idx(_cell_idx), height(_height), event(NULL), left_edge_idx(-1), right_edge_idx(-1) {}
+        ArcSphere(int _cell_idx = 0, int _height = 0) : cell_idx(_cell_idx), height(_height), prev(NULL), next(NULL), event(NULL), left_edge_idx(-1), right_edge_idx(-1) {}
         
         unsigned int cell_idx;
         
@@ -188,7 +330,7 @@ namespace Voronoi
     
     struct CircleEventSphere
     {
-        CircleEventSphere(ArcSphere * a, PointSphere c, Real l) : arc(a), circumcenter(c), lowest_theta(l), is_valid(true) {}
+        CircleEventSphere(ArcSphere * a = NULL, PointSphere c = PointSphere(), Real k = 0) : circumcenter(c), is_valid(true), arc(a), key(k) {}
         
         PointSphere circumcenter;
         
@@ -196,20 +338,24 @@ namespace Voronoi
         
         ArcSphere * arc;
         
-        Real lowest_theta;
+        // Where the sweep line is when the circle is done, the theta or depth of its lowest point.
+        Real key;
     };
 
     struct VoronoiCellSphere
     {
-        VoronoiCellSphere(PointSphere point, int _idx) : site(point), cell_idx(_idx) {}
+        VoronoiCellSphere(PointSphere point, int _idx) : site(point), cell_idx(_idx), key(site.theta) {}
         
-        VoronoiCellSphere(PointCartesian point, int _idx) : site(point), cell_idx(_idx) {}
+        VoronoiCellSphere(PointCartesian point, int _idx) : site(point), cell_idx(_idx), key(site.theta) {}
+        
+        VoronoiCellSphere(PointSphere point, int _idx, Real k) : site(point), cell_idx(_idx), key(k) {}
         
         PointSphere site;
         
         unsigned int cell_idx;
         
-        std::vector<int> edge_ids;
+        // The theta or depth of the site, as the sweep orders it.
+        Real key;
     };
     
     struct HalfEdgeSphere
@@ -222,21 +368,442 @@ namespace Voronoi
     };
     
     /*
-     *  Sort by theta. Smallest theta should be first.
+     *  Sort by key. Smallest key should be first. Sites with the same key go by phi.
      */
     struct PriorityQueueCompare
     {
-        bool operator()(VoronoiCellSphere & left, VoronoiCellSphere & right) {return left.site > right.site;}
-        bool operator()(CircleEventSphere * left, CircleEventSphere * right) {return left->lowest_theta > right->lowest_theta;}
+        bool operator()(VoronoiCellSphere & left, VoronoiCellSphere & right) {return left.key == right.key ? left.site.phi > right.site.phi : left.key > right.key;}
+        bool operator()(CircleEventSphere * left, CircleEventSphere * right) {return left->key > right->key;}
     };
     
-    VoronoiDiagramSphere generate_voronoi_one_thread(std::vector<std::tuple<Real, Real, Real>> * verts, void (*render)(VoronoiDiagramSphere, ArcSphere *, std::vector<VoronoiCellSphere> *, Real) = NULL, bool (*is_sleeping)() = NULL);
+    /*
+     *  A priority queue that keeps its storage when it is cleared.
+     */
+    template <typename T>
+    struct SweepQueueSphere : std::priority_queue<T, std::vector<T>, PriorityQueueCompare>
+    {
+        void clear() {this->c.clear();}
+    };
     
-    VoronoiDiagramSphere generate_voronoi_two_threads(std::vector<std::tuple<Real, Real, Real>> * verts);
+    /*
+     *  Hands out objects from blocks that are kept between sweeps.
+     *  reset makes every block available again without freeing it.
+     */
+    template <typename T, int BLOCK_SIZE>
+    class ArenaSphere
+    {
+    public:
     
-    VoronoiDiagramSphere generate_voronoi_four_threads(std::vector<std::tuple<Real, Real, Real>> * verts);
+        ArenaSphere() : block(0), used(0) {}
         
-    void compute_priority_queues(VoronoiDiagramSphere * voronoi_diagram, std::vector<std::tuple<Real, Real, Real>> * verts, Real bound_theta);
+        // count must not be more than BLOCK_SIZE.
+        T * allocate(int count = 1)
+        {
+            if (block < blocks.size() && used + count > BLOCK_SIZE)
+            {
+                block++;
+                used = 0;
+            }
+            if (block == blocks.size())
+            {
+                blocks.push_back(std::unique_ptr<T[]>(new T[BLOCK_SIZE]));
+            }
+            T * ret = &blocks[block][used];
+            used += count;
+            return ret;
+        }
+        
+        void reset()
+        {
+            block = 0;
+            used = 0;
+        }
+    
+    private:
+    
+        std::vector<std::unique_ptr<T[]>> blocks;
+        
+        size_t block;
+        
+        int used;
+    };
+    
+    /*
+     *  The sites of one sweep, already in the sweep's frame, as one array per coordinate,
+     *  with the angles of every site from the pre-pass. theta is left as it is for a
+     *  DEPTH_KEY sweep, which never reads it.
+     */
+    struct SweepSitesSphere
+    {
+        void resize(size_t n)
+        {
+            x.resize(n);
+            y.resize(n);
+            z.resize(n);
+            theta.resize(n);
+            phi.resize(n);
+        }
+        
+        size_t size() const {return x.size();}
+        
+        std::vector<Real> x, y, z, theta, phi;
+    };
+    
+    /*
+     *  The scratch memory of one sweep. Arcs and circle events come from the arenas and
+     *  go on the free lists when they leave the beachline or the queue, so a sweep only
+     *  needs as many of them as are alive at once. Every arc gets MAX_SKIPLIST_HEIGHT
+     *  links so that it can be handed out again at any height.
+     */
+    struct SweepWorkspaceSphere
+    {
+        void reset()
+        {
+            cells.clear();
+            arcs.reset();
+            links.reset();
+            circle_events.reset();
+            free_arcs.clear();
+            free_circle_events.clear();
+            half_edges.clear();
+            site_event_queue.clear();
+            circle_event_queue.clear();
+            deferred_sites.clear();
+            bound_key = INFINITY;
+            num_bound_arcs = 0;
+        }
+        
+        std::vector<VoronoiCellSphere> cells;
+        
+        std::vector<HalfEdgeSphere> half_edges;
+        
+        SweepQueueSphere<VoronoiCellSphere> site_event_queue;
+        
+        SweepQueueSphere<CircleEventSphere *> circle_event_queue;
+        
+        ArenaSphere<ArcSphere, 256> arcs;
+        
+        ArenaSphere<ArcSphere *, 2 * MAX_SKIPLIST_HEIGHT * 256> links;
+        
+        ArenaSphere<CircleEventSphere, 1024> circle_events;
+        
+        std::vector<ArcSphere *> free_arcs;
+        
+        std::vector<CircleEventSphere *> free_circle_events;
+        
+        // The sites too far past bound_theta to be queued yet. Their cells are placeholders until then.
+        std::vector<unsigned int> deferred_sites;
+        
+        // The key of bound_theta.
+        Real bound_key;
+        
+        // The number of arcs on the beachline whose site has theta < bound_theta.
+        int num_bound_arcs;
+        
+        // The sites of a sweep that was given tuples. reset leaves them alone.
+        SweepSitesSphere input_sites;
+        
+        // What the sweeps in this workspace order their events on. reset leaves it alone.
+        SWEEP_KEY sweep_key = THETA_KEY;
+    };
+    
+    /*
+     *  Watches a one thread sweep. An observer is called after every event with const
+     *  views of the diagram so far, the beachline and the cells, and once more with a
+     *  NULL beach_head when the diagram is finished. The views are only valid during
+     *  the call and must be used from the sweep thread.
+     */
+    typedef void (*ObserverSphere)(const VoronoiDiagramSphere & voronoi_diagram, const ArcSphere * beach_head, const std::vector<VoronoiCellSphere> & cells, Real sweep_line, void * data);
+    
+    /*
+     *  One published state of a sweep. beachline holds the cell indices of the arcs
+     *  in order, starting after beach_head.
+     */
+    struct SnapshotFrameSphere
+    {
+        SnapshotFrameSphere() : sweep_line(0), num_events(0) {}
+        
+        VoronoiDiagramSphere voronoi_diagram;
+        
+        std::vector<unsigned int> beachline;
+        
+        Real sweep_line;
+        
+        unsigned long num_events;
+    };
+    
+    /*
+     *  Lets a viewer thread look at a sweep while it runs on another thread, without
+     *  either of them waiting on the other. Pass VoronoiSnapshotSphere::observe with the
+     *  snapshot as data to set_observer. The sweep fills the frame the viewer is not
+     *  holding and then makes it the newest one. The diagram only grows during a sweep,
+     *  so a frame only copies what was added since it was last filled. If the viewer
+     *  still holds the other frame the sweep skips that publish and tries again later.
+     */
+    class VoronoiSnapshotSphere
+    {
+    public:
+        
+        /*
+         *  observe publishes after every events_per_publish events. The finished diagram
+         *  is always published, waiting for the viewer to let go of a frame if it has to.
+         */
+        VoronoiSnapshotSphere(unsigned long events_per_publish = 1);
+        
+        static void observe(const VoronoiDiagramSphere & voronoi_diagram, const ArcSphere * beach_head, const std::vector<VoronoiCellSphere> & cells, Real sweep_line, void * data);
+        
+        // Returns false if the viewer still holds the frame that would be filled.
+        bool publish(const VoronoiDiagramSphere & voronoi_diagram, const ArcSphere * beach_head, Real sweep_line);
+        
+        /*
+         *  Viewer side. acquire returns the newest frame, or NULL if nothing was published
+         *  yet. The frame does not change until it is given back with release.
+         */
+        const SnapshotFrameSphere * acquire();
+        
+        void release(const SnapshotFrameSphere * frame);
+        
+    private:
+        
+        SnapshotFrameSphere frames[2];
+        
+        // The newest frame, -1 before the first publish.
+        std::atomic<int> newest;
+        
+        std::atomic<int> num_readers[2];
+        
+        unsigned long events_per_publish, num_events;
+    };
+    
+    /*
+     *  Generates diagrams over and over without starting from nothing every time.
+     *  The sweep workspaces, the output diagram, the rotated copies of the sites and the
+     *  worker threads of the two and four thread modes are all kept between calls. Once
+     *  a generator has swept some number of sites it does not allocate again for the same
+     *  or fewer sites, unless a sweep needs more circle events or output than any before it.
+     */
+    class VoronoiSphereGenerator
+    {
+    public:
+    
+        VoronoiSphereGenerator();
+        
+        ~VoronoiSphereGenerator();
+        
+        VoronoiSphereGenerator(const VoronoiSphereGenerator &) = delete;
+        
+        VoronoiSphereGenerator & operator=(const VoronoiSphereGenerator &) = delete;
+        
+        // The diagram stays valid until the next call.
+        const VoronoiDiagramSphere & generate_voronoi(std::vector<std::tuple<Real, Real, Real>> * verts, THREAD_NUMBER num_threads = ONE_THREAD, void (*render)(const VoronoiDiagramSphere &, const ArcSphere *, const std::vector<VoronoiCellSphere> *, Real) = NULL, bool (*is_sleeping)() = NULL, VoronoiStatsSphere * stats = NULL, PARTITION_MODE partition = FIXED_PARTITION, ENGINE_MODE engine = SWEEP_ENGINE);
+        
+        /*
+         *  Generates only the cells of the sites within cap_radius radians of the unit vector
+         *  center. The sphere is rotated so center is the north pole, the sites further than
+         *  a margin past the cap are skipped, and the sweep stops as soon as every cell in the
+         *  cap is done. If the margin turns out too small the sweep is run again with a wider one.
+         *  The diagram holds the edges of the cells in the cap (and the delaunay edges of their
+         *  sites), and its sites are the swept ones. site_ids, if not NULL, is set to the index
+         *  in verts of every site of the diagram.
+         */
+        const VoronoiDiagramSphere & generate_voronoi_cap(std::vector<std::tuple<Real, Real, Real>> * verts, PointCartesian center, Real cap_radius, std::vector<unsigned int> * site_ids = NULL, VoronoiStatsSphere * stats = NULL);
+        
+        const VoronoiDiagramSphere & get_voronoi_diagram() const {return diagrams[0];}
+        
+        // Moves the last diagram out. The next call has to allocate its output again.
+        VoronoiDiagramSphere take_voronoi_diagram() {return std::move(diagrams[0]);}
+        
+        // Rescales every site to unit length before it is swept. Off by default.
+        void set_normalize_sites(bool normalize) {normalize_sites = normalize;}
+        
+        // What every sweep orders its events on. THETA_KEY by default.
+        void set_sweep_key(SWEEP_KEY key)
+        {
+            for (SweepWorkspaceSphere & workspace : workspaces) {workspace.sweep_key = key;}
+        }
+        
+        // The order the sweeps keep the sites in. INPUT_ORDER by default. The cap query and the observer see the sweep's order.
+        void set_site_order(SITE_ORDER order) {site_order = order;}
+        
+        // Only the one thread mode calls the observer. NULL turns it off.
+        void set_observer(ObserverSphere observe, void * data = NULL)
+        {
+            observer = observe;
+            observer_data = data;
+        }
+    
+    private:
+    
+        void generate_one_thread(std::vector<std::tuple<Real, Real, Real>> * verts, void (*render)(const VoronoiDiagramSphere &, const ArcSphere *, const std::vector<VoronoiCellSphere> *, Real), bool (*is_sleeping)(), VoronoiStatsSphere * stats);
+        
+        void generate_two_threads(std::vector<std::tuple<Real, Real, Real>> * verts, VoronoiStatsSphere * stats, PARTITION_MODE partition);
+        
+        void generate_four_threads(std::vector<std::tuple<Real, Real, Real>> * verts, VoronoiStatsSphere * stats, PARTITION_MODE partition);
+        
+        /*
+         *  Runs the bounded sweeps 0 to num_sweeps - 1 that were set up in sub_sweep_sites,
+         *  sub_sweep_bound_theta and sub_sweep_stats. Sweep 0 runs on the calling thread.
+         */
+        void run_sweeps(int num_sweeps);
+        
+        /*
+         *  Takes verts through the rotations in prepass_rotations into sweep_sites[0] to
+         *  sweep_sites[num_partitions - 1], split into num_jobs ranges of sites.
+         */
+        void run_prepass(std::vector<std::tuple<Real, Real, Real>> * verts, int num_partitions, int num_jobs);
+        
+        void run_sweep(int sweep);
+        
+        void run_prepass_range(int range);
+        
+        // Runs (this->*job)(0) on the calling thread and (this->*job)(i) on workers[i - 1] for i < num_jobs.
+        void run_jobs(void (VoronoiSphereGenerator::*job)(int), int num_jobs);
+        
+        void run_worker(int worker, unsigned long seen_generation);
+        
+        // Sorts the sites of verts into site_permutation by site_order.
+        void order_sites(std::vector<std::tuple<Real, Real, Real>> * verts);
+        
+        // Gives diagrams[0] back the caller's site indices.
+        void restore_site_order();
+        
+        SweepWorkspaceSphere workspaces[4];
+        
+        VoronoiDiagramSphere diagrams[4];
+        
+        SweepSitesSphere sweep_sites[4];
+        
+        std::unique_ptr<HullWorkspaceSphere> hull_workspace;
+        
+        std::vector<std::tuple<Real, Real, Real>> cap_verts;
+        
+        std::vector<PointCartesian> partition_sample;
+        
+        std::vector<Real> partition_angles;
+        
+        std::vector<unsigned int> cap_site_ids;
+        
+        SITE_ORDER site_order;
+        
+        // The index in verts of every site of the sweeps, and the sort keys that ordered them.
+        std::vector<unsigned int> site_permutation;
+        
+        std::vector<std::pair<Real, unsigned int>> site_keys;
+        
+        std::vector<PointCartesian> ordered_sites;
+        
+        SweepSitesSphere * sub_sweep_sites[4];
+        
+        Real sub_sweep_bound_theta[4];
+        
+        VoronoiStatsSphere * sub_sweep_stats[4];
+        
+        std::vector<std::tuple<Real, Real, Real>> * prepass_verts;
+        
+        // The index in prepass_verts of every swept site, or NULL for the same order.
+        const unsigned int * prepass_order;
+        
+        // NULL for no rotation.
+        const Real * prepass_rotations[4];
+        
+        Real prepass_rotation_storage[4][9];
+        
+        int num_prepass_partitions, num_prepass_ranges;
+        
+        bool normalize_sites;
+        
+        // Sweeps 1 to 3 run on workers[0] to workers[2], which wait for the next job.
+        std::thread workers[3];
+        
+        ObserverSphere observer;
+        
+        void * observer_data;
+        
+        int num_workers, num_jobs_running, num_jobs_left;
+        
+        void (VoronoiSphereGenerator::*worker_job)(int);
+        
+        unsigned long generation;
+        
+        bool is_stopping;
+        
+        std::mutex worker_mutex;
+        
+        std::condition_variable worker_condition;
+    };
+
+    VoronoiDiagramSphere generate_voronoi_one_thread(std::vector<std::tuple<Real, Real, Real>> * verts, void (*render)(const VoronoiDiagramSphere &, const ArcSphere *, const std::vector<VoronoiCellSphere> *, Real) = NULL, bool (*is_sleeping)() = NULL, VoronoiStatsSphere * stats = NULL);
+    
+    VoronoiDiagramSphere generate_voronoi_two_threads(std::vector<std::tuple<Real, Real, Real>> * verts, VoronoiStatsSphere * stats = NULL, PARTITION_MODE partition = FIXED_PARTITION);
+    
+    VoronoiDiagramSphere generate_voronoi_four_threads(std::vector<std::tuple<Real, Real, Real>> * verts, VoronoiStatsSphere * stats = NULL, PARTITION_MODE partition = FIXED_PARTITION);
+    
+    VoronoiDiagramSphere generate_voronoi_cap(std::vector<std::tuple<Real, Real, Real>> * verts, PointCartesian center, Real cap_radius, std::vector<unsigned int> * site_ids = NULL, VoronoiStatsSphere * stats = NULL);
+    
+    /*
+     *  Picks the axis and the angle from that axis of the seam for two threads.
+     *  rotation is a row major 3x3 matrix that takes the axis to the north pole.
+     *  sample_buffer and angles_buffer are scratch space the caller keeps, or NULL.
+     */
+    void balance_two_thread_partition(std::vector<std::tuple<Real, Real, Real>> * verts, Real rotation[9], Real & bound_theta, std::vector<PointCartesian> * sample_buffer = NULL, std::vector<Real> * angles_buffer = NULL);
+    
+    /*
+     *  Picks the rotation of the sites (row major 3x3) that leaves the fewest sites to sweep
+     *  in the fullest tetrahedron cap and in the caps on average, or the identity if none
+     *  does better. sample_buffer is scratch space the caller keeps, or NULL.
+     */
+    void balance_four_thread_partition(std::vector<std::tuple<Real, Real, Real>> * verts, Real rotation[9], std::vector<PointCartesian> * sample_buffer = NULL);
+    
+    /*
+     *  Sets rotation (row major 3x3) to a rotation that takes the unit vector axis to the north pole.
+     */
+    void rotation_to_pole(PointCartesian axis, Real rotation[9]);
+    
+    /*
+     *  The position of the unit vector p along a Hilbert curve drawn on each face of the cube
+     *  around the sphere, one face after another, so sites close on the curve are close on
+     *  the sphere.
+     */
+    unsigned long long sphere_curve_key(const PointCartesian & p);
+    
+    /*
+     *  What renumber_voronoi_diagram did. Entry i of every array is the old index of what
+     *  is now at index i, so a caller's per-site values can be moved with new[i] = old[sites[i]].
+     */
+    struct DiagramPermutationSphere
+    {
+        std::vector<unsigned int> sites, voronoi_vertices, voronoi_edges, delaunay_edges;
+    };
+    
+    /*
+     *  Renumbers voronoi_diagram so that things close on the sphere are close in memory: the
+     *  sites and the voronoi vertices go in the order of sphere_curve_key, and the voronoi and
+     *  delaunay edges in the order of their sites' new indices (voronoi edges without sites
+     *  in the order of their vertices'). Every index is changed to match. permutation, if
+     *  not NULL, is set to the permutations that were used.
+     */
+    void renumber_voronoi_diagram(VoronoiDiagramSphere * voronoi_diagram, DiagramPermutationSphere * permutation = NULL);
+        
+    /*
+     *  The sweep keeps its scratch memory in workspace, or in a workspace of its own if
+     *  workspace is NULL.
+     *  The sweep never goes past sweep_limit. Returns false if it had to stop there before
+     *  every site with theta < bound_theta was done.
+     */
+    bool compute_priority_queues(VoronoiDiagramSphere * voronoi_diagram, std::vector<std::tuple<Real, Real, Real>> * verts, Real bound_theta, VoronoiStatsSphere * stats = NULL, SweepWorkspaceSphere * workspace = NULL, Real sweep_limit = INFINITY);
+    
+    bool compute_priority_queues(VoronoiDiagramSphere * voronoi_diagram, const SweepSitesSphere * sites, Real bound_theta, VoronoiStatsSphere * stats = NULL, SweepWorkspaceSphere * workspace = NULL, Real sweep_limit = INFINITY);
+    
+    /*
+     *  The pre-pass of the sweeps, for the sites first to last - 1 of verts. Each site is
+     *  rescaled to unit length if normalize is set, then taken through rotations[k]
+     *  (row major 3x3, NULL for none) into partitions[k], which must already be sized
+     *  for verts. phi is worked out for every site, and theta too unless it is a DEPTH_KEY
+     *  sweep. The sites are handled in blocks with one array per coordinate so that the
+     *  rotations and the trig vectorize. If order is not NULL, site i of the partitions is
+     *  site order[i] of verts.
+     */
+    void prepare_sweep_sites(const std::vector<std::tuple<Real, Real, Real>> * verts, int num_partitions, const Real * const rotations[], SweepSitesSphere * partitions, bool normalize, size_t first, size_t last, SWEEP_KEY sweep_key = THETA_KEY, const unsigned int * order = NULL);
     
     void handle_site_event(VoronoiCellSphere cell, VoronoiDiagramSphere * voronoi_diagram, std::vector<VoronoiCellSphere> * cells, std::vector<HalfEdgeSphere> * half_edges, std::priority_queue<CircleEventSphere *, std::vector<CircleEventSphere *>, PriorityQueueCompare> * circle_event_queue_ptr, ArcSphere * & beach_head, Real sweep_line, Real sin_sweep_line, Real cos_sweep_line);
     
@@ -244,11 +811,18 @@ namespace Voronoi
     
     bool parabolic_intersection(PointSphere left, PointSphere right, Real & phi_intersection, ArcSphere * & beach_head, Real sweep_line, Real sin_sweep_line, Real cos_sweep_line);
     
-    inline PointSphere phi_to_point(PointSphere arc, Real phi, Real sweep_line, Real sin_sweep_line, Real cos_sweep_line);
+    PointSphere phi_to_point(PointSphere arc, Real phi, Real sweep_line, Real sin_sweep_line, Real cos_sweep_line);
     
     void check_circle_event(ArcSphere * arc, std::priority_queue<CircleEventSphere *, std::vector<CircleEventSphere *>, PriorityQueueCompare> * circle_event_queue_ptr, std::vector<VoronoiCellSphere> * cells);
     
-    inline void make_circle(PointSphere a, PointSphere b, PointSphere c, PointSphere & circumcenter, Real & lowest_theta);
+    void make_circle(PointSphere a, PointSphere b, PointSphere c, PointSphere & circumcenter, Real & lowest_theta);
+    
+    /*
+     *  make_circle for a DEPTH_KEY sweep. The circumcenter only has its Cartesian coordinates
+     *  and the lowest point comes from the sines and cosines of the circumcenter's theta and
+     *  the radius, which are all dot and cross products.
+     */
+    void make_circle_depth(PointSphere a, PointSphere b, PointSphere c, PointSphere & circumcenter, Real & lowest_depth);
     
     void add_half_edge_sphere(VoronoiDiagramSphere * voronoi_diagram, std::vector<VoronoiCellSphere> * cells, std::vector<HalfEdgeSphere> * half_edges, PointCartesian start, ArcSphere * left, ArcSphere * right);
     
@@ -264,9 +838,74 @@ namespace Voronoi
     
     ArcSphere * traverse_skiplist_to_site(ArcSphere * arc, Real phi, std::vector<VoronoiCellSphere> * cells);
     
+#ifdef VORONOI_RECORD_KERNELS
+    /*
+     *  When VORONOI_RECORD_KERNELS is defined the one thread sweep records the inputs
+     *  of its hot kernels into kernel_recording (unless it is NULL) so that the
+     *  micro_benchmark target can replay them and time each kernel on its own.
+     */
+    struct KernelRecording
+    {
+        struct CircleInput
+        {
+            PointSphere a, b, c;
+        };
+        
+        struct IntersectionInput
+        {
+            PointSphere left, right;
+            Real sweep_line, sin_sweep_line, cos_sweep_line;
+        };
+        
+        struct PhiToPointInput
+        {
+            PointSphere arc;
+            Real phi, sweep_line, sin_sweep_line, cos_sweep_line;
+        };
+        
+        std::vector<PointSphere> sites;
+        
+        std::vector<CircleInput> circles;
+        
+        std::vector<IntersectionInput> intersections;
+        
+        std::vector<PhiToPointInput> phi_to_points;
+        
+        // Cell indices of the beachline halfway through the site events, in order.
+        std::vector<unsigned int> beachline;
+        
+        // Phis looked up in the skiplist after the beachline was recorded.
+        std::vector<Real> traverse_phis;
+        
+        // Circle event queue operations. A push records the key, a pop records -1.
+        std::vector<Real> circle_queue_ops;
+    };
+    
+    extern KernelRecording * kernel_recording;
+    
+    // Makes the arc functions allocate from workspace on this thread, for replays outside a sweep.
+    void set_sweep_workspace(SweepWorkspaceSphere * workspace);
+#endif
+    
+#ifdef VORONOI_TRACE
+    /*
+     *  When VORONOI_TRACE is defined every sweep records spans for its phases, and the
+     *  two and four thread modes also record the rotation pre-pass, the wait on the
+     *  joins and the merge. write_trace saves the spans as a Chrome trace-event json
+     *  file that can be opened in chrome://tracing or Perfetto.
+     */
+    void clear_trace();
+    
+    bool write_trace(const char * path);
+#endif
+    
     inline std::tuple<Real, Real, Real> rotate_y(std::tuple<Real, Real, Real> point, Real sin_theta, Real cos_theta);
     
     inline std::tuple<Real, Real, Real> rotate_z(std::tuple<Real, Real, Real> point, Real sin_theta, Real cos_theta);
+    
+    std::tuple<Real, Real, Real> rotate(std::tuple<Real, Real, Real> point, const Real rotation[9]);
+    
+    std::tuple<Real, Real, Real> rotate_inverse(std::tuple<Real, Real, Real> point, const Real rotation[9]);
 }
 
 #endif /* VoronoiSphere_h */
\ No newline at end of file
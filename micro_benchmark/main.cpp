@@ -0,0 +1,295 @@
+//
+//  main.cpp
+//  micro_benchmark
+//
+//  Copyright © 2016 Ellis Sparky Hoag. All rights reserved.
+//
+
+/*
+ *  Usage: micro_benchmark [--sites N] [--seed S] [--min-time SECONDS]
+ *
+ *  Runs one real sweep with VORONOI_RECORD_KERNELS enabled and then replays the
+ *  recorded inputs through each hot kernel on its own. Every kernel reports
+ *  the time per call in nanoseconds and the throughput in millions of calls
+ *  per second. The recording hooks only cost anything in this target.
+ *
+ *  The accuracy of voronoi_math.h is checked by self_test instead.
+ */
+
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <cstdlib>
+#include <cstring>
+#include "voronoi_sphere.h"
+
+#ifndef VORONOI_RECORD_KERNELS
+#error "micro_benchmark needs voronoi_sphere.cpp to be compiled with VORONOI_RECORD_KERNELS"
+#endif
+
+using namespace std;
+using namespace Voronoi;
+
+double min_time = 0.2;
+
+// Keeps the optimizer from throwing away the kernel results.
+volatile Real sink;
+
+/*
+ *  Calls body(i) for every one of the num_calls recorded inputs, repeating the
+ *  whole recording until at least min_time seconds have passed.
+ */
+template <typename Body>
+void run_benchmark(const char * name, size_t num_calls, Body body)
+{
+    if (num_calls == 0)
+    {
+        cout << left << setw(28) << name << "no recorded calls\n";
+        return;
+    }
+
+    long total_calls = 0;
+    chrono::duration<double> elapsed(0);
+    auto start_time = chrono::steady_clock::now();
+
+    while (elapsed.count() < min_time)
+    {
+        for (size_t i = 0; i < num_calls; i++)
+        {
+            body(i);
+        }
+        total_calls += num_calls;
+        elapsed = chrono::steady_clock::now() - start_time;
+    }
+
+    double ns_per_call = 1e9 * elapsed.count() / total_calls;
+
+    cout << left << setw(28) << name << right << setw(10) << fixed << setprecision(2) << ns_per_call << " ns/call" << setw(12) << total_calls / elapsed.count() / 1e6 << " Mcalls/s  (" << num_calls << " recorded)\n";
+}
+
+// The voronoi_math.h functions against the C library on the same inputs.
+void benchmark_trig(mt19937_64 & rng)
+{
+    const size_t n = 1 << 16;
+    const size_t block = 256;
+    vector<double> angles(n), units(n), others(n), out(n);
+    uniform_real_distribution<double> unit(-1, 1);
+    for (size_t i = 0; i < n; i++)
+    {
+        angles[i] = M_PI * unit(rng);
+        units[i] = unit(rng);
+        others[i] = unit(rng);
+    }
+
+    run_benchmark("sin (libm)", n, [&](size_t i) {sink = sin(angles[i]);});
+    run_benchmark("fast_sin", n, [&](size_t i) {sink = fast_sin(angles[i]);});
+    run_benchmark("sin+cos (libm)", n, [&](size_t i) {sink = sin(angles[i]) + cos(angles[i]);});
+    run_benchmark("fast_sincos", n, [&](size_t i) {Real s, c; fast_sincos(angles[i], s, c); sink = s + c;});
+    run_benchmark("asin (libm)", n, [&](size_t i) {sink = asin(units[i]);});
+    run_benchmark("fast_asin", n, [&](size_t i) {sink = fast_asin(units[i]);});
+    run_benchmark("acos (libm)", n, [&](size_t i) {sink = acos(units[i]);});
+    run_benchmark("fast_acos", n, [&](size_t i) {sink = fast_acos(units[i]);});
+    run_benchmark("fast_acos (array)", n, [&](size_t i)
+    {
+        if (i % block == 0) {fast_acos(&units[i], &out[i], block);}
+    });
+    run_benchmark("atan2 (libm)", n, [&](size_t i) {sink = atan2(units[i], others[i]);});
+    run_benchmark("fast_atan2", n, [&](size_t i) {sink = fast_atan2(units[i], others[i]);});
+    run_benchmark("fast_atan2 (array)", n, [&](size_t i)
+    {
+        if (i % block == 0) {fast_atan2(&units[i], &others[i], &out[i], block);}
+    });
+    sink = out[n - 1];
+    cout << "\n";
+}
+
+int main(int argc, const char * argv[])
+{
+    int num_sites = 100000;
+    unsigned int seed = (unsigned int)time(NULL);
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 == argc) {break;}
+        else if (!strcmp(argv[i], "--sites")) {num_sites = atoi(argv[++i]);}
+        else if (!strcmp(argv[i], "--seed")) {seed = (unsigned int)atol(argv[++i]);}
+        else if (!strcmp(argv[i], "--min-time")) {min_time = atof(argv[++i]);}
+    }
+
+    mt19937_64 rng(seed);
+
+    cout << "Seed = " << seed << ", recording a sweep of " << num_sites << " sites.\n\n";
+
+    benchmark_trig(rng);
+    normal_distribution<Real> gaussian(0, 1);
+
+    vector<tuple<Real, Real, Real>> verts;
+    for (int i = 0; i < num_sites; i++)
+    {
+        Real x = gaussian(rng), y = gaussian(rng), z = gaussian(rng);
+        Real r = sqrt(x*x + y*y + z*z);
+        verts.push_back(make_tuple(x / r, y / r, z / r));
+    }
+
+    KernelRecording recording;
+    kernel_recording = &recording;
+    generate_voronoi(&verts, ONE_THREAD);
+    kernel_recording = NULL;
+
+    // make_circle
+    {
+        auto & inputs = recording.circles;
+        run_benchmark("make_circle", inputs.size(), [&](size_t i)
+        {
+            PointSphere circumcenter;
+            Real lowest_theta;
+            make_circle(inputs[i].a, inputs[i].b, inputs[i].c, circumcenter, lowest_theta);
+            sink = lowest_theta;
+        });
+        run_benchmark("make_circle_depth", inputs.size(), [&](size_t i)
+        {
+            PointSphere circumcenter;
+            Real lowest_depth;
+            make_circle_depth(inputs[i].a, inputs[i].b, inputs[i].c, circumcenter, lowest_depth);
+            sink = lowest_depth;
+        });
+    }
+
+    vector<VoronoiCellSphere> cells;
+    for (auto & site : recording.sites)
+    {
+        cells.push_back(VoronoiCellSphere(site, (int)cells.size()));
+    }
+
+    // The recorded beachline, rebuilt as a skiplist.
+    SweepWorkspaceSphere workspace;
+    workspace.reset();
+    workspace.cells = cells;
+    set_sweep_workspace(&workspace);
+    ArcSphere * beach_head = NULL;
+    auto build_beachline = [&]()
+    {
+        add_initial_arc_sphere(recording.beachline[0], beach_head);
+        for (size_t i = 1; i < recording.beachline.size(); i++)
+        {
+            add_arc_sphere(recording.beachline[i], beach_head->prev[0], beach_head, beach_head);
+        }
+    };
+    build_beachline();
+
+    // parabolic_intersection
+    {
+        auto & inputs = recording.intersections;
+        run_benchmark("parabolic_intersection", inputs.size(), [&](size_t i)
+        {
+            Real phi = 0;
+            parabolic_intersection(inputs[i].left, inputs[i].right, phi, beach_head, inputs[i].sweep_line, inputs[i].sin_sweep_line, inputs[i].cos_sweep_line);
+            sink = phi;
+        });
+    }
+
+    // phi_to_point
+    {
+        auto & inputs = recording.phi_to_points;
+        run_benchmark("phi_to_point", inputs.size(), [&](size_t i)
+        {
+            sink = phi_to_point(inputs[i].arc, inputs[i].phi, inputs[i].sweep_line, inputs[i].sin_sweep_line, inputs[i].cos_sweep_line).theta;
+        });
+    }
+
+    // traverse_skiplist_to_site
+    {
+        auto & inputs = recording.traverse_phis;
+        run_benchmark("traverse_skiplist_to_site", inputs.size(), [&](size_t i)
+        {
+            sink = traverse_skiplist_to_site(beach_head, inputs[i], &cells)->cell_idx;
+        });
+    }
+
+    // add_arc_sphere and remove_arc_sphere on the recorded beachline
+    {
+        long add_calls = 0, remove_calls = 0;
+        chrono::duration<double> add_time(0), remove_time(0);
+
+        while ((add_time + remove_time).count() < 2 * min_time)
+        {
+            while (beach_head->next[0] != beach_head)
+            {
+                remove_arc_sphere(beach_head->next[0], beach_head);
+            }
+            remove_arc_sphere(beach_head, beach_head);
+            beach_head = NULL;
+
+            auto start_time = chrono::steady_clock::now();
+            build_beachline();
+            add_time += chrono::steady_clock::now() - start_time;
+            add_calls += recording.beachline.size();
+
+            // Remove every other arc, like a run of circle events would.
+            start_time = chrono::steady_clock::now();
+            for (ArcSphere * arc = beach_head->next[0]; arc != beach_head && arc->next[0] != beach_head; arc = arc->next[0])
+            {
+                remove_arc_sphere(arc->next[0], beach_head);
+                remove_calls++;
+            }
+            remove_time += chrono::steady_clock::now() - start_time;
+        }
+
+        cout << left << setw(28) << "add_arc_sphere" << right << setw(10) << 1e9 * add_time.count() / add_calls << " ns/call" << setw(12) << add_calls / add_time.count() / 1e6 << " Mcalls/s  (" << recording.beachline.size() << " recorded)\n";
+        cout << left << setw(28) << "remove_arc_sphere" << right << setw(10) << 1e9 * remove_time.count() / remove_calls << " ns/call" << setw(12) << remove_calls / remove_time.count() / 1e6 << " Mcalls/s  (" << recording.beachline.size() / 2 << " recorded)\n";
+    }
+
+    while (beach_head->next[0] != beach_head)
+    {
+        remove_arc_sphere(beach_head->next[0], beach_head);
+    }
+    remove_arc_sphere(beach_head, beach_head);
+    set_sweep_workspace(NULL);
+
+    // Site event queue: push every site and pop them in sweep order.
+    {
+        priority_queue<VoronoiCellSphere, vector<VoronoiCellSphere>, PriorityQueueCompare> site_event_queue;
+        run_benchmark("site_event_queue push+pop", cells.size(), [&](size_t i)
+        {
+            site_event_queue.push(cells[i]);
+            if (i + 1 == cells.size())
+            {
+                while (!site_event_queue.empty())
+                {
+                    sink = site_event_queue.top().site.theta;
+                    site_event_queue.pop();
+                }
+            }
+        });
+    }
+
+    // Circle event queue: replay the recorded pushes and pops.
+    {
+        auto & ops = recording.circle_queue_ops;
+        vector<CircleEventSphere> events;
+        for (Real op : ops)
+        {
+            events.push_back(CircleEventSphere(NULL, PointSphere(), op));
+        }
+
+        priority_queue<CircleEventSphere *, vector<CircleEventSphere *>, PriorityQueueCompare> circle_event_queue;
+        run_benchmark("circle_event_queue op", ops.size(), [&](size_t i)
+        {
+            if (ops[i] >= 0)
+            {
+                circle_event_queue.push(&events[i]);
+            }
+            else if (!circle_event_queue.empty())
+            {
+                sink = circle_event_queue.top()->key;
+                circle_event_queue.pop();
+            }
+            if (i + 1 == ops.size())
+            {
+                while (!circle_event_queue.empty()) {circle_event_queue.pop();}
+            }
+        });
+    }
+
+    return 0;
+}
@@ -0,0 +1,300 @@
+//
+//  main.cpp
+//  self_test
+//
+//  Copyright © 2016 Ellis Sparky Hoag. All rights reserved.
+//
+
+/*
+ *  Usage: self_test [--seed S] [--samples N]
+ *
+ *  Checks the functions of voronoi_math.h against long double references on N random
+ *  inputs (10000000 by default), and the cell mesh of voronoi_mesh.h on random diagrams,
+ *  and exits with a non-zero status if anything fails. Builds with the same flags as
+ *  every other target, so it checks what ships. Nothing here needs a window or a GPU.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <vector>
+#include <ctime>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <algorithm>
+#include "voronoi_math.h"
+#include "voronoi_mesh.h"
+
+using namespace std;
+using namespace Voronoi;
+
+// The error of value in units in the last place of the correctly rounded reference.
+double ulp_error(double value, long double reference)
+{
+    double rounded = (double)reference;
+    if (std::isnan(value) || std::isnan(rounded))
+    {
+        return (std::isnan(value) == std::isnan(rounded)) ? 0 : INFINITY;
+    }
+    double ulp = (rounded == 0) ? numeric_limits<double>::denorm_min() : nextafter(fabs(rounded), INFINITY) - fabs(rounded);
+    return (double)(fabsl(value - reference) / ulp);
+}
+
+struct TrigCheck
+{
+    const char * name;
+    double bound;
+    double max_error;
+    double worst_input;
+
+    void add(double input, double value, long double reference)
+    {
+        double error = ulp_error(value, reference);
+        if (error > max_error)
+        {
+            max_error = error;
+            worst_input = input;
+        }
+    }
+};
+
+/*
+ *  Checks every function of voronoi_math.h on num_samples random inputs, with a third
+ *  of them scaled towards zero, plus the edges of each domain. The array versions
+ *  have to match the scalar ones exactly. Returns the number of failed checks.
+ */
+int check_trig(mt19937_64 & rng, long num_samples)
+{
+    TrigCheck checks[] = {{"fast_sin", 1, 0, 0}, {"fast_cos", 1, 0, 0}, {"fast_sincos", 1, 0, 0}, {"fast_asin", 1, 0, 0}, {"fast_acos", 1, 0, 0}, {"fast_atan2", 2, 0, 0}};
+
+    uniform_real_distribution<double> angle(-1e5, 1e5);
+    uniform_real_distribution<double> small_angle(-7, 7);
+    uniform_real_distribution<double> unit(-1, 1);
+
+    auto check_one = [&](double x, double u, double y)
+    {
+        checks[0].add(x, fast_sin(x), sinl(x));
+        checks[1].add(x, fast_cos(x), cosl(x));
+        double sin_x, cos_x;
+        fast_sincos(x, sin_x, cos_x);
+        checks[2].add(x, sin_x, sinl(x));
+        checks[2].add(x, cos_x, cosl(x));
+        checks[3].add(u, fast_asin(u), asinl(u));
+        checks[4].add(u, fast_acos(u), acosl(u));
+        checks[5].add(y, fast_atan2(y, u), atan2l(y, u));
+    };
+
+    for (long i = 0; i < num_samples; i++)
+    {
+        double x = (i % 2) ? small_angle(rng) : angle(rng);
+        double u = unit(rng);
+        double y = unit(rng);
+        if (i % 3 == 0)
+        {
+            u = ldexp(u, -(int)(i % 60));
+            y = ldexp(y, -(int)(i % 40));
+        }
+        check_one(x, u, y);
+    }
+
+    double edges[] = {0.0, -0.0, 0.5, -0.5, nextafter(0.5, 1), 1, -1, numeric_limits<double>::denorm_min(), M_PI, M_PI_2};
+    for (double a : edges)
+    {
+        for (double b : edges)
+        {
+            if (fabs(a) <= 1) {check_one(b, a, b);}
+        }
+    }
+
+    int num_failed = 0;
+
+    cout << "Checked " << num_samples << " random inputs against long double.\n\n";
+    for (TrigCheck & check : checks)
+    {
+        bool passed = check.max_error <= check.bound;
+        num_failed += !passed;
+        cout << left << setw(16) << check.name << right << setw(8) << fixed << setprecision(3) << check.max_error << " ulp (bound " << check.bound << ") worst at " << setprecision(17) << check.worst_input << (passed ? "" : "  FAILED") << "\n";
+    }
+
+    const size_t n = 4096;
+    vector<double> y(n), x(n), out(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        y[i] = unit(rng);
+        x[i] = (i % 2) ? unit(rng) : angle(rng);
+    }
+
+    auto check_array = [&](const char * name, function<void()> array_call, function<double(size_t)> scalar_call)
+    {
+        array_call();
+        size_t mismatches = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            double expected = scalar_call(i);
+            mismatches += memcmp(&out[i], &expected, sizeof(double)) != 0;
+        }
+        if (mismatches > 0)
+        {
+            cout << name << " array version differs from the scalar one at " << mismatches << " inputs  FAILED\n";
+            num_failed++;
+        }
+    };
+
+    check_array("fast_sin", [&]() {fast_sin(x.data(), out.data(), n);}, [&](size_t i) {return fast_sin(x[i]);});
+    check_array("fast_cos", [&]() {fast_cos(x.data(), out.data(), n);}, [&](size_t i) {return fast_cos(x[i]);});
+    check_array("fast_asin", [&]() {fast_asin(y.data(), out.data(), n);}, [&](size_t i) {return fast_asin(y[i]);});
+    check_array("fast_acos", [&]() {fast_acos(y.data(), out.data(), n);}, [&](size_t i) {return fast_acos(y[i]);});
+    check_array("fast_atan2", [&]() {fast_atan2(y.data(), x.data(), out.data(), n);}, [&](size_t i) {return fast_atan2(y[i], x[i]);});
+
+    return num_failed;
+}
+
+static inline double dot(double ax, double ay, double az, const MeshVertexSphere & b)
+{
+    return ax * b.x + ay * b.y + az * b.z;
+}
+
+/*
+ *  Lays out and writes the cell mesh of random diagrams from one and four threads and
+ *  checks that every cell has the vertices, triangles and lines layout_cell_mesh counted
+ *  for it, that every fan is counterclockwise seen from outside (up to float rounding), that there is exactly
+ *  one delaunay line per pair of neighbours, and that the flat triangles cover a little
+ *  less of the sphere as the cells get smaller. Returns the number of failed checks.
+ */
+int check_mesh(mt19937_64 & rng)
+{
+    int num_failed = 0;
+    double last_deficit[2] = {INFINITY, INFINITY};
+
+    cout << "\n";
+    for (unsigned int num_sites : {1000, 10000, 100000})
+    {
+        normal_distribution<Real> gaussian(0, 1);
+        vector<tuple<Real, Real, Real>> sites;
+        for (unsigned int i = 0; i < num_sites; i++)
+        {
+            Real x = gaussian(rng), y = gaussian(rng), z = gaussian(rng);
+            Real r = sqrt(x * x + y * y + z * z);
+            sites.push_back(make_tuple(x / r, y / r, z / r));
+        }
+
+        for (int mode = 0; mode < 2; mode++)
+        {
+            THREAD_NUMBER num_threads = mode ? FOUR_THREADS : ONE_THREAD;
+            vector<tuple<Real, Real, Real>> verts = sites;
+            VoronoiDiagramSphere diagram = generate_voronoi(&verts, num_threads);
+
+            CellMeshSphere mesh;
+            layout_cell_mesh(diagram, &mesh);
+            vector<MeshVertexSphere> vertices(mesh.num_vertices());
+            vector<unsigned int> triangles(mesh.num_triangle_indices()), voronoi_lines(mesh.num_line_indices()), delaunay_lines(mesh.num_line_indices());
+            write_cell_mesh(diagram, mesh, vertices.data(), triangles.data(), voronoi_lines.data(), delaunay_lines.data());
+
+            // Every cell has its site and a corner per neighbour, with one triangle per corner
+            // and a line per neighbour with a larger index, all tagged with the cell.
+            size_t bad_counts = 0, bad_lines = 0, clockwise = 0;
+            vector<pair<unsigned int, unsigned int>> neighbours;
+            vector<CellArcSphere> arcs;
+            for (unsigned int cell = 0; cell < num_sites; cell++)
+            {
+                find_cell_arcs(diagram, mesh.edge_start, mesh.cell_edges, cell, &arcs);
+                unsigned int num_corners = (unsigned int)arcs.size(), num_lines = 0;
+                for (const CellArcSphere & arc : arcs)
+                {
+                    if (arc.neighbour > cell)
+                    {
+                        neighbours.push_back(make_pair(cell, arc.neighbour));
+                        num_lines++;
+                    }
+                }
+
+                unsigned int first = mesh.vertex_start[cell], last = mesh.vertex_start[cell + 1];
+                bool is_ok = num_corners >= 3 && last - first == 1 + num_corners;
+                is_ok = is_ok && mesh.triangle_start[cell + 1] - mesh.triangle_start[cell] == num_corners;
+                is_ok = is_ok && mesh.line_start[cell + 1] - mesh.line_start[cell] == num_lines;
+                for (unsigned int v = first; is_ok && v < last; v++)
+                {
+                    is_ok = vertices[v].cell == cell;
+                }
+                bad_counts += !is_ok;
+            }
+
+            // Two corners closer than a few floats apart can be rounded either way round.
+            const double float_resolution = 4 * numeric_limits<float>::epsilon();
+            double area = 0;
+            for (size_t t = 0; t < triangles.size(); t += 3)
+            {
+                const MeshVertexSphere & center = vertices[triangles[t]];
+                const MeshVertexSphere & a = vertices[triangles[t + 1]];
+                const MeshVertexSphere & b = vertices[triangles[t + 2]];
+                double ux = a.x - center.x, uy = a.y - center.y, uz = a.z - center.z;
+                double vx = b.x - center.x, vy = b.y - center.y, vz = b.z - center.z;
+                double nx = uy * vz - uz * vy, ny = uz * vx - ux * vz, nz = ux * vy - uy * vx;
+                double wx = b.x - a.x, wy = b.y - a.y, wz = b.z - a.z;
+                clockwise += dot(nx, ny, nz, center) < 0 && wx * wx + wy * wy + wz * wz > float_resolution * float_resolution;
+                area += sqrt(nx * nx + ny * ny + nz * nz) / 2;
+            }
+
+            // The delaunay lines, as pairs of cells, have to be the neighbours, each once.
+            vector<pair<unsigned int, unsigned int>> lines;
+            for (size_t l = 0; l < delaunay_lines.size(); l += 2)
+            {
+                unsigned int a = vertices[delaunay_lines[l]].cell, b = vertices[delaunay_lines[l + 1]].cell;
+                bad_lines += delaunay_lines[l] != mesh.vertex_start[a] || delaunay_lines[l + 1] != mesh.vertex_start[b];
+                bad_lines += vertices[voronoi_lines[l]].cell != a || vertices[voronoi_lines[l + 1]].cell != a;
+                lines.push_back(make_pair(min(a, b), max(a, b)));
+            }
+            sort(lines.begin(), lines.end());
+            sort(neighbours.begin(), neighbours.end());
+            size_t num_repeated = lines.size() - (unique(lines.begin(), lines.end()) - lines.begin());
+
+            vector<pair<unsigned int, unsigned int>> edge_sites;
+            for (const Edge & edge : diagram.voronoi_edge_sites)
+            {
+                edge_sites.push_back(make_pair(min(edge.vidx[0], edge.vidx[1]), max(edge.vidx[0], edge.vidx[1])));
+            }
+            sort(edge_sites.begin(), edge_sites.end());
+            edge_sites.erase(unique(edge_sites.begin(), edge_sites.end()), edge_sites.end());
+            bool is_matched = num_repeated == 0 && lines.size() == neighbours.size() && equal(neighbours.begin(), neighbours.end(), lines.begin()) && neighbours == edge_sites;
+
+            // Flat triangles sit inside the sphere, and the more cells the closer they get.
+            double deficit = 4 * M_PI - area;
+            bool is_shrinking = deficit > 0 && deficit < last_deficit[mode] / 2;
+            last_deficit[mode] = deficit;
+
+            bool passed = bad_counts == 0 && clockwise == 0 && bad_lines == 0 && is_matched && is_shrinking;
+            num_failed += !passed;
+            cout << "cell mesh " << setw(6) << num_sites << " sites, " << num_threads << " thread(s): " << mesh.num_vertices() << " vertices, " << triangles.size() / 3 << " triangles, " << lines.size() << " lines, flat area 4 pi - " << scientific << setprecision(3) << deficit << fixed;
+            if (bad_counts > 0) {cout << ", " << bad_counts << " cells miscounted";}
+            if (clockwise > 0) {cout << ", " << clockwise << " clockwise triangles";}
+            if (bad_lines > 0) {cout << ", " << bad_lines << " lines on the wrong vertices";}
+            if (!is_matched) {cout << ", " << num_repeated << " repeated lines out of " << lines.size() << " for " << edge_sites.size() << " neighbours";}
+            if (!is_shrinking) {cout << ", area not closing in on 4 pi";}
+            cout << (passed ? "\n" : "  FAILED\n");
+        }
+    }
+
+    return num_failed;
+}
+
+int main(int argc, const char * argv[])
+{
+    unsigned int seed = (unsigned int)time(NULL);
+    long num_samples = 10000000;
+
+    for (int i = 1; i + 1 < argc; i++)
+    {
+        if (!strcmp(argv[i], "--seed")) {seed = (unsigned int)atol(argv[++i]);}
+        else if (!strcmp(argv[i], "--samples")) {num_samples = atol(argv[++i]);}
+    }
+
+    cout << "Seed = " << seed << ".\n";
+    mt19937_64 rng(seed);
+
+    int num_failed = check_trig(rng, num_samples);
+    num_failed += check_mesh(rng);
+    cout << ((num_failed == 0) ? "\nAll checks passed.\n" : "\nSome checks FAILED.\n");
+    return (num_failed == 0) ? 0 : 1;
+}
@@ -0,0 +1,40 @@
+//
+//  main.cpp
+//  shard_worker
+//
+//  Copyright © 2016 Ellis Sparky Hoag. All rights reserved.
+//
+
+/*
+ *  Usage: shard_worker PORT
+ *
+ *  Serves shard jobs for generate_voronoi_sharded on PORT. Start one on every
+ *  machine (or several on one machine with different ports) and hand their
+ *  "host:port" addresses to the coordinator.
+ */
+
+#include <iostream>
+#include <cstdlib>
+#include "voronoi_shard.h"
+
+using namespace std;
+using namespace Voronoi;
+
+int main(int argc, const char * argv[])
+{
+    if (argc != 2)
+    {
+        cerr << "Usage: shard_worker PORT\n";
+        return 1;
+    }
+
+    int port = atoi(argv[1]);
+    cout << "Serving shard jobs on port " << port << "\n";
+
+    if (!serve_shard_workers(port))
+    {
+        cerr << "Could not listen on port " << port << "\n";
+        return 1;
+    }
+    return 0;
+}
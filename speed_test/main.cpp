@@ -35,107 +35,525 @@
  *  Four threads: 0.311399
  */
 
+/*
+ *  Usage: speed_test [options]
+ *
+ *  --sites 1000,10000,...     Site counts to sweep (default 1k, 10k; larger ones only when asked for)
+ *  --max-sites N              Drop every site count above N
+ *  --dist uniform,clustered   Distributions to run (uniform, clustered, polar, fibonacci, near_duplicate;
+ *                             default all but near_duplicate)
+ *  --threads 1,2,4            Thread modes to run (default all of them)
+ *  --partition fixed|balanced How the two and four thread modes split the sphere (default fixed)
+ *  --engine sweep|hull|...    Which engine builds the diagrams (sweep, hull, incremental; default sweep)
+ *  --site-order ORDER         The order the sweep keeps the sites in (input, curve, sweep; default input)
+ *  --trials N                 Trials per configuration (default 20, or as many as make 200k sites
+ *                             if that is fewer)
+ *  --weak-sites N             Sites per thread for the weak scaling curve (default 10000, 0 for none).
+ *                             It always runs one thread as well, to scale against.
+ *  --seed S                   Seed for the random distributions (default time)
+ *  --json FILE                Where to write the report (default speed_test.json, "-" for stdout)
+ *  --trace FILE               Chrome trace of the last trial of every configuration
+ *                             (only when voronoi_sphere.cpp is built with VORONOI_TRACE)
+ *
+ *  Every trial is timed with steady_clock. The json report has one entry per
+ *  (distribution, sites, threads) with p50/p90/p99, sites per second and peak RSS,
+ *  followed by the strong and weak scaling curves. The strong scaling curve needs
+ *  one thread among --threads.
+ */
+
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <random>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <ctime>
+#include <cstdlib>
+#include <cmath>
+#include <cstring>
+#include <sys/resource.h>
 #include "voronoi_sphere.h"
 
 using namespace std;
 using namespace Voronoi;
 
-const int num_sites = 4000;
-const int num_trials = 100;
-
-int main(int argc, const char * argv[]) {
-    
-    srand((unsigned int)time(NULL));
-    
-    chrono::duration<float> total_time_one_thread;
-    chrono::duration<float> total_time_two_threads;
-    chrono::duration<float> total_time_four_threads;
-    
-    chrono::duration<float> max_trial_time_one_thread = chrono::duration<float>(0);
-    chrono::duration<float> max_trial_time_two_threads = chrono::duration<float>(0);
-    chrono::duration<float> max_trial_time_four_threads = chrono::duration<float>(0);
-    
-    chrono::time_point<chrono::system_clock> start_time;
-    chrono::duration<float> trial_time;
-    
-    for (int trial = 1; trial <= num_trials; trial++)
+// Unless --trials says otherwise, large inputs get fewer trials so that a full sweep still finishes.
+const int default_trials = 20;
+const long trial_site_budget = 200000;
+
+int trials_for(long num_sites, int num_trials)
+{
+    return (num_trials > 0) ? num_trials : (int)max(1L, min((long)default_trials, trial_site_budget / num_sites));
+}
+
+struct TrialResult
+{
+    string distribution;
+
+    int num_sites;
+
+    int num_threads;
+
+    int num_trials;
+
+    double p50, p90, p99, mean, max;
+
+    double sites_per_second;
+
+    long peak_rss_bytes;
+};
+
+enum DISTRIBUTION
+{
+    UNIFORM,
+    CLUSTERED,
+    POLAR,
+    FIBONACCI,
+    NEAR_DUPLICATE
+};
+
+const char * distribution_names[] = {"uniform", "clustered", "polar", "fibonacci", "near_duplicate"};
+
+tuple<Real, Real, Real> normalized(Real x, Real y, Real z)
+{
+    Real r = sqrt(x*x + y*y + z*z);
+    return make_tuple(x / r, y / r, z / r);
+}
+
+tuple<Real, Real, Real> random_point(mt19937_64 & rng)
+{
+    normal_distribution<Real> gaussian(0, 1);
+
+    Real x, y, z;
+    do
+    {
+        x = gaussian(rng);
+        y = gaussian(rng);
+        z = gaussian(rng);
+    } while (x*x + y*y + z*z < 1e-12);
+
+    return normalized(x, y, z);
+}
+
+void generate_sites(vector<tuple<Real, Real, Real>> & verts, DISTRIBUTION distribution, int num_sites, unsigned int seed)
+{
+    mt19937_64 rng(seed);
+    uniform_real_distribution<Real> unit(0, 1);
+    normal_distribution<Real> gaussian(0, 1);
+
+    verts.clear();
+    verts.reserve(num_sites);
+
+    switch (distribution)
+    {
+        case UNIFORM:
+            for (int i = 0; i < num_sites; i++)
+            {
+                verts.push_back(random_point(rng));
+            }
+            break;
+        case CLUSTERED:
+        {
+            // Population centers: a few dozen tight clusters over a sparse background.
+            const int num_clusters = 32;
+            const Real spread = 0.05;
+
+            vector<tuple<Real, Real, Real>> centers;
+            for (int i = 0; i < num_clusters; i++)
+            {
+                centers.push_back(random_point(rng));
+            }
+
+            for (int i = 0; i < num_sites; i++)
+            {
+                if (unit(rng) < 0.1)
+                {
+                    verts.push_back(random_point(rng));
+                    continue;
+                }
+
+                auto center = centers[rng() % num_clusters];
+                verts.push_back(normalized(get<0>(center) + spread * gaussian(rng), get<1>(center) + spread * gaussian(rng), get<2>(center) + spread * gaussian(rng)));
+            }
+            break;
+        }
+        case POLAR:
+            // Density grows towards both poles.
+            for (int i = 0; i < num_sites; i++)
+            {
+                Real u = unit(rng);
+                Real z = 1 - u * u * u;
+                if (rng() & 1) {z = -z;}
+
+                Real phi = 2 * M_PI * unit(rng);
+                Real r = sqrt(max<Real>(0, 1 - z * z));
+
+                verts.push_back(normalized(r * cos(phi), r * sin(phi), z));
+            }
+            break;
+        case FIBONACCI:
+        {
+            const Real golden_angle = M_PI * (3 - sqrt(5.0));
+            for (int i = 0; i < num_sites; i++)
+            {
+                Real z = 1 - (2 * i + 1) / (Real)num_sites;
+                Real r = sqrt(max<Real>(0, 1 - z * z));
+                Real phi = golden_angle * i;
+
+                verts.push_back(make_tuple(r * cos(phi), r * sin(phi), z));
+            }
+            break;
+        }
+        case NEAR_DUPLICATE:
+            // Half of the sites have a twin a few micro radians away.
+            for (int i = 0; i < num_sites; i++)
+            {
+                if (i % 2 == 1)
+                {
+                    auto twin = verts.back();
+                    const Real jitter = 1e-6;
+                    verts.push_back(normalized(get<0>(twin) + jitter * gaussian(rng), get<1>(twin) + jitter * gaussian(rng), get<2>(twin) + jitter * gaussian(rng)));
+                }
+                else
+                {
+                    verts.push_back(random_point(rng));
+                }
+            }
+            break;
+    }
+}
+
+void reset_peak_rss()
+{
+#ifdef __linux__
+    // Writing 5 to clear_refs resets the peak RSS high water mark.
+    ofstream clear_refs("/proc/self/clear_refs");
+    if (clear_refs) {clear_refs << "5";}
+#endif
+}
+
+long peak_rss_bytes()
+{
+#ifdef __linux__
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line))
+    {
+        if (line.compare(0, 6, "VmHWM:") == 0)
+        {
+            return atol(line.c_str() + 6) * 1024;
+        }
+    }
+#endif
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return (long)usage.ru_maxrss;
+#else
+    return (long)usage.ru_maxrss * 1024;
+#endif
+}
+
+double percentile(const vector<double> & sorted_times, double p)
+{
+    // Nearest rank
+    int rank = (int)ceil(p * sorted_times.size()) - 1;
+    return sorted_times[min(max(rank, 0), (int)sorted_times.size() - 1)];
+}
+
+PARTITION_MODE partition_mode = FIXED_PARTITION;
+
+ENGINE_MODE engine_mode = SWEEP_ENGINE;
+
+SITE_ORDER site_order = INPUT_ORDER;
+
+const char * site_order_names[] = {"input", "curve", "sweep"};
+
+TrialResult run_trials(DISTRIBUTION distribution, int num_sites, THREAD_NUMBER num_threads, int num_trials, unsigned int seed)
+{
+    TrialResult result;
+    result.distribution = distribution_names[distribution];
+    result.num_sites = num_sites;
+    result.num_threads = num_threads;
+    result.num_trials = num_trials;
+
+    vector<double> times;
+    vector<tuple<Real, Real, Real>> verts;
+
+    // Every trial reuses the buffers of the ones before it, like a service would.
+    VoronoiSphereGenerator generator;
+    generator.set_site_order(site_order);
+
+    reset_peak_rss();
+
+    for (int trial = 0; trial < num_trials; trial++)
+    {
+        // The fibonacci lattice is the same every trial, the random ones are not.
+        generate_sites(verts, distribution, num_sites, seed + trial);
+
+#ifdef VORONOI_TRACE
+        clear_trace();
+#endif
+
+        auto start_time = chrono::steady_clock::now();
+
+        generator.generate_voronoi(&verts, num_threads, NULL, NULL, NULL, partition_mode, engine_mode);
+
+        chrono::duration<double> trial_time = chrono::steady_clock::now() - start_time;
+
+        times.push_back(trial_time.count());
+    }
+
+    result.peak_rss_bytes = peak_rss_bytes();
+
+    sort(times.begin(), times.end());
+
+    double total = 0;
+    for (double t : times) {total += t;}
+
+    result.p50 = percentile(times, 0.5);
+    result.p90 = percentile(times, 0.9);
+    result.p99 = percentile(times, 0.99);
+    result.mean = total / times.size();
+    result.max = times.back();
+    result.sites_per_second = num_sites / result.p50;
+
+    return result;
+}
+
+void write_result(ostream & out, const TrialResult & r)
+{
+    out << "{\"distribution\": \"" << r.distribution << "\", \"sites\": " << r.num_sites << ", \"threads\": " << r.num_threads << ", \"trials\": " << r.num_trials;
+    out << ", \"p50_s\": " << r.p50 << ", \"p90_s\": " << r.p90 << ", \"p99_s\": " << r.p99 << ", \"mean_s\": " << r.mean << ", \"max_s\": " << r.max;
+    out << ", \"sites_per_second\": " << r.sites_per_second << ", \"peak_rss_bytes\": " << r.peak_rss_bytes << "}";
+}
+
+vector<long> parse_list(const char * arg)
+{
+    vector<long> values;
+    stringstream stream(arg);
+    string item;
+    while (getline(stream, item, ','))
+    {
+        values.push_back(atol(item.c_str()));
+    }
+    return values;
+}
+
+int main(int argc, const char * argv[])
+{
+    // The defaults finish in about a minute. Larger inputs and near_duplicate have to be asked for.
+    vector<long> site_counts = {1000, 10000};
+    vector<DISTRIBUTION> distributions = {UNIFORM, CLUSTERED, POLAR, FIBONACCI};
+    vector<THREAD_NUMBER> thread_modes = {ONE_THREAD, TWO_THREADS, FOUR_THREADS};
+    long max_sites = 0;
+    int num_trials = 0;
+    int weak_sites = 10000;
+    unsigned int seed = (unsigned int)time(NULL);
+    string json_path = "speed_test.json";
+    string trace_path;
+
+    for (int i = 1; i < argc; i++)
     {
-        unsigned int seed = rand();
-        
-        srand(seed);
-        
-        cout << trial << ") Seed = " << seed << endl;
-        
-        vector<tuple<double, double, double>> verts;
-        
-        const int precision = numeric_limits<int>::max();
-        for (int i = 0; i < num_sites; i++)
-        {
-            double x = (rand() % precision) / (double)precision - 0.5f;
-            double y = (rand() % precision) / (double)precision - 0.5f;
-            double z = (rand() % precision) / (double)precision - 0.5f;
-            
-            double r = sqrt(x*x + y*y + z*z);
-            
-            tuple<double, double, double> point = make_tuple(x / r, y / r, z / r);
-            
-            verts.push_back(point);
-        }
-
-        start_time = chrono::system_clock::now();
-        
-        generate_voronoi(&verts, ONE_THREAD);
-        
-        trial_time = chrono::system_clock::now() - start_time;
-        
-        total_time_one_thread += trial_time;
-        
-        if (trial_time > max_trial_time_one_thread)
-        {
-            max_trial_time_one_thread = trial_time;
-        }
-
-        start_time = chrono::system_clock::now();
-        
-        generate_voronoi(&verts, TWO_THREADS);
-        
-        trial_time = chrono::system_clock::now() - start_time;
-        
-        total_time_two_threads += trial_time;
-        
-        if (trial_time > max_trial_time_two_threads)
-        {
-            max_trial_time_two_threads = trial_time;
-        }
-
-        start_time = chrono::system_clock::now();
-        
-        generate_voronoi(&verts, FOUR_THREADS);
-        
-        trial_time = chrono::system_clock::now() - start_time;
-        
-        total_time_four_threads += trial_time;
-        
-        if (trial_time > max_trial_time_four_threads)
-        {
-            max_trial_time_four_threads = trial_time;
+        bool has_value = i + 1 < argc;
+
+        if (!strcmp(argv[i], "--sites") && has_value)
+        {
+            site_counts = parse_list(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--max-sites") && has_value)
+        {
+            max_sites = atol(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--dist") && has_value)
+        {
+            distributions.clear();
+            stringstream stream(argv[++i]);
+            string item;
+            while (getline(stream, item, ','))
+            {
+                for (int d = UNIFORM; d <= NEAR_DUPLICATE; d++)
+                {
+                    if (item == distribution_names[d]) {distributions.push_back((DISTRIBUTION)d);}
+                }
+            }
+        }
+        else if (!strcmp(argv[i], "--threads") && has_value)
+        {
+            thread_modes.clear();
+            for (long t : parse_list(argv[++i]))
+            {
+                if (t == ONE_THREAD || t == TWO_THREADS || t == FOUR_THREADS) {thread_modes.push_back((THREAD_NUMBER)t);}
+            }
+        }
+        else if (!strcmp(argv[i], "--partition") && has_value)
+        {
+            partition_mode = strcmp(argv[++i], "balanced") ? FIXED_PARTITION : BALANCED_PARTITION;
+        }
+        else if (!strcmp(argv[i], "--engine") && has_value)
+        {
+            const char * name = argv[++i];
+            engine_mode = !strcmp(name, "hull") ? HULL_ENGINE : (!strcmp(name, "incremental") ? INCREMENTAL_ENGINE : SWEEP_ENGINE);
+        }
+        else if (!strcmp(argv[i], "--site-order") && has_value)
+        {
+            const char * name = argv[++i];
+            site_order = !strcmp(name, "curve") ? CURVE_ORDER : (!strcmp(name, "sweep") ? SWEEP_ORDER : INPUT_ORDER);
+        }
+        else if (!strcmp(argv[i], "--trials") && has_value)
+        {
+            num_trials = max(1, atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--weak-sites") && has_value)
+        {
+            weak_sites = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--seed") && has_value)
+        {
+            seed = (unsigned int)atol(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--json") && has_value)
+        {
+            json_path = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--trace") && has_value)
+        {
+            trace_path = argv[++i];
+        }
+        else
+        {
+            cout << "Unknown option " << argv[i] << "\n";
+            return 1;
         }
     }
-    
-    cout << "\nGenerated " << num_trials << " voronoi diagrams with " << num_sites << " sites.\n";
-    cout << "One thread:\n";
-    cout << "Total time = " << total_time_one_thread.count() << " seconds.\n";
-    cout << "Average = " << total_time_one_thread.count() / num_trials << " seconds.\n";
-    cout << "Max = " << max_trial_time_one_thread.count() << " seconds.\n\n";
-    cout << "Two threads:\n";
-    cout << "Total time = " << total_time_two_threads.count() << " seconds.\n";
-    cout << "Average = " << total_time_two_threads.count() / num_trials << " seconds.\n";
-    cout << "Max = " << max_trial_time_two_threads.count() << " seconds.\n\n";
-    cout << "Four threads:\n";
-    cout << "Total time = " << total_time_four_threads.count() << " seconds.\n";
-    cout << "Average = " << total_time_four_threads.count() / num_trials << " seconds.\n";
-    cout << "Max = " << max_trial_time_four_threads.count() << " seconds.\n\n";
-        
+
+    if (max_sites > 0)
+    {
+        site_counts.erase(remove_if(site_counts.begin(), site_counts.end(), [=](long n) {return n > max_sites;}), site_counts.end());
+    }
+
+    cout << "Seed = " << seed << endl;
+
+    vector<TrialResult> results;
+
+    for (auto distribution : distributions)
+    {
+        for (long num_sites : site_counts)
+        {
+            int trials = trials_for(num_sites, num_trials);
+
+            for (auto num_threads : thread_modes)
+            {
+                TrialResult result = run_trials(distribution, (int)num_sites, num_threads, trials, seed);
+                results.push_back(result);
+
+#ifdef VORONOI_TRACE
+                if (!trace_path.empty())
+                {
+                    stringstream path;
+                    path << trace_path << "." << result.distribution << "." << num_sites << "." << num_threads << ".json";
+                    write_trace(path.str().c_str());
+                }
+#endif
+
+                cout << result.distribution << ", " << num_sites << " sites, " << num_threads << " thread(s): p50 = " << result.p50 << " s, p99 = " << result.p99 << " s, " << result.sites_per_second << " sites/s\n";
+            }
+        }
+    }
+
+    // Strong scaling needs one thread on every input, which can be large, so that is not forced.
+    if (find(thread_modes.begin(), thread_modes.end(), ONE_THREAD) == thread_modes.end())
+    {
+        cout << "No one thread runs to compare against, so the strong scaling curve is empty. Add 1 to --threads for it.\n";
+    }
+
+    // Weak scaling keeps the number of sites per thread fixed. One thread is the baseline,
+    // so it is run even if it was left out of --threads.
+    vector<TrialResult> weak_results;
+    vector<THREAD_NUMBER> weak_thread_modes = thread_modes;
+    if (find(weak_thread_modes.begin(), weak_thread_modes.end(), ONE_THREAD) == weak_thread_modes.end())
+    {
+        weak_thread_modes.insert(weak_thread_modes.begin(), ONE_THREAD);
+    }
+
+    if (weak_sites > 0)
+    {
+        for (auto distribution : distributions)
+        {
+            for (auto num_threads : weak_thread_modes)
+            {
+                int num_sites = weak_sites * num_threads;
+                int trials = trials_for(num_sites, num_trials);
+                weak_results.push_back(run_trials(distribution, num_sites, num_threads, trials, seed));
+            }
+        }
+    }
+
+    ofstream json_file;
+    if (json_path != "-")
+    {
+        json_file.open(json_path);
+        if (!json_file)
+        {
+            cout << "Could not open " << json_path << "\n";
+            return 1;
+        }
+    }
+    ostream & json = (json_path == "-") ? cout : json_file;
+
+    json << setprecision(9);
+    json << "{\n  \"seed\": " << seed << ",\n  \"hardware_threads\": " << thread::hardware_concurrency() << ",\n";
+    json << "  \"partition\": \"" << (partition_mode == BALANCED_PARTITION ? "balanced" : "fixed") << "\",\n";
+    json << "  \"engine\": \"" << (engine_mode == HULL_ENGINE ? "hull" : (engine_mode == INCREMENTAL_ENGINE ? "incremental" : "sweep")) << "\",\n";
+    json << "  \"site_order\": \"" << site_order_names[site_order] << "\",\n";
+
+    json << "  \"results\": [";
+    for (int i = 0; i < results.size(); i++)
+    {
+        json << (i ? ",\n    " : "\n    ");
+        write_result(json, results[i]);
+    }
+    json << "\n  ],\n";
+
+    // Strong scaling is the speedup of each thread mode over one thread for the same input.
+    json << "  \"strong_scaling\": [";
+    bool first = true;
+    for (auto & one : results)
+    {
+        if (one.num_threads != ONE_THREAD) {continue;}
+
+        for (auto & other : results)
+        {
+            if (other.distribution != one.distribution || other.num_sites != one.num_sites) {continue;}
+
+            double speedup = one.p50 / other.p50;
+            json << (first ? "\n    " : ",\n    ");
+            json << "{\"distribution\": \"" << one.distribution << "\", \"sites\": " << one.num_sites << ", \"threads\": " << other.num_threads << ", \"speedup\": " << speedup << ", \"efficiency\": " << speedup / other.num_threads << "}";
+            first = false;
+        }
+    }
+    json << "\n  ],\n";
+
+    json << "  \"weak_scaling\": [";
+    first = true;
+    for (auto & one : weak_results)
+    {
+        if (one.num_threads != ONE_THREAD) {continue;}
+
+        for (auto & other : weak_results)
+        {
+            if (other.distribution != one.distribution) {continue;}
+
+            json << (first ? "\n    " : ",\n    ");
+            json << "{\"distribution\": \"" << one.distribution << "\", \"sites_per_thread\": " << weak_sites << ", \"threads\": " << other.num_threads << ", \"sites\": " << other.num_sites << ", \"p50_s\": " << other.p50 << ", \"efficiency\": " << one.p50 / other.p50 << "}";
+            first = false;
+        }
+    }
+    json << "\n  ]\n}\n";
+
     return 0;
 }